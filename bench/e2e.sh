@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# e2e.sh -- end-to-end benchmark of gsmMuxd against the modem emulator
+#
+# Runs gsmMuxd on a pty of bench/gsmModem for every frame size and number
+# of channels, drives all virtual ports at once by bench/gsmLoad and prints
+# a row of results for each. Needs no modem and no root, run from the top
+# directory after make e2e or by it. The settings are taken from the
+# environment:
+#
+#   FRAMES    frame sizes for gsmMuxd -f ["31 127 512 1500"]
+#   CHANNELS  numbers of channels ["1 2 4 8"]
+#   DURATION  seconds per run [5]
+#   MESSAGE   message size of gsmLoad [64]
+#   WINDOW    data in flight per channel [4096]
+#   BAUD      pacing of the emulated UART, 0 for none [0]
+#   DELAY     delay of every frame of the modem in microseconds [0]
+#   MUXARGS   further options of gsmMuxd, e.g. -t or -a []
+#
+
+FRAMES=${FRAMES:-"31 127 512 1500"}
+CHANNELS=${CHANNELS:-"1 2 4 8"}
+DURATION=${DURATION:-5}
+MESSAGE=${MESSAGE:-64}
+WINDOW=${WINDOW:-4096}
+BAUD=${BAUD:-0}
+DELAY=${DELAY:-0}
+MUXARGS=${MUXARGS:-}
+
+MUXD=./gsmMuxd
+MODEM=bench/gsmModem
+LOAD=bench/gsmLoad
+
+for p in $MUXD $MODEM $LOAD; do
+	if [ ! -x $p ]; then
+		echo "$p not found, run make e2e" >&2
+		exit 1
+	fi
+done
+
+DIR=$(mktemp -d /tmp/gsmbench.XXXXXX) || exit 1
+modem_pid=
+mux_pid=
+
+stop() {
+	[ -n "$mux_pid" ] && kill $mux_pid 2>/dev/null && wait $mux_pid 2>/dev/null
+	[ -n "$modem_pid" ] && kill $modem_pid 2>/dev/null \
+		&& wait $modem_pid 2>/dev/null
+	mux_pid=
+	modem_pid=
+}
+
+trap 'stop; rm -rf $DIR; exit 1' INT TERM
+trap 'stop; rm -rf $DIR' EXIT
+
+# Waits for a file to appear, $2 tenths of a second at most
+wait_for() {
+	i=0
+	while [ ! -e $1 ]; do
+		i=$((i + 1))
+		[ $i -gt $2 ] && return 1
+		sleep 0.1
+	done
+	return 0
+}
+
+echo "gsmMuxd${MUXARGS:+ $MUXARGS}, $MESSAGE byte messages, window $WINDOW," \
+	"baud $BAUD, frame delay $DELAY us, $DURATION s per run"
+printf "%6s %8s %10s %8s %8s %8s %10s %6s\n" frame channels KB/s \
+	p50_us p99_us p999_us cpu_ns/B errors
+
+for f in $FRAMES; do
+	for n in $CHANNELS; do
+		$MODEM -b $BAUD -D $DELAY $DIR/modem &
+		modem_pid=$!
+		if ! wait_for $DIR/modem 50; then
+			echo "The modem emulator didn't start" >&2
+			exit 1
+		fi
+		ptys=
+		ports=
+		i=0
+		while [ $i -lt $n ]; do
+			ptys="$ptys /dev/ptmx"
+			ports="$ports $DIR/mux$i"
+			i=$((i + 1))
+		done
+		$MUXD -d -p $DIR/modem -f $f $MUXARGS -s $DIR/mux $ptys \
+			>$DIR/gsmMuxd.log 2>&1 &
+		mux_pid=$!
+		# the channels are opened one per second
+		if ! wait_for $DIR/mux$((n - 1)) $((10 * n + 50)); then
+			echo "gsmMuxd didn't start, see its log:" >&2
+			tail $DIR/gsmMuxd.log >&2
+			exit 1
+		fi
+		printf "%6d %8d " $f $n
+		# the row is printed unless the channels didn't answer at all
+		$LOAD -q -t $DURATION -m $MESSAGE -w $WINDOW -p $mux_pid $ports
+		[ $? -eq 1 ] && echo
+		stop
+		rm -f $DIR/modem $DIR/mux*
+	done
+done
@@ -0,0 +1,353 @@
+/*
+ * load.c -- drives virtual ports of gsmMuxd connected to a loopback modem
+ *           and measures throughput, latency and CPU time per byte
+ *
+ * Every channel keeps a window of timestamped, numbered messages in
+ * flight and checks what comes back.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <termios.h>
+#include <time.h>
+
+#define MAX_CHANNELS 32
+#define MESSAGE_MAX 4096
+#define WARM_UP_TIMEOUT 10000000000LL // nanoseconds
+
+// starts every message, the rest is a pattern derived from seq
+typedef struct Header {
+	uint64_t sent; // CLOCK_MONOTONIC in nanoseconds
+	uint32_t seq;
+	uint32_t channel;
+} Header;
+
+typedef struct Channel {
+	int fd;
+	char out[MESSAGE_MAX]; // the message being written
+	int out_length, out_done;
+	char in[MESSAGE_MAX];  // the message being received
+	int in_length;
+	uint32_t tx_seq, rx_seq;
+	long in_flight; // characters
+} Channel;
+
+static Channel channels[MAX_CHANNELS];
+static int numOfChannels;
+static int message_size = 64;
+static long window = 4096;
+static long long *samples;
+static long numOfSamples, maxSamples;
+static unsigned long long received;
+static unsigned long errors;
+static int sampling;
+
+static long long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Tells the CPU time of all threads of a process from schedstat
+ *
+ * RETURNS:
+ * nanoseconds or -1, if the process isn't found
+ */
+static long long cpu_ns(int pid) {
+	char path[300];
+	unsigned long long t, total = 0;
+	struct dirent *e;
+	DIR *dir;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	if (!(dir = opendir(path)))
+		return -1;
+	while ((e = readdir(dir))) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/schedstat", pid,
+				e->d_name);
+		if ((f = fopen(path, "r"))) {
+			if (fscanf(f, "%llu", &t) == 1)
+				total += t;
+			fclose(f);
+		}
+	}
+	closedir(dir);
+	return total;
+}
+
+static void make_message(Channel *c, int channel) {
+	Header h;
+	int i;
+
+	h.sent = now_ns();
+	h.seq = c->tx_seq++;
+	h.channel = channel;
+	memcpy(c->out, &h, sizeof(h));
+	for (i = sizeof(h); i < message_size; i++)
+		c->out[i] = h.seq + i;
+	c->out_length = message_size;
+	c->out_done = 0;
+}
+
+static void check_message(Channel *c, int channel, long long now) {
+	Header h;
+	int i;
+
+	memcpy(&h, c->in, sizeof(h));
+	if (h.seq != c->rx_seq || h.channel != channel)
+		errors++;
+	for (i = sizeof(h); i < message_size; i++)
+		if (c->in[i] != (char) (h.seq + i)) {
+			errors++;
+			break;
+		}
+	c->rx_seq = h.seq + 1;
+	if (!sampling)
+		return;
+	if (numOfSamples == maxSamples) {
+		maxSamples = maxSamples ? 2 * maxSamples : 65536;
+		if (!(samples = realloc(samples, maxSamples * sizeof(long long)))) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	samples[numOfSamples++] = now - h.sent;
+}
+
+// Reads what a channel has looped back, returns 0 when it would block
+static int receive(Channel *c, int channel, long long now) {
+	int n;
+
+	if ((n = read(c->fd, c->in + c->in_length, message_size - c->in_length))
+			<= 0)
+		return 0;
+	c->in_length += n;
+	c->in_flight -= n;
+	if (sampling)
+		received += n;
+	if (c->in_length == message_size) {
+		check_message(c, channel, now);
+		c->in_length = 0;
+	}
+	return n;
+}
+
+/* Sends a message through every channel and waits for all of them, as
+ * the first ones take the setup of the channels in gsmMuxd and the modem
+ *
+ * RETURNS:
+ * 0 on success, -1 on a timeout
+ */
+static int warm_up() {
+	struct pollfd fds[MAX_CHANNELS];
+	long long deadline = now_ns() + WARM_UP_TIMEOUT;
+	int i, pending;
+	Channel *c;
+
+	for (i = 0; i < numOfChannels; i++) {
+		c = &channels[i];
+		make_message(c, i);
+		if (write(c->fd, c->out, message_size) != message_size)
+			return -1;
+		c->out_done = c->out_length;
+		c->in_flight = message_size;
+		fds[i].fd = c->fd;
+		fds[i].events = POLLIN;
+	}
+	do {
+		for (i = 0, pending = 0; i < numOfChannels; i++)
+			pending += channels[i].in_flight > 0;
+		if (pending == 0)
+			return 0;
+		if (poll(fds, numOfChannels, 100) > 0)
+			for (i = 0; i < numOfChannels; i++)
+				if (fds[i].revents & POLLIN)
+					while (receive(&channels[i], i, now_ns()) > 0)
+						;
+	} while (now_ns() < deadline);
+	return -1;
+}
+
+static int compare(const void *a, const void *b) {
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static long long percentile(double p) {
+	long i = (long) (p * numOfSamples);
+
+	return numOfSamples ? samples[i < numOfSamples ? i : numOfSamples - 1]
+			: 0;
+}
+
+static void usage(char *name) {
+	fprintf(stderr, "\nUsage: %s [options] <tty> ...\n", name);
+	fprintf(stderr,
+			"  <tty>               : virtual ports of gsmMuxd, looped back by\n"
+			"                        the modem\n\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -t <seconds>        : Duration [5]\n");
+	fprintf(stderr, "  -m <size>           : Message size [64]\n");
+	fprintf(stderr,
+			"  -w <bytes>          : Data in flight per channel [4096]\n");
+	fprintf(stderr,
+			"  -p <pid>            : Report CPU time of this process per byte\n");
+	fprintf(stderr,
+			"  -q                  : Print the results as one line of numbers\n");
+}
+
+int main(int argc, char *argv[]) {
+	struct pollfd fds[MAX_CHANNELS];
+	struct termios options;
+	long long start, end, now, cpu_start = -1, cpu_end = -1;
+	double seconds, cpu_per_byte = 0;
+	int opt, i, n, pid = 0, quiet = 0, duration = 5;
+	Channel *c;
+
+	while ((opt = getopt(argc, argv, "t:m:w:p:qh")) > 0) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'm':
+			message_size = atoi(optarg);
+			break;
+		case 'w':
+			window = atol(optarg);
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (message_size < sizeof(Header) || message_size > MESSAGE_MAX
+			|| window < message_size || optind == argc
+			|| argc - optind > MAX_CHANNELS) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = optind; i < argc; i++) {
+		c = &channels[numOfChannels];
+		if ((c->fd = open(argv[i], O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+			perror(argv[i]);
+			return 1;
+		}
+		// no echo or line editing by the pty
+		tcgetattr(c->fd, &options);
+		cfmakeraw(&options);
+		tcsetattr(c->fd, TCSANOW, &options);
+		tcflush(c->fd, TCIOFLUSH);
+		fds[numOfChannels].fd = c->fd;
+		numOfChannels++;
+	}
+
+	if (warm_up() != 0) {
+		fprintf(stderr, "No reply from all channels\n");
+		return 1;
+	}
+	sampling = 1;
+	if (pid)
+		cpu_start = cpu_ns(pid);
+	start = now_ns();
+	end = start + duration * 1000000000LL;
+	// stop sending at the end and wait a moment for the rest
+	for (now = start; now < end + 1000000000LL; now = now_ns()) {
+		for (i = 0, n = 0; i < numOfChannels; i++) {
+			c = &channels[i];
+			fds[i].events = POLLIN;
+			if (c->out_done < c->out_length || (now < end
+					&& c->in_flight + message_size <= window)) {
+				fds[i].events |= POLLOUT;
+				n++;
+			} else if (c->in_flight > 0) {
+				n++;
+			}
+		}
+		if (n == 0 && now >= end)
+			break;
+		if (poll(fds, numOfChannels, 100) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+		now = now_ns();
+		for (i = 0; i < numOfChannels; i++) {
+			c = &channels[i];
+			while (fds[i].revents & POLLOUT) {
+				if (c->out_done == c->out_length) {
+					if (now >= end || c->in_flight + message_size > window)
+						break;
+					make_message(c, i);
+					c->in_flight += message_size;
+				}
+				if ((n = write(c->fd, c->out + c->out_done,
+						c->out_length - c->out_done)) <= 0)
+					break;
+				c->out_done += n;
+			}
+			if (fds[i].revents & POLLIN)
+				while (receive(c, i, now) > 0)
+					;
+		}
+	}
+	seconds = (now_ns() - start) / 1e9;
+	if (pid) {
+		cpu_end = cpu_ns(pid);
+		if (cpu_start >= 0 && cpu_end >= 0 && received > 0)
+			cpu_per_byte = (double) (cpu_end - cpu_start) / received;
+	}
+	for (i = 0; i < numOfChannels; i++)
+		if (channels[i].in_flight > 0)
+			errors++;
+	qsort(samples, numOfSamples, sizeof(long long), compare);
+	if (quiet) {
+		printf("%10.1f %8lld %8lld %8lld %10.1f %6lu\n", received / seconds
+				/ 1024, percentile(0.5) / 1000, percentile(0.99) / 1000,
+				percentile(0.999) / 1000, cpu_per_byte, errors);
+	} else {
+		printf("%d channels, %d byte messages: %.1f KB/s looped back\n",
+				numOfChannels, message_size, received / seconds / 1024);
+		printf("latency p50 %lld us, p99 %lld us, p999 %lld us\n",
+				percentile(0.5) / 1000, percentile(0.99) / 1000,
+				percentile(0.999) / 1000);
+		if (pid)
+			printf("CPU %.1f ns per byte\n", cpu_per_byte);
+		printf("%lu errors\n", errors);
+	}
+	return errors ? 2 : 0;
+}
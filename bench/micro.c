@@ -0,0 +1,552 @@
+/*
+ * micro.c -- microbenchmarks of the frame parser, the encoder and the FCS
+ *
+ * Synthetic serial streams are fed through gsm0710_buffer_*() and
+ * gsm0710_extract_frames() like in gsmMuxd, frames are encoded by
+ * gsm0710_write_frame() and the FCS kernels are run over blocks. Before a
+ * case is timed, the frames it parses or encodes are checked once against
+ * the ones that went in. Every case is timed several times and the best
+ * run counts. The results can be saved as a baseline and later runs
+ * compared against it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include "../buffer.h"
+#include "../fcs.h"
+#include "../internal.h"
+
+// serial data of a stream
+#define STREAM_SIZE (1 << 20)
+// a case is repeated for this long per run
+#define RUN_TIME 20000 // microseconds
+#define RUNS 15
+// slower than the baseline by more than this is a regression
+#define TOLERANCE 15 // percent
+#define MAX_CASES 32
+#define BLOCK_SIZE 4096
+#define NUM_DLCS 4
+
+typedef struct Case {
+	const char *name;
+	// processes the stream once, returns the number of frames or blocks
+	unsigned long (*run)(struct Case *c);
+	GSM0710_Mux *mux;
+	char *stream; // serial data or a block for the FCS
+	int length;
+	int chunk;    // characters written to the input buffer at once
+	int size;     // frame data
+	const GSM0710_FcsKernel *kernel;
+	// frames in the stream, the checksum of their data and the noise in it
+	unsigned long frames;
+	unsigned int sum;
+	int noise;
+	// results
+	unsigned long long bytes; // per run of the stream
+	double ns_per_byte;
+	double frames_per_s;
+} Case;
+
+static Case cases[MAX_CASES];
+static int numOfCases;
+static unsigned long long delivered;
+// the data of the frames is summed up only while a case is checked
+static int checking;
+static unsigned int delivered_sum;
+
+// Adds a frame to a checksum of the frames, their DLCs and their order
+static unsigned int sum_frame(unsigned int sum, int dlc,
+		const struct iovec *iov, int iovcnt) {
+	int i, j;
+
+	sum = sum * 31 + dlc;
+	for (i = 0; i < iovcnt; i++)
+		for (j = 0; j < iov[i].iov_len; j++)
+			sum = sum * 31 + ((unsigned char *) iov[i].iov_base)[j];
+	return sum;
+}
+
+// the data frames end here instead of at a pseudo TTY
+static void receive_data(GSM0710_Mux *mux, int dlc, const struct iovec *iov,
+		int iovcnt, void *ctx) {
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		delivered += iov[i].iov_len;
+	if (checking)
+		delivered_sum = sum_frame(delivered_sum, dlc, iov, iovcnt);
+}
+
+// a fixed generator, so that the streams are the same everywhere
+static unsigned int rand_state = 1;
+
+static unsigned int next_rand() {
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 16;
+}
+
+static GSM0710_Mux *new_mux(int advanced, int size) {
+	GSM0710_Mux *mux;
+	int dlc;
+
+	if (!(mux = gsm0710_mux_new())) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	mux->serportdev = "bench";
+	mux->advanced = advanced;
+	mux->max_frame_size = size;
+	for (dlc = 1; dlc <= NUM_DLCS; dlc++)
+		gsm0710_mux_set_data_callback(mux, dlc, receive_data, NULL);
+	mux->in_buf->overflow = GSM0710_OVERFLOW_DROP;
+	mux->in_buf->frame_limit = FRAME_SIZE_LIMIT(mux);
+	return mux;
+}
+
+/* Encodes UIH frames of random data on the data DLCs in turn by
+ * gsm0710_write_frame() until the stream of a case is full. The number of frames
+ * in it and the checksum of their data are kept in the case.
+ */
+static void make_stream(Case *c, int advanced, int size) {
+	GSM0710_Mux *mux = new_mux(advanced, size);
+	char data[GSM0710_BUFFER_FRAME_MAX];
+	struct iovec seg[2];
+	unsigned long frames = 0;
+	unsigned int sum = 0;
+	int i, n, dlc = 0;
+
+	if (!(c->stream = malloc(STREAM_SIZE))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (c->length = 0; ; ) {
+		for (i = 0; i < size; i++)
+			data[i] = next_rand();
+		if (gsm0710_write_frame(mux, 1 + dlc, data, size, UIH) == 0) {
+			// only whole frames make it to the stream
+			n = gsm0710_buffer_length(mux->out_buf);
+			if (c->length + n > STREAM_SIZE)
+				break;
+			n = gsm0710_buffer_peek(mux->out_buf, 0, seg, n);
+			for (i = 0; i < n; i++) {
+				memcpy(c->stream + c->length, seg[i].iov_base, seg[i].iov_len);
+				c->length += seg[i].iov_len;
+			}
+			gsm0710_buffer_clear(mux->out_buf);
+			c->frames = frames;
+			c->sum = sum;
+			continue;
+		}
+		seg[0].iov_base = data;
+		seg[0].iov_len = size;
+		sum = sum_frame(sum, 1 + dlc, seg, 1);
+		frames++;
+		dlc = (dlc + 1) % NUM_DLCS;
+	}
+	gsm0710_mux_free(mux);
+}
+
+/* Flips a random bit in about every 512th character, these mostly hit
+ * the data of UIH frames, which isn't covered by the FCS. Bursts of up to
+ * 32 random characters about every 4096 characters hit flags and headers
+ * too and make the parser resynchronize.
+ *
+ * RETURNS:
+ * the number of bursts
+ */
+static int add_noise(char *stream, int length) {
+	int i, j, burst, bursts = 0;
+
+	for (i = next_rand() % 1024; i < length; i += 1 + next_rand() % 1024)
+		stream[i] ^= 1 << (next_rand() % 8);
+	for (i = next_rand() % 8192; i < length; i += 1 + next_rand() % 8192) {
+		burst = 1 + next_rand() % 32;
+		for (j = i; j < i + burst && j < length; j++)
+			stream[j] = next_rand();
+		bursts++;
+	}
+	return bursts;
+}
+
+static unsigned long run_parse(Case *c) {
+	GSM0710_Mux *mux = c->mux;
+	unsigned long received = mux->in_buf->received_count;
+	int i, n;
+
+	for (i = 0; i < c->length; i += n) {
+		gsm0710_buffer_make_room(mux->in_buf,
+				mux->advanced ? ADV_FLAG : F_FLAG);
+		n = gsm0710_buffer_write(mux->in_buf, c->stream + i,
+				min(c->chunk, c->length - i));
+		gsm0710_extract_frames(mux);
+		gsm0710_buffer_clear(mux->out_buf);
+	}
+	return mux->in_buf->received_count - received;
+}
+
+static unsigned long run_encode(Case *c) {
+	GSM0710_Mux *mux = c->mux;
+	unsigned long frames = 0;
+
+	for (c->bytes = 0; c->bytes < STREAM_SIZE; frames++) {
+		if (gsm0710_write_frame(mux, 1 + frames % NUM_DLCS, c->stream,
+				c->size, UIH) == 0) {
+			c->bytes += gsm0710_buffer_length(mux->out_buf);
+			gsm0710_buffer_clear(mux->out_buf);
+			frames--;
+		}
+	}
+	return frames;
+}
+
+static unsigned long run_fcs(Case *c) {
+	volatile unsigned char fcs = 0xFF;
+	int i;
+
+	for (i = 0; i + c->size <= c->length; i += c->size)
+		fcs = c->kernel->update(fcs, (unsigned char *) c->stream + i, c->size);
+	return c->length / c->size;
+}
+
+static unsigned long run_make_fcs(Case *c) {
+	volatile unsigned char fcs;
+	int i;
+
+	for (i = 0; i + c->size <= c->length; i += c->size)
+		fcs = gsm0710_make_fcs((unsigned char *) c->stream + i, c->size);
+	(void) fcs;
+	return c->length / c->size;
+}
+
+/* Parses the stream of a parser case once and compares the frames with
+ * the ones, which went into it. Noise changes the data of some frames and
+ * destroys others, so only their number is checked then: a burst may take
+ * the two frames it hits with it or make up one.
+ *
+ * RETURNS:
+ * 1 if the frames are right, 0 otherwise
+ */
+static int check_parse(Case *c) {
+	unsigned long frames;
+
+	delivered_sum = 0;
+	checking = 1;
+	frames = run_parse(c);
+	checking = 0;
+	if (c->noise ? frames + 2 * c->noise < c->frames
+			|| frames > c->frames + c->noise
+			: frames != c->frames || delivered_sum != c->sum) {
+		fprintf(stderr, "%s: %lu frames parsed (checksum %08x), %lu sent "
+				"(checksum %08x)\n", c->name, frames, delivered_sum,
+				c->frames, c->sum);
+		return 0;
+	}
+	return 1;
+}
+
+/* Encodes frames of an encoder case until the transmit buffer is full,
+ * parses them with another multiplexer and compares the frames
+ *
+ * RETURNS:
+ * 1 if the frames are right, 0 otherwise
+ */
+static int check_encode(Case *c) {
+	GSM0710_Mux *rx = new_mux(c->mux->advanced, c->size);
+	struct iovec seg[2];
+	unsigned long frames;
+	unsigned int sum = 0;
+	int i, n, dlc;
+
+	gsm0710_buffer_clear(c->mux->out_buf);
+	for (frames = 0; ; frames++) {
+		dlc = 1 + frames % NUM_DLCS;
+		if (gsm0710_write_frame(c->mux, dlc, c->stream, c->size, UIH) == 0)
+			break;
+		seg[0].iov_base = c->stream;
+		seg[0].iov_len = c->size;
+		sum = sum_frame(sum, dlc, seg, 1);
+	}
+	n = gsm0710_buffer_peek(c->mux->out_buf, 0, seg,
+			gsm0710_buffer_length(c->mux->out_buf));
+	for (i = 0; i < n; i++)
+		gsm0710_buffer_write(rx->in_buf, seg[i].iov_base, seg[i].iov_len);
+	gsm0710_buffer_clear(c->mux->out_buf);
+	delivered_sum = 0;
+	checking = 1;
+	gsm0710_extract_frames(rx);
+	checking = 0;
+	n = rx->in_buf->received_count;
+	gsm0710_mux_free(rx);
+	if (n != frames || delivered_sum != sum) {
+		fprintf(stderr, "%s: %d frames parsed (checksum %08x), %lu encoded "
+				"(checksum %08x)\n", c->name, n, delivered_sum, frames, sum);
+		return 0;
+	}
+	return 1;
+}
+
+static Case *add_case(const char *name, unsigned long (*run)(Case *)) {
+	Case *c = &cases[numOfCases++];
+
+	c->name = name;
+	c->run = run;
+	return c;
+}
+
+/* A parser case
+ *
+ * PARAMS:
+ * name     - of the case
+ * advanced - advanced option framing
+ * size     - frame data
+ * noise    - bit errors in the stream
+ * chunk    - characters written to the input buffer at once
+ * mirrored - 0 for a plain ring, where frames wrap around
+ */
+static void add_parse(const char *name, int advanced, int size, int noise,
+		int chunk, int mirrored) {
+	Case *c = add_case(name, run_parse);
+
+	make_stream(c, advanced, size);
+	if (noise)
+		c->noise = add_noise(c->stream, c->length);
+	c->mux = new_mux(advanced, size);
+	if (gsm0710_mux_set_mirrored(c->mux, mirrored) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	c->chunk = chunk;
+	c->bytes = c->length;
+}
+
+static void add_encode(const char *name, int advanced, int size) {
+	Case *c = add_case(name, run_encode);
+	int i;
+
+	c->mux = new_mux(advanced, size);
+	c->size = size;
+	if (!(c->stream = malloc(size))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < size; i++)
+		c->stream[i] = next_rand();
+}
+
+static void add_fcs(const char *name, const GSM0710_FcsKernel *kernel,
+		int size) {
+	Case *c = add_case(name, kernel ? run_fcs : run_make_fcs);
+	int i;
+
+	c->kernel = kernel;
+	c->size = size;
+	c->length = STREAM_SIZE / 4;
+	if (!(c->stream = malloc(c->length))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < c->length; i++)
+		c->stream[i] = next_rand();
+	c->bytes = c->length / size * size;
+}
+
+static void setup() {
+	static const char *kernels[] = { "clmul", "slice8", "slice4", "table" };
+	static char names[4][16];
+	const GSM0710_FcsKernel *k;
+	int i, n;
+
+	add_parse("parse-clean", 0, 127, 0, BLOCK_SIZE, 1);
+	add_parse("parse-noisy", 0, 127, 1, BLOCK_SIZE, 1);
+	add_parse("parse-max", 0, GSM0710_BUFFER_FRAME_MAX, 0, BLOCK_SIZE, 1);
+	add_parse("parse-tiny", 0, 1, 0, BLOCK_SIZE, 1);
+	// odd chunks and frames of half the ring, most of them wrap around
+	add_parse("parse-wrap", 0, 1000, 0, 61, 0);
+	add_parse("parse-adv-clean", 1, 127, 0, BLOCK_SIZE, 1);
+	add_parse("parse-adv-noisy", 1, 127, 1, BLOCK_SIZE, 1);
+	add_parse("parse-adv-max", 1, (GSM0710_BUFFER_FRAME_MAX - 1) / 2, 0,
+			BLOCK_SIZE, 1);
+	add_encode("encode-tiny", 0, 1);
+	add_encode("encode-127", 0, 127);
+	add_encode("encode-max", 0, GSM0710_BUFFER_FRAME_MAX);
+	add_encode("encode-adv-127", 1, 127);
+	// the FCS of headers, as of UIH frames, and of whole UI frames
+	add_fcs("make_fcs-header", NULL, 3);
+	add_fcs("make_fcs-127", NULL, 127);
+	for (i = 0, n = 0; i < 4; i++) {
+		if (!(k = gsm0710_fcs_kernel(kernels[i])))
+			continue;
+		snprintf(names[n], sizeof(names[n]), "fcs-%s", k->name);
+		add_fcs(names[n++], k, BLOCK_SIZE);
+	}
+}
+
+// Runs a case for RUN_TIME repeatedly, RUNS times, the best run counts
+static void measure(Case *c) {
+	long long start, elapsed, best = LLONG_MAX;
+	unsigned long frames, best_frames = 0, rounds, best_rounds = 1;
+	int run;
+
+	// warm up the caches and the buffers
+	c->run(c);
+	for (run = 0; run < RUNS; run++) {
+		frames = 0;
+		rounds = 0;
+		start = gsm0710_monotonic_us();
+		do {
+			frames += c->run(c);
+			rounds++;
+		} while ((elapsed = gsm0710_monotonic_us() - start) < RUN_TIME);
+		if (elapsed * best_rounds < best * rounds) {
+			best = elapsed;
+			best_rounds = rounds;
+			best_frames = frames;
+		}
+	}
+	c->ns_per_byte = best * 1000.0 / (best_rounds * (double) c->bytes);
+	c->frames_per_s = best_frames * 1e6 / best;
+}
+
+/* Compares the results with a baseline, a line of name, ns/byte and
+ * frames/s per case
+ *
+ * RETURNS:
+ * the number of regressions or -1, if the file can't be read
+ */
+static int compare(const char *path, int tolerance) {
+	char name[64];
+	double ns, frames, change;
+	int i, regressions = 0;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+	printf("\n%-18s %10s %10s %8s\n", "case", "baseline", "ns/byte", "change");
+	while (fscanf(f, "%63s %lf %lf", name, &ns, &frames) == 3) {
+		for (i = 0; i < numOfCases && strcmp(cases[i].name, name) != 0; i++)
+			;
+		if (i == numOfCases || ns <= 0)
+			continue;
+		change = (cases[i].ns_per_byte - ns) * 100 / ns;
+		printf("%-18s %10.3f %10.3f %+7.1f%%%s\n", name, ns,
+				cases[i].ns_per_byte, change,
+				(change > tolerance) ? "  REGRESSION" : "");
+		if (change > tolerance)
+			regressions++;
+	}
+	fclose(f);
+	return regressions;
+}
+
+static int save(const char *path) {
+	FILE *f;
+	int i;
+
+	if (!(f = fopen(path, "w"))) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < numOfCases; i++)
+		fprintf(f, "%s %.4f %.0f\n", cases[i].name, cases[i].ns_per_byte,
+				cases[i].frames_per_s);
+	return fclose(f);
+}
+
+static void usage(char *name) {
+	fprintf(stderr, "\nUsage: %s [options] [case] ...\n", name);
+	fprintf(stderr, "  <case>              : Run the cases starting with"
+			" these names [all]\n\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr,
+			"  -b <file>           : Compare against a baseline, fail on"
+			" regressions\n");
+	fprintf(stderr, "  -w <file>           : Save the results as a baseline\n");
+	fprintf(stderr,
+			"  -t <percent>        : Slowdown taken as a regression [%d]\n",
+			TOLERANCE);
+	fprintf(stderr, "  -l                  : List the cases\n");
+	fprintf(stderr, "  -h                  : Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+	char *baseline = NULL, *output = NULL;
+	int opt, i, j, list = 0, tolerance = TOLERANCE, regressions = 0;
+
+	while ((opt = getopt(argc, argv, "b:w:t:lh")) > 0) {
+		switch (opt) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'w':
+			output = optarg;
+			break;
+		case 't':
+			tolerance = atoi(optarg);
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	printf("FCS kernel %s\n", gsm0710_fcs_init());
+	setup();
+	// keep the selected cases only
+	if (optind < argc) {
+		for (i = 0, j = 0; i < numOfCases; i++) {
+			for (opt = optind; opt < argc; opt++)
+				if (strncmp(cases[i].name, argv[opt], strlen(argv[opt])) == 0)
+					break;
+			if (opt < argc)
+				cases[j++] = cases[i];
+		}
+		numOfCases = j;
+	}
+	if (list) {
+		for (i = 0; i < numOfCases; i++)
+			printf("%s\n", cases[i].name);
+		return 0;
+	}
+	printf("%-18s %10s %12s %10s\n", "case", "ns/byte", "frames/s", "MB/s");
+	for (i = 0; i < numOfCases; i++) {
+		// a fast case, which gets the frames wrong, counts for nothing
+		if ((cases[i].run == run_parse && !check_parse(&cases[i]))
+				|| (cases[i].run == run_encode && !check_encode(&cases[i])))
+			return 1;
+		measure(&cases[i]);
+		printf("%-18s %10.3f %12.0f %10.1f\n", cases[i].name,
+				cases[i].ns_per_byte, cases[i].frames_per_s,
+				1000 / cases[i].ns_per_byte);
+		fflush(stdout);
+	}
+	if (output && save(output) != 0)
+		return 1;
+	if (baseline && (regressions = compare(baseline, tolerance)) != 0) {
+		if (regressions > 0)
+			printf("%d regressions over %d%%\n", regressions, tolerance);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,503 @@
+/*
+ * modem.c -- a GSM 07.10 modem emulator on a pseudo TTY
+ *
+ * Answers AT commands and AT+CMUX like a modem, then the multiplexer
+ * frames: SABM and DISC by UA, the MSC, TEST, PN, FCon, FCoff and CLD
+ * commands of the control channel by their responses and unknown
+ * commands by NSC. The data of the other DLCs is looped back. Frames are
+ * parsed by the parser of the daemon.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <limits.h>
+#include "../buffer.h"
+#include "../internal.h"
+
+// characters of the encoded frames waiting for the host
+#define OUT_SIZE (1 << 16)
+// the loopback queue of a DLC
+#define LOOP_SIZE (1 << 16)
+// frames are encoded, while less than this is waiting for the host
+#define OUT_LOW 4096
+#define AT_LINE_MAX 256
+
+// a frame waiting in a loopback queue, followed by its data
+typedef struct Held {
+	long long due; // when it may be sent
+	int length;
+	unsigned char control;
+} Held;
+
+static struct {
+	int fd;      // master side of the pty
+	int slave;   // kept open, so the master doesn't see a hangup
+	int mux;     // set in multiplexer mode
+	int advanced;
+	long long rate;  // characters per second in each direction, 0 if unpaced
+	long long delay; // of every frame in microseconds
+	int max_frame_size; // N1 agreed by PN at most
+	int verbose;
+	char line[AT_LINE_MAX];
+	int line_length;
+	GSM0710_Buffer *in;
+	GSM0710_Buffer *out;
+	GSM0710_Buffer *loop[MAX_DLCS]; // held frames by DLC
+	int opened[MAX_DLCS];
+	int stopped[MAX_DLCS]; // by MSC from the host
+	int stopped_all;       // by FCoff
+	int next;              // where the round robin of the DLCs continues
+	// token buckets of the pacing
+	long long rx_tokens, tx_tokens, refill_time;
+} m;
+
+static volatile int terminate = 0;
+
+static long long now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig) {
+	terminate = 1;
+}
+
+// Copies the oldest characters of a buffer without removing them
+static void peek_copy(GSM0710_Buffer *buf, void *output, int count) {
+	GSM0710_FrameView view;
+
+	view.segments = gsm0710_buffer_peek(buf, 0, view.seg, count);
+	gsm0710_frame_view_copy(&view, output, count);
+}
+
+/* Encodes a frame to the output queue
+ *
+ * PARAMS:
+ * dlc     - the DLC
+ * cr      - the C/R bit of the address
+ * control - type of the frame
+ * data    - the data
+ * length  - length of the data
+ */
+static void send_frame(int dlc, int cr, unsigned char control,
+		const char *data, int length) {
+	unsigned char header[4];
+	unsigned char fcs, flag = m.advanced ? ADV_FLAG : F_FLAG;
+	int header_length = 3;
+
+	header[0] = EA | (cr ? CR : 0) | (dlc << 2);
+	header[1] = control;
+	if (length > 127) {
+		header[2] = (length & 127) << 1;
+		header[3] = length >> 7;
+		header_length = 4;
+	} else {
+		header[2] = EA | (length << 1);
+	}
+	// no length field in the advanced option
+	if (m.advanced)
+		header_length = 2;
+	fcs = gsm0710_fcs_update(0xFF, header, header_length);
+	if ((control & ~PF) == UI)
+		fcs = gsm0710_fcs_update(fcs, data, length);
+	fcs = 0xFF - fcs;
+	gsm0710_buffer_write(m.out, (char *) &flag, 1);
+	if (m.advanced) {
+		gsm0710_buffer_write_stuffed(m.out, (char *) header, header_length);
+		gsm0710_buffer_write_stuffed(m.out, data, length);
+		gsm0710_buffer_write_stuffed(m.out, (char *) &fcs, 1);
+	} else {
+		gsm0710_buffer_write(m.out, (char *) header, header_length);
+		gsm0710_buffer_write(m.out, data, length);
+		gsm0710_buffer_write(m.out, (char *) &fcs, 1);
+	}
+	gsm0710_buffer_write(m.out, (char *) &flag, 1);
+	if (m.verbose)
+		fprintf(stderr, "> dlc %d control 0x%02x length %d\n", dlc, control,
+				length);
+}
+
+/* Queues a frame to be sent after the frame delay. Control channel
+ * responses are held like data, so the delay models the round trip of
+ * the modem.
+ */
+static void hold_frame(int dlc, unsigned char control, const char *data,
+		int length) {
+	Held h;
+
+	if (gsm0710_buffer_free(m.loop[dlc]) < (int) sizeof(h) + length) {
+		fprintf(stderr, "Loopback queue of DLC %d is full, frame dropped\n",
+				dlc);
+		return;
+	}
+	h.due = now_us() + m.delay;
+	h.length = length;
+	h.control = control;
+	gsm0710_buffer_write(m.loop[dlc], (char *) &h, sizeof(h));
+	gsm0710_buffer_write(m.loop[dlc], data, length);
+}
+
+/* Moves due frames of the DLCs, that aren't stopped, to the output queue
+ * by round robin, one frame per DLC and round
+ */
+static void schedule(long long now) {
+	char data[MAX_FRAME_DATA + 1];
+	GSM0710_Buffer *q;
+	Held h;
+	int i, dlc, sent = 1;
+
+	while (sent && gsm0710_buffer_length(m.out) < OUT_LOW) {
+		sent = 0;
+		for (i = 0; i < MAX_DLCS; i++) {
+			dlc = (m.next + i) % MAX_DLCS;
+			q = m.loop[dlc];
+			if (gsm0710_buffer_length(q) == 0
+					|| (dlc > 0 && (m.stopped[dlc] || m.stopped_all)))
+				continue;
+			peek_copy(q, &h, sizeof(h));
+			if (h.due > now)
+				continue;
+			gsm0710_buffer_consume(q, sizeof(h));
+			peek_copy(q, data, h.length);
+			gsm0710_buffer_consume(q, h.length);
+			// C/R is set in our responses, but not in our commands
+			send_frame(dlc, (h.control & ~PF) == UA || (h.control & ~PF) == DM,
+					h.control, data, h.length);
+			sent = 1;
+		}
+		m.next = (m.next + 1) % MAX_DLCS;
+	}
+}
+
+// Tells, when the next held frame becomes due, LLONG_MAX if none
+static long long next_due() {
+	long long due = LLONG_MAX;
+	Held h;
+	int dlc;
+
+	for (dlc = 0; dlc < MAX_DLCS; dlc++) {
+		if (gsm0710_buffer_length(m.loop[dlc]) == 0
+				|| (dlc > 0 && (m.stopped[dlc] || m.stopped_all)))
+			continue;
+		peek_copy(m.loop[dlc], &h, sizeof(h));
+		due = min(due, h.due);
+	}
+	return due;
+}
+
+// Answers a command of the control channel
+static void handle_command(char *data, int length) {
+	unsigned char type;
+	int i, value, value_length = 0, dlc, size;
+
+	if (length < 2)
+		return;
+	type = data[0];
+	for (i = 1; i < length; i++) {
+		value_length = value_length * 128 + ((data[i] & 254) >> 1);
+		if (data[i] & EA)
+			break;
+	}
+	value = i + 1;
+	if (value + value_length > length)
+		return;
+	if (!(type & CR))
+		// a response to a command of ours, there are none
+		return;
+	switch (type & ~CR) {
+	case C_CLD:
+		// answered at once, the multiplexer is closed down
+		data[0] = type & ~CR;
+		hold_frame(0, UIH, data, length);
+		schedule(LLONG_MAX);
+		m.mux = 0;
+		return;
+	case C_MSC:
+		if (value_length >= 2) {
+			dlc = (data[value] & 252) >> 2;
+			m.stopped[dlc] = (data[value + 1] & S_FC) != 0;
+		}
+		break;
+	case C_FCON:
+	case C_FCOFF:
+		m.stopped_all = (type & ~CR) == C_FCOFF;
+		break;
+	case C_PN:
+		if (value_length >= 8) {
+			size = (unsigned char) data[value + 4]
+					| ((unsigned char) data[value + 5] << 8);
+			size = min(size, m.max_frame_size);
+			data[value + 4] = size & 255;
+			data[value + 5] = size >> 8;
+		}
+		break;
+	case C_TEST:
+		break;
+	default:
+		// not supported, NSC with the type
+		data[0] = C_NSC;
+		data[1] = EA | (1 << 1);
+		data[2] = type;
+		hold_frame(0, UIH, data, 3);
+		return;
+	}
+	data[0] = type & ~CR;
+	hold_frame(0, UIH, data, length);
+}
+
+// Handles the frames received from the host
+static void handle_frames() {
+	char data[MAX_FRAME_DATA + 1];
+	GSM0710_FrameView view;
+	int length, dlc;
+
+	while (m.mux && (m.advanced
+			? gsm0710_buffer_get_adv_frame_view(m.in, &view)
+			: gsm0710_buffer_get_frame_view(m.in, &view))) {
+		dlc = view.channel;
+		length = gsm0710_frame_view_copy(&view, data, sizeof(data));
+		if (m.verbose)
+			fprintf(stderr, "< dlc %d control 0x%02x length %d\n", dlc,
+					view.control, length);
+		switch (view.control & ~PF) {
+		case SABM:
+			m.opened[dlc] = 1;
+			hold_frame(dlc, UA | PF, NULL, 0);
+			break;
+		case DISC:
+			hold_frame(dlc, m.opened[dlc] ? UA | PF : DM | PF, NULL, 0);
+			m.opened[dlc] = 0;
+			m.stopped[dlc] = 0;
+			if (dlc == 0) {
+				// the multiplexer is closed down
+				schedule(LLONG_MAX);
+				m.mux = 0;
+			}
+			break;
+		case UIH:
+		case UI:
+			if (dlc == 0)
+				handle_command(data, length);
+			else if (m.opened[dlc])
+				hold_frame(dlc, view.control, data, length);
+			break;
+		}
+	}
+}
+
+// Handles characters received in AT command mode
+static void handle_at(const char *data, int count) {
+	const char ok[] = "\r\nOK\r\n";
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (data[i] != '\r' && data[i] != '\n') {
+			if (m.line_length < AT_LINE_MAX - 1)
+				m.line[m.line_length++] = data[i];
+			continue;
+		}
+		if (m.line_length == 0)
+			continue;
+		m.line[m.line_length] = 0;
+		m.line_length = 0;
+		if (m.verbose)
+			fprintf(stderr, "< %s\n", m.line);
+		gsm0710_buffer_write(m.out, ok, sizeof(ok) - 1);
+		if (strncasecmp(m.line, "AT+CMUX=", 8) == 0 && m.line[8] != '?') {
+			// the rest of the input is already multiplexed
+			m.advanced = atoi(m.line + 8) == 1;
+			m.mux = 1;
+			memset(m.opened, 0, sizeof(m.opened));
+			memset(m.stopped, 0, sizeof(m.stopped));
+			m.stopped_all = 0;
+			gsm0710_buffer_clear(m.in);
+			gsm0710_buffer_write(m.in, data + i + 1, count - i - 1);
+			handle_frames();
+			return;
+		}
+	}
+}
+
+// Adds the tokens of the time passed, a burst of 10 ms is allowed
+static void refill(long long now) {
+	long long burst = max(m.rate / 100, 64);
+
+	if (m.rate == 0) {
+		m.rx_tokens = m.tx_tokens = INT_MAX;
+		return;
+	}
+	m.rx_tokens = min(burst, m.rx_tokens + (now - m.refill_time) * m.rate
+			/ 1000000);
+	m.tx_tokens = min(burst, m.tx_tokens + (now - m.refill_time) * m.rate
+			/ 1000000);
+	m.refill_time = now;
+}
+
+static void usage(char *name) {
+	fprintf(stderr, "\nUsage: %s [options] <link>\n", name);
+	fprintf(stderr,
+			"  <link>              : symlink created to the modem side of the pty,\n"
+			"                        for gsmMuxd -p\n\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr,
+			"  -b <baudrate>       : Pace both directions like a UART [unpaced]\n");
+	fprintf(stderr,
+			"  -D <usec>           : Delay every frame sent to the host [0]\n");
+	fprintf(stderr,
+			"  -N <framsize>       : Largest frame size to agree on [%d]\n",
+			MAX_FRAME_DATA);
+	fprintf(stderr, "  -v                  : Log the frames to stderr\n");
+	fprintf(stderr, "  -h                  : Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+	struct termios options;
+	struct pollfd fds;
+	struct iovec seg[2];
+	long long now, due;
+	int opt, i, len, timeout;
+	char *link;
+
+	m.max_frame_size = MAX_FRAME_DATA;
+	while ((opt = getopt(argc, argv, "b:D:N:vh")) > 0) {
+		switch (opt) {
+		case 'b':
+			// a start and a stop bit
+			m.rate = atoi(optarg) / 10;
+			break;
+		case 'D':
+			m.delay = atoi(optarg);
+			break;
+		case 'N':
+			m.max_frame_size = min(max(atoi(optarg), 1), MAX_FRAME_DATA);
+			break;
+		case 'v':
+			m.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	link = argv[optind];
+	gsm0710_fcs_init();
+
+	if ((m.fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0
+			|| grantpt(m.fd) != 0 || unlockpt(m.fd) != 0
+			|| (m.slave = open(ptsname(m.fd), O_RDWR | O_NOCTTY)) < 0) {
+		perror("Can't open a pty");
+		return 1;
+	}
+	tcgetattr(m.slave, &options);
+	cfmakeraw(&options);
+	tcsetattr(m.slave, TCSANOW, &options);
+	unlink(link);
+	if (symlink(ptsname(m.fd), link) != 0) {
+		perror(link);
+		return 1;
+	}
+	if (!(m.in = gsm0710_buffer_init_size(OUT_SIZE))
+			|| !(m.out = gsm0710_buffer_init_size(OUT_SIZE)))
+		return 1;
+	m.in->overflow = GSM0710_OVERFLOW_DROP;
+	m.in->frame_limit = MAX_FRAME_DATA;
+	for (i = 0; i < MAX_DLCS; i++)
+		if (!(m.loop[i] = gsm0710_buffer_init_size(LOOP_SIZE)))
+			return 1;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	m.refill_time = now_us();
+
+	while (!terminate) {
+		now = now_us();
+		refill(now);
+		if (m.mux)
+			schedule(now);
+		// write as much as the pacing allows
+		if (gsm0710_buffer_length(m.out) > 0 && m.tx_tokens > 0) {
+			len = min(gsm0710_buffer_length(m.out), (int) min(m.tx_tokens,
+					INT_MAX));
+			i = gsm0710_buffer_peek(m.out, 0, seg, len);
+			if ((len = writev(m.fd, seg, i)) > 0) {
+				gsm0710_buffer_consume(m.out, len);
+				if (m.rate > 0)
+					m.tx_tokens -= len;
+			}
+		}
+
+		fds.fd = m.fd;
+		fds.events = 0;
+		if (m.rx_tokens > 0 && gsm0710_buffer_free(m.in) > 0)
+			fds.events |= POLLIN;
+		if (gsm0710_buffer_length(m.out) > 0 && m.tx_tokens > 0)
+			fds.events |= POLLOUT;
+		due = m.mux ? next_due() : LLONG_MAX;
+		if (m.rate > 0 && (m.rx_tokens <= 0 || (m.tx_tokens <= 0
+				&& gsm0710_buffer_length(m.out) > 0)))
+			due = min(due, now + 1000);
+		timeout = (due == LLONG_MAX) ? -1
+				: (int) max(0, (due - now + 999) / 1000);
+		if (poll(&fds, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (!(fds.revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		len = min(gsm0710_buffer_free(m.in), (int) min(m.rx_tokens,
+				INT_MAX));
+		if (len <= 0)
+			continue;
+		if (m.mux) {
+			len = gsm0710_buffer_fill(m.in, m.fd, len);
+			if (len > 0)
+				handle_frames();
+		} else {
+			char at[AT_LINE_MAX];
+
+			len = read(m.fd, at, min(len, (int) sizeof(at)));
+			if (len > 0)
+				handle_at(at, len);
+		}
+		if (len > 0 && m.rate > 0)
+			m.rx_tokens -= len;
+		else if (len <= 0 && errno != EAGAIN && errno != EINTR)
+			// the host has closed its side, wait for it to come back
+			usleep(10000);
+	}
+	unlink(link);
+	return 0;
+}
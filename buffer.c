@@ -21,202 +21,784 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+// To get memfd_create
+#define _GNU_SOURCE
+#endif
 #include "buffer.h"
-#include "gsm0710.h"
+#include "internal.h"
+#include "fcs.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
-const unsigned char r_crctable[256] = { //reversed, 8-bit, poly=0x07 
-	0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
-	0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
-	0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
-	0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
-	0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
-	0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
-	0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
-	0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
-	0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
-	0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
-	0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
-	0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
-	0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
-	0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
-	0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
-	0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
-	0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
-	0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
-	0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
-	0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
-	0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
-	0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
-	0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
-	0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
-	0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
-	0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
-	0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
-	0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
-	0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
-	0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
-	0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
-	0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF
-};
-
-unsigned char make_fcs(const unsigned char *input, int count) {
-	unsigned char fcs = 0xFF;
-	int i;
-	for (i = 0; i < count; i++) {
-		fcs = r_crctable[fcs ^ input[i]];
-	}
-	return (0xFF - fcs);
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// the character at a free running position
+#define BUF_AT(buf, pos) ((buf)->data[(pos) & (buf)->mask])
+
+// records what happened to a received frame
+#define TRACE(buf, dlc, control, length, verdict) \
+	gsm0710_trace((buf)->trace, (buf)->trace_source, (dlc), (control), \
+			(length), (verdict))
+
+// Rounds a buffer size up to a power of two
+static unsigned int round_size(unsigned int size) {
+	unsigned int s = 64;
+
+	while (s < size && s < GSM0710_BUFFER_MAX)
+		s <<= 1;
+	return s;
 }
 
-GSM0710_Buffer *gsm0710_buffer_init() {
+/* Maps the same size bytes of a memfd twice, back to back.
+ *
+ * RETURNS:
+ * the start of the first mapping or NULL, if it failed
+ */
+static char *map_mirrored(unsigned int size) {
+	char *data;
+	int fd;
+
+	if ((fd = memfd_create("gsm0710_buffer", MFD_CLOEXEC)) < 0)
+		return NULL;
+	// reserve the address space for both halves first
+	data = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ftruncate(fd, size) < 0 || data == MAP_FAILED
+			|| mmap(data, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+					fd, 0) == MAP_FAILED
+			|| mmap(data + size, size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		if (data != MAP_FAILED)
+			munmap(data, 2 * size);
+		data = NULL;
+	}
+	// the mappings keep the memory
+	close(fd);
+	return data;
+}
+
+/* Allocates the storage of a buffer
+ *
+ * RETURNS:
+ * the storage or NULL, if out of memory
+ */
+static char *alloc_data(unsigned int size, int mirrored) {
+	if (mirrored)
+		return map_mirrored(size);
+	return malloc(size);
+}
+
+static void free_data(char *data, unsigned int size, int mirrored) {
+	if (mirrored)
+		munmap(data, 2 * size);
+	else
+		free(data);
+}
+
+// Rounds the size of a mirrored buffer up to whole pages
+static unsigned int round_mirrored(unsigned int size) {
+	unsigned int page = sysconf(_SC_PAGESIZE);
+
+	return round_size(max(size, page));
+}
+
+// Allocates a buffer of a rounded size with the given storage
+static GSM0710_Buffer *new_buffer(unsigned int size, int mirrored) {
 	GSM0710_Buffer *buf;
 	if ((buf = malloc(sizeof(GSM0710_Buffer)))) {
 		memset(buf, 0, sizeof(GSM0710_Buffer));
-		buf->readp = buf->data;
-		buf->writep = buf->data;
-		buf->endp = buf->data + GSM0710_BUFFER_SIZE;
+		buf->mirrored = mirrored;
+		buf->size = size;
+		buf->mask = size - 1;
+		buf->frame_limit = GSM0710_BUFFER_FRAME_MAX;
+		buf->overflow = GSM0710_OVERFLOW_STOP;
+		if (!(buf->data = alloc_data(size, mirrored))) {
+			free(buf);
+			return NULL;
+		}
+	}
+	return buf;
+}
+
+GSM0710_Buffer *gsm0710_buffer_init() {
+	return gsm0710_buffer_init_size(GSM0710_BUFFER_SIZE);
+}
+
+GSM0710_Buffer *gsm0710_buffer_init_size(unsigned int size) {
+	return new_buffer(round_size(size), 0);
+}
+
+GSM0710_Buffer *gsm0710_buffer_init_mirrored(unsigned int size) {
+	GSM0710_Buffer *buf;
+
+	if (!(buf = new_buffer(round_mirrored(size), 1))) {
+		SYSLOG(LOG_WARNING, "Can't map a mirrored buffer. %s (%d).\n",
+				strerror(errno), errno);
+		return gsm0710_buffer_init_size(size);
 	}
 	return buf;
 }
 
 void gsm0710_buffer_destroy(GSM0710_Buffer *buf) {
+	if (buf) {
+		free_data(buf->data, buf->size, buf->mirrored);
+		free(buf->frame);
+	}
 	free(buf);
 }
 
+/* Moves the contents of a buffer to new storage of a rounded size
+ *
+ * RETURNS:
+ * 0 on success, -1 if out of memory
+ */
+static int move_data(GSM0710_Buffer *buf, unsigned int size, int mirrored) {
+	struct iovec seg[2];
+	int length = gsm0710_buffer_length(buf), i, n;
+	char *data;
+
+	if (!(data = alloc_data(size, mirrored)))
+		return -1;
+	n = gsm0710_buffer_peek(buf, 0, seg, length);
+	for (i = 0, length = 0; i < n; i++) {
+		memcpy(data + length, seg[i].iov_base, seg[i].iov_len);
+		length += seg[i].iov_len;
+	}
+	free_data(buf->data, buf->size, buf->mirrored);
+	buf->data = data;
+	buf->mirrored = mirrored;
+	buf->size = size;
+	buf->mask = size - 1;
+	buf->tail = 0;
+	buf->head = length;
+	return 0;
+}
+
+int gsm0710_buffer_resize(GSM0710_Buffer *buf, unsigned int size) {
+	size = max(size, gsm0710_buffer_length(buf));
+	size = buf->mirrored ? round_mirrored(size) : round_size(size);
+	if (size == buf->size)
+		return 0;
+	return move_data(buf, size, buf->mirrored);
+}
+
+int gsm0710_buffer_set_mirrored(GSM0710_Buffer *buf, int mirrored) {
+	if (!buf->mirrored == !mirrored)
+		return 0;
+	if (!mirrored)
+		return move_data(buf, buf->size, 0);
+	if (move_data(buf, round_mirrored(buf->size), 1) != 0)
+		SYSLOG(LOG_WARNING, "Can't map a mirrored buffer. %s (%d).\n",
+				strerror(errno), errno);
+	return 0;
+}
+
+int gsm0710_buffer_peek(GSM0710_Buffer *buf, unsigned int offset,
+		struct iovec seg[2], unsigned int count) {
+	unsigned int pos = (buf->tail + offset) & buf->mask;
+	unsigned int c = buf->size - pos;
+
+	if (count == 0)
+		return 0;
+	seg[0].iov_base = buf->data + pos;
+	if (count > c && !buf->mirrored) {
+		seg[0].iov_len = c;
+		seg[1].iov_base = buf->data;
+		seg[1].iov_len = count - c;
+		return 2;
+	}
+	seg[0].iov_len = count;
+	return 1;
+}
+
+// I/O functions on a file descriptor, ctx points to it
+static ssize_t fd_readv(void *ctx, const struct iovec *iov, int iovcnt) {
+	return readv(*(int *) ctx, iov, iovcnt);
+}
+
+static ssize_t fd_writev(void *ctx, const struct iovec *iov, int iovcnt) {
+	return writev(*(int *) ctx, iov, iovcnt);
+}
+
+int gsm0710_buffer_fill(GSM0710_Buffer *buf, int fd, int count) {
+	return gsm0710_buffer_fill_io(buf, fd_readv, &fd, count);
+}
+
+int gsm0710_buffer_fill_io(GSM0710_Buffer *buf, GSM0710_IoFunc io,
+		void *ctx, int count) {
+	struct iovec iov[2];
+	unsigned int pos = buf->head & buf->mask;
+	int iovcnt = 1, c;
+
+	count = min(count, gsm0710_buffer_free(buf));
+	iov[0].iov_base = buf->data + pos;
+	iov[0].iov_len = count;
+	if (count > buf->size - pos && !buf->mirrored) {
+		iov[0].iov_len = buf->size - pos;
+		iov[1].iov_base = buf->data;
+		iov[1].iov_len = count - iov[0].iov_len;
+		iovcnt = 2;
+	}
+	do {
+		c = io(ctx, iov, iovcnt);
+	} while (c < 0 && errno == EINTR);
+	if (c > 0)
+		buf->head += c;
+	return c;
+}
+
 int gsm0710_buffer_write(GSM0710_Buffer *buf, const char *input, int count) {
-	int c = buf->endp - buf->writep;
+	unsigned int pos = buf->head & buf->mask;
+	int c = buf->size - pos;
 
 	count = min(count, gsm0710_buffer_free(buf));
-	if (count > c) {
-		memcpy(buf->writep, input, c);
+	if (count > c && !buf->mirrored) {
+		memcpy(buf->data + pos, input, c);
 		memcpy(buf->data, input + c, count - c);
-		buf->writep = buf->data + (count - c);
 	} else {
-		memcpy(buf->writep, input, count);
-		buf->writep += count;
-		if (buf->writep == buf->endp)
-			buf->writep = buf->data;
+		memcpy(buf->data + pos, input, count);
 	}
+	buf->head += count;
 
 	return count;
 }
 
-GSM0710_Frame *gsm0710_buffer_get_frame(GSM0710_Buffer *buf) {
-	int end;
-	int length_needed = 5; // channel, type, length, fcs, flag
-	char *data;
-	unsigned char fcs = 0xFF;
+int gsm0710_buffer_write_fcs(GSM0710_Buffer *buf, const char *input, int count,
+		unsigned char *fcs) {
+	unsigned int pos = buf->head & buf->mask;
+	int c = buf->size - pos;
 
-	GSM0710_Frame *frame = NULL;
+	count = min(count, gsm0710_buffer_free(buf));
+	if (count > c && !buf->mirrored) {
+		*fcs = gsm0710_fcs_copy(*fcs, buf->data + pos, input, c);
+		*fcs = gsm0710_fcs_copy(*fcs, buf->data, input + c, count - c);
+	} else {
+		*fcs = gsm0710_fcs_copy(*fcs, buf->data + pos, input, count);
+	}
+	buf->head += count;
 
-	// Find start flag
-	while (!buf->flag_found && gsm0710_buffer_length(buf) > 0) {
-		if (*buf->readp == F_FLAG)
-			buf->flag_found = 1;
-		INC_BUF_POINTER(buf, buf->readp);
+	return count;
+}
+
+int gsm0710_buffer_flush(GSM0710_Buffer *buf, int fd) {
+	return gsm0710_buffer_flush_io(buf, fd_writev, &fd);
+}
+
+int gsm0710_buffer_flush_io(GSM0710_Buffer *buf, GSM0710_IoFunc io,
+		void *ctx) {
+	struct iovec iov[2];
+	int iovcnt, c;
+
+	if ((iovcnt = gsm0710_buffer_peek(buf, 0, iov,
+			gsm0710_buffer_length(buf))) == 0)
+		return 0;
+	do {
+		c = io(ctx, iov, iovcnt);
+	} while (c < 0 && errno == EINTR);
+	if (c < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	gsm0710_buffer_consume(buf, c);
+	return c;
+}
+
+int gsm0710_find_byte(const char *p, int len, unsigned char c) {
+	int i = 0;
+#if defined(__AVX2__)
+	__m256i needle32 = _mm256_set1_epi8((char) c);
+	for (; i + 32 <= len; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i)),
+						needle32));
+		if (mask)
+			return i + __builtin_ctz(mask);
 	}
-	if (!buf->flag_found) // no frame started
-		return NULL;
+#endif
+#if defined(__SSE2__)
+	__m128i needle16 = _mm_set1_epi8((char) c);
+	for (; i + 16 <= len; i += 16) {
+		unsigned int mask = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)),
+						needle16));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t needle16 = vdupq_n_u8(c);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *) p + i), needle16);
+		// narrow the comparison result to four bits per byte
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		if (mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	for (; i < len; i++) {
+		if ((unsigned char) p[i] == c)
+			return i;
+	}
+	return len;
+}
 
-	// skip empty frames (this causes troubles if we're using DLC 62)
-	while (gsm0710_buffer_length(buf) > 0 && (*buf->readp == F_FLAG)) {
-		INC_BUF_POINTER(buf, buf->readp);
-	}
-
-	if (gsm0710_buffer_length(buf) >= length_needed) {
-		data = buf->readp;
-		frame = malloc(sizeof(GSM0710_Frame));
-
-		frame->channel = ((*data & 252) >> 2);
-		fcs = r_crctable[fcs ^ *data];
-		INC_BUF_POINTER(buf, data);
-
-		frame->control = *data;
-		fcs = r_crctable[fcs ^ *data];
-		INC_BUF_POINTER(buf, data);
-
-		frame->data_length = (*data & 254) >> 1;
-		fcs = r_crctable[fcs ^ *data];
-		if ((*data & 1) == 0) {
-			/* Current spec (version 7.1.0) states these kind of frames to be invalid
-			 * Long lost of sync might be caused if we would expect a long
-			 * frame because of an error in length field.
-			 INC_BUF_POINTER(buf,data);
-			 frame->data_length += (*data*128);
-			 fcs = r_crctable[fcs^*data];
-			 length_needed++;
-			 */
-			free(frame);
-			buf->readp = data;
-			buf->flag_found = 0;
-			return gsm0710_buffer_get_frame(buf);
-		}
-		length_needed += frame->data_length;
-		if (!(gsm0710_buffer_length(buf) >= length_needed)) {
-			free(frame);
-			return NULL;
+// Tells, if a character needs the advanced option transparency
+#define IS_STUFFED(c) ((c) == ADV_FLAG || (c) == ADV_ESCAPE || (c) == 0x11 \
+		|| (c) == 0x13)
+
+/* Finds the first character, that needs the advanced option transparency,
+ * vectorized like gsm0710_find_byte().
+ *
+ * RETURNS:
+ * index of the character or len, if there is none
+ */
+static int find_stuffed(const char *p, int len) {
+	int i = 0;
+#if defined(__AVX2__)
+	__m256i flag32 = _mm256_set1_epi8((char) ADV_FLAG);
+	__m256i escape32 = _mm256_set1_epi8((char) ADV_ESCAPE);
+	// XON 0x11 and XOFF 0x13 differ in bit 1 only
+	__m256i xonoff32 = _mm256_set1_epi8(0x11);
+	__m256i bit32 = _mm256_set1_epi8(0x02);
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, flag32),
+						_mm256_cmpeq_epi8(v, escape32)),
+				_mm256_cmpeq_epi8(_mm256_andnot_si256(bit32, v), xonoff32)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i flag16 = _mm_set1_epi8((char) ADV_FLAG);
+	__m128i escape16 = _mm_set1_epi8((char) ADV_ESCAPE);
+	__m128i xonoff16 = _mm_set1_epi8(0x11);
+	__m128i bit16 = _mm_set1_epi8(0x02);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, flag16),
+						_mm_cmpeq_epi8(v, escape16)),
+				_mm_cmpeq_epi8(_mm_andnot_si128(bit16, v), xonoff16)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t flag16 = vdupq_n_u8(ADV_FLAG);
+	uint8x16_t escape16 = vdupq_n_u8(ADV_ESCAPE);
+	uint8x16_t xonoff16 = vdupq_n_u8(0x11);
+	uint8x16_t bit16 = vdupq_n_u8(0x02);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *) p + i);
+		uint8x16_t eq = vorrq_u8(vorrq_u8(vceqq_u8(v, flag16),
+				vceqq_u8(v, escape16)), vceqq_u8(vbicq_u8(v, bit16), xonoff16));
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		if (mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	for (; i < len; i++) {
+		if (IS_STUFFED((unsigned char) p[i]))
+			return i;
+	}
+	return len;
+}
+
+int gsm0710_buffer_write_stuffed(GSM0710_Buffer *buf, const char *input,
+		int count) {
+	char escape[2] = { ADV_ESCAPE, 0 };
+	int i = 0, run, written = 0;
+
+	while (i < count) {
+		// copy the run up to the next special character as is
+		run = find_stuffed(input + i, count - i);
+		written += gsm0710_buffer_write(buf, input + i, run);
+		if ((i += run) < count) {
+			escape[1] = input[i++] ^ ADV_XOR;
+			written += gsm0710_buffer_write(buf, escape, 2);
 		}
-		INC_BUF_POINTER(buf, data);
-		//extract data
-		if (frame->data_length > 0) {
-			if ((frame->data = malloc(sizeof(char) * frame->data_length))) {
-				end = buf->endp - data;
-				if (frame->data_length > end) {
-					memcpy(frame->data, data, end);
-					memcpy(frame->data + end, buf->data,
-							frame->data_length - end);
-					data = buf->data + (frame->data_length - end);
-				} else {
-					memcpy(frame->data, data, frame->data_length);
-					data += frame->data_length;
-					if (data == buf->endp)
-						data = buf->data;
-				}
-				if (FRAME_IS(UI, frame)) {
-					for (end = 0; end < frame->data_length; end++)
-						fcs = r_crctable[fcs ^ (frame->data[end])];
-				}
-			} else {
-				syslog(LOG_ALERT,
-						"Out of memory, when allocating space for frame data.\n");
-				frame->data_length = 0;
+	}
+	return written;
+}
+
+/* Tells, how far the next flag is from the start of the buffer. Both
+ * segments of the buffer are scanned a block at a time.
+ *
+ * PARAMS:
+ * buf    - the buffer
+ * offset - where to start looking
+ * flag   - the flag
+ * RETURNS:
+ * the distance or -1, if there is no flag in the buffer
+ */
+static int find_flag(GSM0710_Buffer *buf, int offset, unsigned char flag) {
+	struct iovec seg[2];
+	int n = gsm0710_buffer_peek(buf, offset, seg,
+			gsm0710_buffer_length(buf) - offset), i, off;
+
+	for (i = 0; i < n; i++) {
+		if ((off = gsm0710_find_byte(seg[i].iov_base, seg[i].iov_len, flag))
+				< (int) seg[i].iov_len)
+			return offset + off;
+		offset += seg[i].iov_len;
+	}
+	return -1;
+}
+
+/* Moves the start of the buffer right after the next start flag.
+ *
+ * RETURNS:
+ * 1 if a flag was found, 0 if the buffer was exhausted
+ */
+static int find_start_flag(GSM0710_Buffer *buf) {
+	int off;
+
+	if ((off = find_flag(buf, 0, F_FLAG)) < 0) {
+		gsm0710_buffer_clear(buf);
+		return 0;
+	}
+	gsm0710_buffer_consume(buf, off + 1);
+	buf->flag_found = 1;
+	return 1;
+}
+
+int gsm0710_buffer_get_frame_view(GSM0710_Buffer *buf, GSM0710_FrameView *view) {
+	int length_needed, i;
+	unsigned int start, pos;
+	unsigned char fcs, c;
+
+	buf->incomplete = 0;
+	for (;;) {
+		// Find start flag
+		if (!buf->flag_found && !find_start_flag(buf)) // no frame started
+			return 0;
+
+		// skip empty frames (this causes troubles if we're using DLC 62)
+		while (gsm0710_buffer_length(buf) > 0
+				&& (unsigned char) BUF_AT(buf, buf->tail) == F_FLAG) {
+			gsm0710_buffer_consume(buf, 1);
+		}
+
+		length_needed = 5; // channel, type, length, fcs, flag
+		if (gsm0710_buffer_length(buf) < length_needed) {
+			buf->incomplete = gsm0710_buffer_length(buf) > 0;
+			return 0;
+		}
+
+		// a rejected candidate is resynchronized from here, i.e. from the
+		// byte following its start flag
+		start = pos = buf->tail;
+		fcs = 0xFF;
+
+		c = BUF_AT(buf, pos++);
+		view->channel = ((c & 252) >> 2);
+		fcs = gsm0710_crctable[fcs ^ c];
+
+		c = BUF_AT(buf, pos++);
+		view->control = c;
+		fcs = gsm0710_crctable[fcs ^ c];
+
+		c = BUF_AT(buf, pos);
+		view->data_length = (c & 254) >> 1;
+		fcs = gsm0710_crctable[fcs ^ c];
+		if ((c & 1) == 0) {
+			// two octet length
+			if (gsm0710_buffer_length(buf) < ++length_needed) {
+				buf->incomplete = 1;
+				return 0;
 			}
+			c = BUF_AT(buf, ++pos);
+			view->data_length += (c * 128);
+			fcs = gsm0710_crctable[fcs ^ c];
+		}
+		// an error in the length field mustn't make us wait for a frame,
+		// which can't be valid or doesn't even fit to the buffer
+		if (view->data_length > buf->frame_limit) {
+			if (DEBUG_ENABLED)
+				syslog(LOG_DEBUG, "Dropping frame: %d characters exceed N1\n",
+						view->data_length);
+			TRACE(buf, view->channel, view->control, view->data_length,
+					TRACE_RX_LENGTH);
+			buf->dropped_count++;
+			buf->dropped_length++;
+			goto resync;
 		}
+		length_needed += view->data_length;
+		if (!(gsm0710_buffer_length(buf) >= length_needed)) {
+			buf->incomplete = 1;
+			return 0;
+		}
+		pos++;
+		// check end flag first, a false start flag mustn't cost the FCS
+		// of all the data its length field claims
+		c = BUF_AT(buf, pos + view->data_length + 1);
+		if (c != F_FLAG) {
+			if (DEBUG_ENABLED)
+				syslog(LOG_DEBUG,
+						"Dropping frame: End flag not found. Instead: %d\n", c);
+			TRACE(buf, view->channel, view->control, view->data_length,
+					TRACE_RX_FLAG);
+			buf->dropped_count++;
+			buf->dropped_flag++;
+			goto resync;
+		}
+		// locate data
+		view->segments = gsm0710_buffer_peek(buf, pos - start, view->seg,
+				view->data_length);
+		if (FRAME_IS(UI, view)) {
+			for (i = 0; i < view->segments; i++)
+				fcs = gsm0710_fcs_update(fcs, view->seg[i].iov_base,
+						view->seg[i].iov_len);
+		}
+		pos += view->data_length;
 		// check FCS
-		if (r_crctable[fcs ^ (*data)] != 0xCF) {
-			syslog(LOG_INFO, "Dropping frame: FCS doesn't match\n");
-			destroy_frame(frame);
-			buf->flag_found = 0;
+		if (gsm0710_crctable[fcs ^ (unsigned char) BUF_AT(buf, pos)]
+				!= FCS_GOOD) {
+			if (DEBUG_ENABLED)
+				syslog(LOG_DEBUG, "Dropping frame: FCS doesn't match\n");
+			TRACE(buf, view->channel, view->control, view->data_length,
+					TRACE_RX_FCS);
 			buf->dropped_count++;
-			buf->readp = data;
-			return gsm0710_buffer_get_frame(buf);
-		} else {
-			// check end flag
-			INC_BUF_POINTER(buf, data);
-			if (*data != F_FLAG) {
-				syslog(LOG_WARNING,
-						"Dropping frame: End flag not found. Instead: %d\n",
-						*data);
-				destroy_frame(frame);
-				buf->flag_found = 0;
-				buf->dropped_count++;
-				buf->readp = data;
-				return gsm0710_buffer_get_frame(buf);
-			} else {
-				buf->received_count++;
+			buf->dropped_fcs++;
+			goto resync;
+		}
+		TRACE(buf, view->channel, view->control, view->data_length, TRACE_RX);
+		buf->received_count++;
+		buf->tail = pos + 2;
+		return 1;
+
+resync:
+		buf->tail = start;
+		buf->flag_found = 0;
+	}
+}
+
+/* Removes the advanced option transparency from count characters and
+ * appends them to a frame. Runs without control escapes are copied as a
+ * whole.
+ *
+ * PARAMS:
+ * p      - the characters
+ * count  - number of characters
+ * frame  - the frame
+ * len    - the length of the frame so far
+ * limit  - the longest frame
+ * escape - set, if the last character was a control escape
+ * RETURNS:
+ * the new length of the frame or -1, if it would be longer than limit
+ */
+static int unstuff(const char *p, int count, char *frame, int len, int limit,
+		int *escape) {
+	int run;
+
+	while (count > 0) {
+		if (*escape) {
+			if (len >= limit)
+				return -1;
+			frame[len++] = *p++ ^ ADV_XOR;
+			count--;
+			*escape = 0;
+			continue;
+		}
+		run = gsm0710_find_byte(p, count, ADV_ESCAPE);
+		if (len + run > limit)
+			return -1;
+		memcpy(frame + len, p, run);
+		len += run;
+		p += run;
+		if ((count -= run) > 0) {
+			*escape = 1;
+			p++;
+			count--;
+		}
+	}
+	return len;
+}
+
+int gsm0710_buffer_get_adv_frame_view(GSM0710_Buffer *buf,
+		GSM0710_FrameView *view) {
+	struct iovec seg[2];
+	// address, control and FCS around the data
+	int limit = buf->frame_limit + 3;
+	int end, n, i, len, escape;
+	unsigned char fcs;
+	char *frame;
+
+	buf->incomplete = 0;
+	if (buf->frame_space < limit) {
+		if (!(frame = realloc(buf->frame, limit)))
+			return 0;
+		buf->frame = frame;
+		buf->frame_space = limit;
+	}
+	for (;;) {
+		// characters before the first flag don't belong to any frame
+		if (!buf->flag_found) {
+			if ((end = find_flag(buf, 0, ADV_FLAG)) < 0) {
+				gsm0710_buffer_clear(buf);
+				return 0;
 			}
-			INC_BUF_POINTER(buf, data);
+			gsm0710_buffer_consume(buf, end + 1);
+			buf->flag_found = 1;
+			buf->scanned = 0;
+		}
+
+		// the characters scanned by the previous calls hold no flag, so a
+		// long frame arriving in small reads is scanned once
+		if ((end = find_flag(buf, min(buf->scanned,
+				gsm0710_buffer_length(buf)), ADV_FLAG)) < 0) {
+			buf->scanned = gsm0710_buffer_length(buf);
+			// a full buffer is left to the overflow policy
+			buf->incomplete = gsm0710_buffer_length(buf) > 0;
+			return 0;
+		}
+		n = gsm0710_buffer_peek(buf, 0, seg, end);
+		escape = 0;
+		if (n == 1 && gsm0710_find_byte(seg[0].iov_base, end, ADV_ESCAPE)
+				== end) {
+			// nothing to unstuff, the frame is used in place
+			frame = seg[0].iov_base;
+			len = (end <= limit) ? end : -1;
+		} else {
+			frame = buf->frame;
+			for (i = 0, len = 0; i < n && len >= 0; i++)
+				len = unstuff(seg[i].iov_base, seg[i].iov_len, frame, len,
+						limit, &escape);
+		}
+		// the closing flag may open the next frame
+		gsm0710_buffer_consume(buf, end + 1);
+		buf->scanned = 0;
+		if (end == 0)
+			continue;
+
+		// address, control and FCS at least, within N1, no aborted escape
+		if (len < 3 || escape || !(frame[0] & EA)) {
+			TRACE(buf, TRACE_NO_DLC, 0, len, TRACE_RX_LENGTH);
+			buf->dropped_count++;
+			buf->dropped_length++;
+			continue;
+		}
+		view->channel = (frame[0] & 252) >> 2;
+		view->control = frame[1];
+		view->data_length = len - 3;
+		fcs = gsm0710_fcs_update(0xFF, frame, 2);
+		if (FRAME_IS(UI, view))
+			fcs = gsm0710_fcs_update(fcs, frame + 2, view->data_length);
+		if (gsm0710_crctable[fcs ^ (unsigned char) frame[len - 1]] != FCS_GOOD) {
+			if (DEBUG_ENABLED)
+				syslog(LOG_DEBUG, "Dropping frame: FCS doesn't match\n");
+			TRACE(buf, view->channel, view->control, view->data_length,
+					TRACE_RX_FCS);
+			buf->dropped_count++;
+			buf->dropped_fcs++;
+			continue;
+		}
+		view->segments = (view->data_length > 0) ? 1 : 0;
+		view->seg[0].iov_base = frame + 2;
+		view->seg[0].iov_len = view->data_length;
+		TRACE(buf, view->channel, view->control, view->data_length, TRACE_RX);
+		buf->received_count++;
+		return 1;
+	}
+}
+
+int gsm0710_buffer_make_room(GSM0710_Buffer *buf, unsigned char flag) {
+	int off;
+
+	if (gsm0710_buffer_free(buf) > 0)
+		return gsm0710_buffer_free(buf);
+	switch (buf->overflow) {
+	case GSM0710_OVERFLOW_GROW:
+		if (buf->size < GSM0710_BUFFER_MAX
+				&& gsm0710_buffer_resize(buf, buf->size * 2) == 0) {
+			buf->grown_count++;
+			SYSLOG(LOG_INFO, "Input buffer grown to %u bytes\n", buf->size);
+			return gsm0710_buffer_free(buf);
+		}
+		// fall through, drop when the buffer can't grow any more
+	case GSM0710_OVERFLOW_DROP:
+		// the oldest frame ends, where the next flag is found
+		for (off = 0; off < gsm0710_buffer_length(buf)
+				&& (unsigned char) BUF_AT(buf, buf->tail + off) == flag; off++)
+			;
+		if ((off = find_flag(buf, off, flag)) < 0)
+			off = gsm0710_buffer_length(buf);
+		gsm0710_buffer_consume(buf, off);
+		buf->flag_found = 0;
+		buf->incomplete = 0;
+		buf->dropped_count++;
+		buf->discarded_count++;
+		buf->discarded_bytes += off;
+		TRACE(buf, TRACE_NO_DLC, 0, off, TRACE_RX_OVERFLOW);
+		if (DEBUG_ENABLED)
+			syslog(LOG_DEBUG,
+					"Dropping frame: %d characters overflow the buffer\n", off);
+		return gsm0710_buffer_free(buf);
+	default:
+		buf->stopped_count++;
+		return 0;
+	}
+}
+
+void gsm0710_buffer_skip_frame(GSM0710_Buffer *buf) {
+	// the start of the buffer is still right after the start flag
+	buf->flag_found = 0;
+	buf->incomplete = 0;
+	TRACE(buf, TRACE_NO_DLC, 0, gsm0710_buffer_length(buf), TRACE_RX_STALL);
+	buf->dropped_count++;
+	buf->dropped_stall++;
+}
+
+int gsm0710_frame_view_copy(const GSM0710_FrameView *view, char *output,
+		int count) {
+	int i, c, copied = 0;
+
+	for (i = 0; i < view->segments && copied < count; i++) {
+		c = min((int) view->seg[i].iov_len, count - copied);
+		memcpy(output + copied, view->seg[i].iov_base, c);
+		copied += c;
+	}
+	return copied;
+}
+
+GSM0710_Frame *gsm0710_buffer_get_frame(GSM0710_Buffer *buf) {
+	GSM0710_FrameView view;
+	GSM0710_Frame *frame;
+
+	if (!gsm0710_buffer_get_frame_view(buf, &view))
+		return NULL;
+	if (!(frame = malloc(sizeof(GSM0710_Frame)))) {
+		SYSLOG(LOG_ALERT, "Out of memory, when allocating space for frame.\n");
+		return NULL;
+	}
+	frame->channel = view.channel;
+	frame->control = view.control;
+	frame->data_length = view.data_length;
+	frame->data = NULL;
+	if (frame->data_length > 0) {
+		if ((frame->data = malloc(sizeof(char) * frame->data_length))) {
+			gsm0710_frame_view_copy(&view, frame->data, frame->data_length);
+		} else {
+			SYSLOG(LOG_ALERT,
+					"Out of memory, when allocating space for frame data.\n");
+			frame->data_length = 0;
 		}
-		buf->readp = data;
 	}
 	return frame;
 }
 
-void destroy_frame(GSM0710_Frame *frame) {
+void gsm0710_frame_destroy(GSM0710_Frame *frame) {
 	if (frame->data_length > 0)
 		free(frame->data);
 	free(frame);
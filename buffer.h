@@ -24,9 +24,9 @@
  *
  */
 
-#ifndef min
-#define min(a,b) ((a < b) ? a :b)
-#endif 
+#include <sys/uio.h>
+
+struct GSM0710_Trace;
 
 typedef struct GSM0710_Frame {
 	unsigned char channel;
@@ -35,28 +35,120 @@ typedef struct GSM0710_Frame {
 	char *data;
 } GSM0710_Frame;
 
+/* A frame located in the receive buffer. The payload is not copied, it is
+ * described by one or two segments pointing straight into the buffer (two
+ * when the payload wraps around the end of the buffer). A view stays valid
+ * until the buffer is written to again.
+ */
+typedef struct GSM0710_FrameView {
+	unsigned char channel;
+	unsigned char control;
+	int data_length;
+	int segments;
+	struct iovec seg[2];
+} GSM0710_FrameView;
+
+// the default size of a buffer
 #define GSM0710_BUFFER_SIZE 2048
+// the longest frame data, which fits to a default buffer with the header
+#define GSM0710_BUFFER_FRAME_MAX (GSM0710_BUFFER_SIZE - 8)
+// a buffer doesn't grow beyond this
+#define GSM0710_BUFFER_MAX (1 << 20)
+
+// what to do, when there is no room for received characters
+#define GSM0710_OVERFLOW_STOP 0 // stop reading until a frame is consumed
+#define GSM0710_OVERFLOW_GROW 1 // double the size of the buffer
+#define GSM0710_OVERFLOW_DROP 2 // drop the oldest, partial frame
 
+/* A ring of a power of two size. head and tail run freely and are masked
+ * when the data is accessed, so the length is a plain subtraction and a
+ * full buffer needs no spare character.
+ *
+ * The pages of a mirrored buffer are mapped twice, back to back, so
+ * data + size aliases data and any span of up to size characters is
+ * contiguous, even across the wrap point.
+ */
 typedef struct GSM0710_Buffer {
-	char data[GSM0710_BUFFER_SIZE];
-	char *readp;
-	char *writep;
-	char *endp;
+	char *data;
+	int mirrored;
+	unsigned int size;
+	unsigned int mask; // size - 1
+	unsigned int head; // where the next character is written
+	unsigned int tail; // the oldest character
 	int flag_found; // set if last character read was flag
 	unsigned long received_count;
-	unsigned long dropped_count;
+	unsigned long dropped_count; // all reasons below together
+	unsigned long dropped_fcs;
+	unsigned long dropped_flag; // end flag missing
+	unsigned long dropped_length; // above N1 or malformed
+	unsigned long dropped_stall; // rest of the frame not received
+	int frame_limit; // longest frame data accepted (N1)
+	int incomplete; // set if a started frame waits for more characters
+	char *frame; // an unstuffed advanced option frame
+	int frame_space; // size of frame
+	int scanned; // characters after the start flag known to hold no flag
+	// the overflow policy and how often it has been applied
+	int overflow;
+	unsigned long stopped_count;
+	unsigned long grown_count;
+	unsigned long discarded_count; // partial frames
+	unsigned long discarded_bytes;
+	// received frames are recorded here, if not NULL, as coming from
+	// multiplexer trace_source
+	struct GSM0710_Trace *trace;
+	int trace_source;
 } GSM0710_Buffer;
 
-// increases buffer pointer by one and wraps around if necessary
-#define INC_BUF_POINTER(buf,p) p++; if (p == buf->endp) p = buf->data;
-
-/* Allocates memory for a new buffer and initializes it.
+/* Allocates memory for a new buffer of the default size and initializes
+ * it. The overflow policy is GSM0710_OVERFLOW_STOP.
  *
  * RETURNS:
  * the pointer to a new buufer
  */
 GSM0710_Buffer *gsm0710_buffer_init();
 
+/* Allocates memory for a new buffer and initializes it.
+ *
+ * PARAMS:
+ * size - capacity in characters, rounded up to a power of two
+ * RETURNS:
+ * the pointer to a new buffer or NULL, if out of memory
+ */
+GSM0710_Buffer *gsm0710_buffer_init_size(unsigned int size);
+
+/* Allocates memory for a new mirrored buffer and initializes it. Falls
+ * back to a plain buffer, if the system can't map memory twice.
+ *
+ * PARAMS:
+ * size - capacity in characters, rounded up to a power of two and to
+ *        whole pages
+ * RETURNS:
+ * the pointer to a new buffer or NULL, if out of memory
+ */
+GSM0710_Buffer *gsm0710_buffer_init_mirrored(unsigned int size);
+
+/* Changes the size of a buffer, keeping its contents. Frame views into the
+ * buffer become invalid.
+ *
+ * PARAMS:
+ * buf  - the buffer
+ * size - the new capacity, rounded up to a power of two and at least
+ *        the length of the contents
+ * RETURNS:
+ * 0 on success, -1 if out of memory
+ */
+int gsm0710_buffer_resize(GSM0710_Buffer *buf, unsigned int size);
+
+/* Moves a buffer to mirrored or plain storage, keeping its contents. A
+ * mirrored buffer is rounded up to whole pages and stays plain, if the
+ * system can't map memory twice. Frame views into the buffer become
+ * invalid.
+ *
+ * RETURNS:
+ * 0 on success, -1 if out of memory
+ */
+int gsm0710_buffer_set_mirrored(GSM0710_Buffer *buf, int mirrored);
+
 /* Destroys the buffer (i.e. frees up the memory
  *
  * PARAMS:
@@ -68,12 +160,43 @@ void gsm0710_buffer_destroy(GSM0710_Buffer *buf);
  *
  */
 //int gsm0710_buffer_length(GSM0710_Buffer *buf);
-#define gsm0710_buffer_length(buf) ((buf->readp > buf->writep) ? (GSM0710_BUFFER_SIZE - (buf->readp - buf->writep)) : (buf->writep-buf->readp))
+#define gsm0710_buffer_length(buf) ((int) ((buf)->head - (buf)->tail))
 
-/* Tells, how much free space there is in the buffer
+/* Tells, how much free space there is in the buffer.
  */
 //int gsm0710_buffer_free(GSM0710_Buffer *buf);
-#define gsm0710_buffer_free(buf) ((buf->readp > buf->writep) ? (buf->readp - buf->writep) : (GSM0710_BUFFER_SIZE - (buf->writep-buf->readp)))
+#define gsm0710_buffer_free(buf) ((int) ((buf)->size - ((buf)->head - (buf)->tail)))
+
+// Removes count characters from the start of the buffer
+#define gsm0710_buffer_consume(buf, count) ((buf)->tail += (count))
+
+// Removes all characters from the buffer
+#define gsm0710_buffer_clear(buf) ((buf)->tail = (buf)->head)
+
+/* Describes characters in the buffer without copying them. A mirrored
+ * buffer always returns a single segment.
+ *
+ * PARAMS:
+ * buf    - the buffer
+ * offset - position of the characters counted from the oldest one
+ * seg    - filled in with one or two segments pointing into the buffer
+ * count  - number of characters, offset + count must not exceed the length
+ * RETURNS:
+ * number of segments used, 0 if count is 0
+ */
+int gsm0710_buffer_peek(GSM0710_Buffer *buf, unsigned int offset,
+		struct iovec seg[2], unsigned int count);
+
+/* Makes room for received characters in a full buffer according to its
+ * overflow policy.
+ *
+ * PARAMS:
+ * buf  - the buffer
+ * flag - the flag, which starts the frames in the buffer
+ * RETURNS:
+ * the free space, 0 if the reader has to wait for a frame to be consumed
+ */
+int gsm0710_buffer_make_room(GSM0710_Buffer *buf, unsigned char flag);
 
 /* Tries to read count number of chars from the buffer
  *
@@ -110,28 +233,147 @@ int gsm0710_buffer_write2ch(GSM0710_Buffer *buf, int channel, const char *input,
  */
 int gsm0710_buffer_write(GSM0710_Buffer *buf, const char *input, int count);
 
-/* Gets a frame from buffer. You have to remember to free this frame
- * when it's not needed anymore
+/* Writes data to the buffer and feeds it to a FCS register in the same pass
+ *
+ * PARAMS
+ * buf     - pointer to the buffer
+ * input   - input data (in user memory)
+ * count   - how many characters should be written
+ * fcs     - the FCS register to update
+ * RETURNS
+ * number of characters written
+ */
+int gsm0710_buffer_write_fcs(GSM0710_Buffer *buf, const char *input, int count,
+		unsigned char *fcs);
+
+/* Writes data to the buffer with advanced option transparency, i.e. flag,
+ * control escape, XON and XOFF characters are replaced by the control
+ * escape and the character with bit 5 complemented. The caller must make
+ * sure, that 2 * count characters fit.
+ *
+ * PARAMS
+ * buf     - pointer to the buffer
+ * input   - input data (in user memory)
+ * count   - how many characters should be written
+ * RETURNS
+ * number of characters written to the buffer
+ */
+int gsm0710_buffer_write_stuffed(GSM0710_Buffer *buf, const char *input,
+		int count);
+
+/* Reads or writes like readv() and writev(), e.g. a serial port in a way
+ * of its own. ctx is passed through.
+ */
+typedef ssize_t (*GSM0710_IoFunc)(void *ctx, const struct iovec *iov,
+		int iovcnt);
+
+/* Reads from a file descriptor straight into the free space of the buffer
+ * with a single readv, which is retried if a signal interrupts it
+ *
+ * PARAMS
+ * buf     - pointer to the buffer
+ * fd      - file descriptor to read from
+ * count   - how many characters to read at most
+ * RETURNS
+ * number of characters read, 0 at end of file or -1 on error (errno is
+ * set as by read)
+ */
+int gsm0710_buffer_fill(GSM0710_Buffer *buf, int fd, int count);
+
+/* Writes as much of the buffer contents as the file descriptor accepts
+ * without blocking and removes the written characters from the buffer
+ *
+ * PARAMS
+ * buf     - pointer to the buffer
+ * fd      - file descriptor to write to
+ * RETURNS
+ * number of characters written or -1 on error
+ */
+int gsm0710_buffer_flush(GSM0710_Buffer *buf, int fd);
+
+/* Like gsm0710_buffer_fill() and gsm0710_buffer_flush(), but the
+ * characters are read or written by an I/O function
+ */
+int gsm0710_buffer_fill_io(GSM0710_Buffer *buf, GSM0710_IoFunc io,
+		void *ctx, int count);
+int gsm0710_buffer_flush_io(GSM0710_Buffer *buf, GSM0710_IoFunc io,
+		void *ctx);
+
+/* Finds the first occurrence of a character. The search is vectorized with
+ * SSE2/AVX2 or NEON when the compiler targets them.
+ *
+ * PARAMS:
+ * p   - characters to search
+ * len - number of characters
+ * c   - the character to find
+ * RETURNS:
+ * index of the first occurrence or len, if c wasn't found
+ */
+int gsm0710_find_byte(const char *p, int len, unsigned char c);
+
+/* Gets a frame from buffer without copying or allocating anything. The
+ * payload segments of the view point into the buffer and are only valid
+ * until the next write to the buffer. Invalid frames are skipped and the
+ * search for the next frame continues from the byte following their start
+ * flag. The end flag is checked before the FCS of a UI frame's data is
+ * computed, so false start flags cost no more than their header.
  *
  * PARAMS:
  * buf   - the buffer, where the frame is extracted
+ * view  - filled in with the channel, control and payload segments
  * RETURNS:
- * frame or null, if there isn't ready frame with given index
+ * 1 if a frame was extracted, 0 if there isn't a ready frame
  */
-GSM0710_Frame *gsm0710_buffer_get_frame(GSM0710_Buffer *buf);
+int gsm0710_buffer_get_frame_view(GSM0710_Buffer *buf, GSM0710_FrameView *view);
 
-// destroys a frame
-void destroy_frame(GSM0710_Frame *frame);
+/* Gets an advanced option frame from buffer. Frames are delimited by flags
+ * only, so the parser resynchronizes on every flag. A contiguous frame
+ * without control escapes is used in place, otherwise the transparency is
+ * removed into a scratch area of the buffer. Either way the payload
+ * segment of the view stays valid until the next call or write. Invalid
+ * frames are skipped.
+ *
+ * PARAMS:
+ * buf   - the buffer, where the frame is extracted
+ * view  - filled in with the channel, control and payload
+ * RETURNS:
+ * 1 if a frame was extracted, 0 if there isn't a ready frame
+ */
+int gsm0710_buffer_get_adv_frame_view(GSM0710_Buffer *buf,
+		GSM0710_FrameView *view);
 
-/* Calculates frame check sequence from given characters.
+/* Gives up the frame, which is waiting for more characters. The parser
+ * resynchronizes on the next flag after its start flag. Used, when the
+ * rest of a frame doesn't arrive, e.g. because of a corrupted length.
  *
  * PARAMS:
- * input - character array
- * count - number of characters in array (that are included)
+ * buf   - the buffer
+ */
+void gsm0710_buffer_skip_frame(GSM0710_Buffer *buf);
+
+/* Copies the payload of a frame view into contiguous memory
+ *
+ * PARAMS:
+ * view   - the frame view
+ * output - where to copy the payload
+ * count  - size of output
  * RETURNS:
- * frame check sequence
+ * number of characters copied
  */
-unsigned char make_fcs(const unsigned char *input, int count);
+int gsm0710_frame_view_copy(const GSM0710_FrameView *view, char *output,
+		int count);
 
-#endif /* _GSM0710_BUFFER_H_ */
+/* Gets a frame from buffer. You have to remember to free this frame
+ * when it's not needed anymore
+ *
+ * PARAMS:
+ * buf   - the buffer, where the frame is extracted
+ * RETURNS:
+ * frame or null, if there isn't ready frame with given index
+ */
+GSM0710_Frame *gsm0710_buffer_get_frame(GSM0710_Buffer *buf);
 
+// destroys a frame
+void gsm0710_frame_destroy(GSM0710_Frame *frame);
+
+#endif /* _GSM0710_BUFFER_H_ */
@@ -0,0 +1,338 @@
+/*
+ * capture.c -- Implementation of functions defined in capture.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+// To get accept4
+#define _GNU_SOURCE
+#endif
+#include "capture.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static const GSM0710_CaptureHeader file_header = {
+	CAPTURE_MAGIC, CAPTURE_VERSION, sizeof(GSM0710_CaptureRecord)
+};
+
+// Writes all of an I/O vector, returns -1 on error
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (; iovcnt > 0 && n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void add_client(GSM0710_Capture *c, int fd) {
+	if (c->numOfClients >= CAPTURE_CLIENTS
+			|| send(fd, &file_header, sizeof(file_header), MSG_NOSIGNAL)
+					!= sizeof(file_header)) {
+		close(fd);
+		return;
+	}
+	c->clients[c->numOfClients++] = fd;
+}
+
+/* Sends records to the tap clients. A client, which doesn't take them at
+ * once, would get a broken stream and is disconnected.
+ */
+static void send_clients(GSM0710_Capture *c, struct iovec *seg, int segments,
+		int count) {
+	struct msghdr msg;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = seg;
+	msg.msg_iovlen = segments;
+	for (i = 0; i < c->numOfClients; ) {
+		if (sendmsg(c->clients[i], &msg, MSG_NOSIGNAL | MSG_DONTWAIT)
+				== count) {
+			i++;
+			continue;
+		}
+		SYSLOG(LOG_INFO, "Capture tap client disconnected.\n");
+		close(c->clients[i]);
+		c->clients[i] = c->clients[--c->numOfClients];
+	}
+}
+
+// Writes everything in the ring. The records are pushed as units, so the
+// ring always ends at a record boundary.
+static void drain(GSM0710_Capture *c) {
+	struct iovec seg[2];
+	unsigned int count;
+	int segments;
+
+	while ((count = gsm0710_spsc_length(c->ring)) > 0) {
+		segments = gsm0710_spsc_peek(c->ring, 0, seg, count);
+		if (c->numOfClients > 0)
+			send_clients(c, seg, segments, count);
+		if (c->fd >= 0 && writev_all(c->fd, seg, segments) != 0) {
+			SYSLOG(LOG_ERR, "Can't write the capture file. %s (%d).\n",
+					strerror(errno), errno);
+			close(c->fd);
+			c->fd = -1;
+		}
+		gsm0710_spsc_consume(c->ring, count);
+	}
+}
+
+static void *writer_thread(void *arg) {
+	GSM0710_Capture *c = arg;
+	struct pollfd fds[3];
+	int fd;
+
+	fds[0].fd = c->stop_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = c->ring->data_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = c->listen_fd;
+	fds[2].events = POLLIN;
+	for (;;) {
+		if (poll(fds, 3, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			SYSLOG(LOG_ERR, "Capture writer failed. %s (%d).\n",
+					strerror(errno), errno);
+			break;
+		}
+		if (fds[1].revents)
+			gsm0710_spsc_clear(c->ring->data_fd);
+		drain(c);
+		// new clients start at a record boundary
+		if (fds[2].revents) {
+			while ((fd = accept4(c->listen_fd, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+				add_client(c, fd);
+		}
+		if (fds[0].revents) {
+			drain(c);
+			break;
+		}
+	}
+	return NULL;
+}
+
+// Creates the listening tap socket, replacing a stale one
+static int listen_tap(const char *path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		SYSLOG(LOG_ERR, "Tap socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+			< 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+			|| listen(fd, CAPTURE_CLIENTS) != 0) {
+		SYSLOG(LOG_ERR, "Can't listen on %s. %s (%d).\n", path,
+				strerror(errno), errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+GSM0710_Capture *gsm0710_capture_open(const char *path, const char *tap) {
+	GSM0710_Capture *c;
+	sigset_t all, old;
+	int err;
+
+	if (!(c = calloc(1, sizeof(GSM0710_Capture))))
+		return NULL;
+	c->fd = c->listen_fd = c->stop_fd = -1;
+	pthread_mutex_init(&c->lock, NULL);
+	atomic_init(&c->lost, 0);
+	if (!(c->ring = gsm0710_spsc_init(CAPTURE_RING_SIZE))
+			|| (c->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail;
+	if (path) {
+		if ((c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				0644)) < 0) {
+			SYSLOG(LOG_ERR, "Can't open %s. %s (%d).\n", path,
+					strerror(errno), errno);
+			goto fail;
+		}
+		if (write(c->fd, &file_header, sizeof(file_header))
+				!= sizeof(file_header))
+			goto fail;
+	}
+	if (tap) {
+		if ((c->listen_fd = listen_tap(tap)) < 0)
+			goto fail;
+		c->tap_path = strdup(tap);
+	}
+	// signals are handled by the main thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&c->thread, NULL, writer_thread, c);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err == 0)
+		return c;
+	SYSLOG(LOG_ERR, "Can't start the capture writer. %s (%d).\n",
+			strerror(err), err);
+fail:
+	if (c->fd >= 0)
+		close(c->fd);
+	if (c->listen_fd >= 0) {
+		close(c->listen_fd);
+		unlink(tap);
+	}
+	if (c->stop_fd >= 0)
+		close(c->stop_fd);
+	gsm0710_spsc_destroy(c->ring);
+	free(c->tap_path);
+	free(c);
+	return NULL;
+}
+
+void gsm0710_capture_close(GSM0710_Capture *c) {
+	uint64_t one = 1;
+	int i;
+
+	if (!c)
+		return;
+	if (write(c->stop_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(c->thread, NULL);
+	if (atomic_load(&c->lost) > 0)
+		SYSLOG(LOG_WARNING, "Capture lost %lu records.\n",
+				atomic_load(&c->lost));
+	for (i = 0; i < c->numOfClients; i++)
+		close(c->clients[i]);
+	if (c->fd >= 0)
+		close(c->fd);
+	if (c->listen_fd >= 0) {
+		close(c->listen_fd);
+		unlink(c->tap_path);
+	}
+	close(c->stop_fd);
+	gsm0710_spsc_destroy(c->ring);
+	pthread_mutex_destroy(&c->lock);
+	free(c->tap_path);
+	free(c);
+}
+
+void gsm0710_capture_write(GSM0710_Capture *c, int source, int type, int dlc,
+		int control, const struct iovec *iov, int iovcnt) {
+	GSM0710_CaptureRecord rec;
+	struct iovec v[3];
+	struct timespec ts;
+	int i;
+
+	// a header and up to two segments, e.g. of a ring
+	if (iovcnt > 2)
+		iovcnt = 2;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.time = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	rec.length = 0;
+	rec.type = type;
+	rec.source = source;
+	rec.dlc = dlc;
+	rec.control = control;
+	v[0].iov_base = &rec;
+	v[0].iov_len = sizeof(rec);
+	for (i = 0; i < iovcnt; i++) {
+		v[i + 1] = iov[i];
+		rec.length += iov[i].iov_len;
+	}
+	pthread_mutex_lock(&c->lock);
+	if (gsm0710_spsc_push(c->ring, v, 1 + iovcnt) != 0)
+		atomic_fetch_add(&c->lost, 1);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void gsm0710_capture_buffer(GSM0710_Capture *c, int source, int type,
+		GSM0710_Buffer *buf, unsigned int pos, unsigned int count) {
+	struct iovec seg[2];
+	unsigned int first = buf->size - (pos & buf->mask);
+
+	seg[0].iov_base = buf->data + (pos & buf->mask);
+	seg[0].iov_len = min(count, first);
+	seg[1].iov_base = buf->data;
+	seg[1].iov_len = count - seg[0].iov_len;
+	gsm0710_capture_write(c, source, type, 0, 0, seg,
+			(seg[1].iov_len > 0) ? 2 : 1);
+}
+
+char *gsm0710_capture_load(const char *path, size_t *length) {
+	GSM0710_CaptureHeader header;
+	struct stat st;
+	char *data = NULL;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb")))
+		return NULL;
+	if (fstat(fileno(f), &st) != 0 || st.st_size < sizeof(header)
+			|| fread(&header, sizeof(header), 1, f) != 1
+			|| memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != CAPTURE_VERSION
+			|| header.record_size != sizeof(GSM0710_CaptureRecord)) {
+		errno = EINVAL;
+		goto out;
+	}
+	*length = st.st_size - sizeof(header);
+	if ((data = malloc(*length + 1)) && fread(data, 1, *length, f) != *length) {
+		free(data);
+		data = NULL;
+	}
+out:
+	fclose(f);
+	return data;
+}
+
+int gsm0710_capture_next(const char **p, const char *end,
+		GSM0710_CaptureRecord *rec, const char **data) {
+	if (end - *p < sizeof(GSM0710_CaptureRecord))
+		return 0;
+	memcpy(rec, *p, sizeof(GSM0710_CaptureRecord));
+	if (end - *p - sizeof(GSM0710_CaptureRecord) < rec->length)
+		return 0;
+	*data = *p + sizeof(GSM0710_CaptureRecord);
+	*p = *data + rec->length;
+	return 1;
+}
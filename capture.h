@@ -0,0 +1,140 @@
+#ifndef _GSM0710_CAPTURE_H_
+#define _GSM0710_CAPTURE_H_
+/*
+ * capture.h -- recording of the serial data and the frames of the
+ *              GSM 0710 multiplexer to a file and a live tap socket
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "spsc.h"
+#include "buffer.h"
+
+// record types
+#define CAPTURE_OPEN 1     // mux mode started, see below
+#define CAPTURE_RX_RAW 2   // characters read from the serial port
+#define CAPTURE_TX_RAW 3   // characters written to the serial port
+#define CAPTURE_RX_FRAME 4 // a received frame, the data is its payload
+#define CAPTURE_TX_FRAME 5 // a frame queued for sending, likewise
+
+/* A record header followed by length characters of data, in the byte
+ * order of the host. The data of CAPTURE_OPEN is the longest frame
+ * accepted (uint32_t) and the name of the serial port, its control is 1
+ * for the advanced option.
+ */
+typedef struct GSM0710_CaptureRecord {
+	uint64_t time;   // CLOCK_REALTIME in microseconds
+	uint32_t length; // of the data
+	uint8_t type;    // CAPTURE_*
+	uint8_t source;  // the multiplexer
+	uint8_t dlc;     // frames only
+	uint8_t control; // frames only
+} GSM0710_CaptureRecord;
+
+// a capture file and the stream of the tap socket start with this
+typedef struct GSM0710_CaptureHeader {
+	char magic[8]; // CAPTURE_MAGIC
+	uint32_t version;
+	uint32_t record_size;
+} GSM0710_CaptureHeader;
+
+#define CAPTURE_MAGIC "GSMCAPT"
+#define CAPTURE_VERSION 1
+// records waiting for the writer thread, more are lost
+#define CAPTURE_RING_SIZE (1 << 20)
+#define CAPTURE_CLIENTS 8
+
+/* The multiplexer threads only copy the records to a ring, a thread of
+ * its own writes them to the file and the tap clients. Producers are
+ * serialized by a mutex, which is held for the copy only.
+ */
+typedef struct GSM0710_Capture {
+	GSM0710_Spsc *ring;
+	pthread_mutex_t lock;
+	int fd;        // the file or -1
+	int listen_fd; // the tap socket or -1
+	char *tap_path;
+	int clients[CAPTURE_CLIENTS];
+	int numOfClients;
+	int stop_fd; // eventfd telling the writer thread to exit
+	pthread_t thread;
+	atomic_ulong lost; // records, which didn't fit to the ring
+} GSM0710_Capture;
+
+/* Starts a capture
+ *
+ * PARAMS:
+ * path - the capture file, which is replaced, or NULL
+ * tap  - path of the tap socket or NULL
+ * RETURNS:
+ * the capture or NULL on error
+ */
+GSM0710_Capture *gsm0710_capture_open(const char *path, const char *tap);
+
+/* Writes the records still in the ring, stops the writer thread and
+ * closes the file and the tap socket
+ */
+void gsm0710_capture_close(GSM0710_Capture *c);
+
+/* Records data. Doesn't block for I/O, a record is lost, if the writer
+ * thread has fallen behind by CAPTURE_RING_SIZE.
+ *
+ * PARAMS:
+ * c       - the capture
+ * source  - the multiplexer
+ * type    - CAPTURE_*
+ * dlc     - the DLC of a frame
+ * control - the control field of a frame
+ * iov     - the data
+ * iovcnt  - number of elements in iov
+ */
+void gsm0710_capture_write(GSM0710_Capture *c, int source, int type, int dlc,
+		int control, const struct iovec *iov, int iovcnt);
+
+/* Records count characters of a buffer from a free running position,
+ * e.g. what has just been read to it or written from it
+ */
+void gsm0710_capture_buffer(GSM0710_Capture *c, int source, int type,
+		GSM0710_Buffer *buf, unsigned int pos, unsigned int count);
+
+/* Reads a whole capture file to memory
+ *
+ * PARAMS:
+ * path   - the file
+ * length - set to the length of the records
+ * RETURNS:
+ * the records following the header, to be freed, or NULL on error
+ */
+char *gsm0710_capture_load(const char *path, size_t *length);
+
+/* Steps through loaded records
+ *
+ * PARAMS:
+ * p    - the next record, advanced past it
+ * end  - end of the records
+ * rec  - filled in with the header
+ * data - set to the data of the record
+ * RETURNS:
+ * 1 if a record was found, 0 at the end or at a truncated record
+ */
+int gsm0710_capture_next(const char **p, const char *end,
+		GSM0710_CaptureRecord *rec, const char **data);
+
+#endif /* _GSM0710_CAPTURE_H_ */
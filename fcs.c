@@ -0,0 +1,367 @@
+/*
+ * fcs.c -- Implementation of functions defined in fcs.h
+ *
+ * The 07.10 FCS is the reversed 8-bit CRC with polynomial x^8+x^2+x+1.
+ * Besides the byte-at-a-time table there are slicing-by-4/8 kernels, which
+ * fold several input bytes per step with precomputed tables, and a kernel
+ * doing a Barrett reduction of 8 bytes at a time with carry-less multiply
+ * (PCLMULQDQ on x86-64, PMULL on AArch64).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "fcs.h"
+#include "internal.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CLMUL_KERNEL 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CLMUL_KERNEL 1
+#endif
+
+const unsigned char gsm0710_crctable[256] = { //reversed, 8-bit, poly=0x07 
+	0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
+	0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
+	0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
+	0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
+	0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
+	0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
+	0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
+	0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
+	0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
+	0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
+	0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
+	0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
+	0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
+	0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
+	0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
+	0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
+	0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
+	0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
+	0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
+	0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
+	0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
+	0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
+	0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
+	0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
+	0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
+	0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
+	0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
+	0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
+	0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
+	0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
+	0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
+	0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF
+};
+
+// r_slicetable[k][x] is the FCS register after x followed by k zero bytes
+static unsigned char r_slicetable[8][256];
+
+static unsigned char fcs_table_update(unsigned char fcs,
+		const unsigned char *input, int count) {
+	int i;
+	for (i = 0; i < count; i++)
+		fcs = gsm0710_crctable[fcs ^ input[i]];
+	return fcs;
+}
+
+static unsigned char fcs_table_copy(unsigned char fcs, char *dst,
+		const char *src, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		dst[i] = src[i];
+		fcs = gsm0710_crctable[fcs ^ (unsigned char) src[i]];
+	}
+	return fcs;
+}
+
+#define SLICE4(fcs, p) \
+	(r_slicetable[3][(fcs) ^ (p)[0]] ^ r_slicetable[2][(p)[1]] \
+	 ^ r_slicetable[1][(p)[2]] ^ r_slicetable[0][(p)[3]])
+
+#define SLICE8(fcs, p) \
+	(r_slicetable[7][(fcs) ^ (p)[0]] ^ r_slicetable[6][(p)[1]] \
+	 ^ r_slicetable[5][(p)[2]] ^ r_slicetable[4][(p)[3]] \
+	 ^ r_slicetable[3][(p)[4]] ^ r_slicetable[2][(p)[5]] \
+	 ^ r_slicetable[1][(p)[6]] ^ r_slicetable[0][(p)[7]])
+
+static unsigned char fcs_slice4_update(unsigned char fcs,
+		const unsigned char *input, int count) {
+	for (; count >= 4; count -= 4, input += 4)
+		fcs = SLICE4(fcs, input);
+	return fcs_table_update(fcs, input, count);
+}
+
+static unsigned char fcs_slice4_copy(unsigned char fcs, char *dst,
+		const char *src, int count) {
+	for (; count >= 4; count -= 4, src += 4, dst += 4) {
+		memcpy(dst, src, 4);
+		fcs = SLICE4(fcs, (const unsigned char *) src);
+	}
+	return fcs_table_copy(fcs, dst, src, count);
+}
+
+static unsigned char fcs_slice8_update(unsigned char fcs,
+		const unsigned char *input, int count) {
+	for (; count >= 8; count -= 8, input += 8)
+		fcs = SLICE8(fcs, input);
+	return fcs_slice4_update(fcs, input, count);
+}
+
+static unsigned char fcs_slice8_copy(unsigned char fcs, char *dst,
+		const char *src, int count) {
+	for (; count >= 8; count -= 8, src += 8, dst += 8) {
+		memcpy(dst, src, 8);
+		fcs = SLICE8(fcs, (const unsigned char *) src);
+	}
+	return fcs_slice4_copy(fcs, dst, src, count);
+}
+
+#ifdef HAVE_CLMUL_KERNEL
+/* Barrett reduction of 64 message bits at a time. With mu = x^72 / P and
+ * all values bit reflected, the quotient of the reflected input word w is
+ * w ^ (clmul(w, rev(mu mod x^64)) << 1). Only the low 8 bits of the
+ * quotient times P = x^8 + x^2 + x + 1 are needed for the remainder, which
+ * is quotient ^ (quotient >> 1) ^ (quotient >> 2) in reflected form.
+ */
+static uint64_t fcs_mu;
+
+#define FCS_REDUCE(q) ((unsigned char) (((q) >> 56) ^ ((q) >> 57) ^ ((q) >> 58)))
+
+#if defined(__x86_64__)
+__attribute__((target("pclmul,sse4.1")))
+static inline uint64_t clmul_low(uint64_t a, uint64_t b) {
+	return _mm_cvtsi128_si64(
+			_mm_clmulepi64_si128(_mm_cvtsi64_si128(a), _mm_cvtsi64_si128(b),
+					0));
+}
+
+static int clmul_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul");
+}
+#define CLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#else
+static inline uint64_t clmul_low(uint64_t a, uint64_t b) {
+	return vgetq_lane_u64(vreinterpretq_u64_p128(vmull_p64(a, b)), 0);
+}
+
+static int clmul_supported(void) {
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#define CLMUL_TARGET
+#endif
+
+CLMUL_TARGET
+static unsigned char fcs_clmul_update(unsigned char fcs,
+		const unsigned char *input, int count) {
+	uint64_t w;
+
+	for (; count >= 8; count -= 8, input += 8) {
+		memcpy(&w, input, 8); // both targets are little endian
+		w ^= fcs;
+		w ^= clmul_low(w, fcs_mu) << 1;
+		fcs = FCS_REDUCE(w);
+	}
+	return fcs_slice4_update(fcs, input, count);
+}
+
+CLMUL_TARGET
+static unsigned char fcs_clmul_copy(unsigned char fcs, char *dst,
+		const char *src, int count) {
+	uint64_t w;
+
+	for (; count >= 8; count -= 8, src += 8, dst += 8) {
+		memcpy(&w, src, 8);
+		memcpy(dst, &w, 8);
+		w ^= fcs;
+		w ^= clmul_low(w, fcs_mu) << 1;
+		fcs = FCS_REDUCE(w);
+	}
+	return fcs_slice4_copy(fcs, dst, src, count);
+}
+
+// floor(x^72 / P) without the x^64 term, bit reflected
+static uint64_t barrett_mu(void) {
+	unsigned __int128 d = (unsigned __int128) 1 << 72;
+	uint64_t q = 0, r = 0;
+	int i;
+
+	for (i = 72; i >= 8; i--) {
+		if ((d >> i) & 1) {
+			d ^= (unsigned __int128) 0x107 << (i - 8);
+			if (i - 8 < 64)
+				q |= (uint64_t) 1 << (i - 8);
+		}
+	}
+	for (i = 0; i < 64; i++)
+		r |= ((q >> i) & 1) << (63 - i);
+	return r;
+}
+#endif
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static pthread_once_t choose_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void) {
+	int k, x;
+
+	for (x = 0; x < 256; x++) {
+		r_slicetable[0][x] = gsm0710_crctable[x];
+		for (k = 1; k < 8; k++)
+			r_slicetable[k][x] = gsm0710_crctable[r_slicetable[k - 1][x]];
+	}
+#ifdef HAVE_CLMUL_KERNEL
+	fcs_mu = barrett_mu();
+#endif
+}
+
+static const GSM0710_FcsKernel kernels[] = {
+#ifdef HAVE_CLMUL_KERNEL
+	{ "clmul", fcs_clmul_update, fcs_clmul_copy },
+#endif
+	{ "slice8", fcs_slice8_update, fcs_slice8_copy },
+	{ "slice4", fcs_slice4_update, fcs_slice4_copy },
+	{ "table", fcs_table_update, fcs_table_copy },
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+// table is the last kernel, usable before gsm0710_fcs_init() is called
+const GSM0710_FcsKernel *gsm0710_fcs = &kernels[NUM_KERNELS - 1];
+
+static int kernel_supported(const GSM0710_FcsKernel *kernel) {
+#ifdef HAVE_CLMUL_KERNEL
+	if (kernel->update == fcs_clmul_update)
+		return clmul_supported();
+#endif
+	return 1;
+}
+
+/* Runs a kernel over pseudo random data of all lengths and alignments up to
+ * a few blocks and compares the results with the byte table.
+ *
+ * RETURNS:
+ * 1 if the kernel agrees with the table, 0 otherwise
+ */
+static int kernel_verify(const GSM0710_FcsKernel *kernel) {
+	unsigned char input[320];
+	char output[320];
+	unsigned int seed = 0x0710;
+	int i, offset, count;
+	unsigned char expected;
+
+	for (i = 0; i < sizeof(input); i++) {
+		seed = seed * 1103515245 + 12345;
+		input[i] = seed >> 16;
+	}
+	for (offset = 0; offset < 8; offset++) {
+		for (count = 0; count + offset <= sizeof(input); count++) {
+			expected = fcs_table_update(input[offset], input + offset, count);
+			if (kernel->update(input[offset], input + offset, count)
+					!= expected)
+				return 0;
+			memset(output, 0, sizeof(output));
+			if (kernel->copy(input[offset], output, (char *) input + offset,
+					count) != expected
+					|| memcmp(output, input + offset, count) != 0)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+const GSM0710_FcsKernel *gsm0710_fcs_kernel(const char *name) {
+	int i;
+
+	pthread_once(&tables_once, init_tables);
+	for (i = 0; i < NUM_KERNELS; i++) {
+		if (strcmp(kernels[i].name, name) == 0 && kernel_supported(&kernels[i]))
+			return &kernels[i];
+	}
+	return NULL;
+}
+
+/* Times a kernel over the lengths of short and long frames. The best of a
+ * few runs is taken, so that an interruption doesn't count.
+ *
+ * RETURNS:
+ * the time of the best run in nanoseconds
+ */
+static long long kernel_time(const GSM0710_FcsKernel *kernel) {
+	static const int counts[] = { 3, 31, 127, 1024 };
+	unsigned char input[1024];
+	volatile unsigned char sink = 0;
+	struct timespec start, end;
+	long long ns, best = -1;
+	int run, i, j;
+
+	for (i = 0; i < sizeof(input); i++)
+		input[i] = i * 7;
+	for (run = 0; run < 5; run++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < 32; i++)
+			for (j = 0; j < sizeof(counts) / sizeof(counts[0]); j++)
+				sink = kernel->update(sink, input, counts[j]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = (end.tv_sec - start.tv_sec) * 1000000000LL
+				+ (end.tv_nsec - start.tv_nsec);
+		if (best < 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+// Sets gsm0710_fcs to the fastest kernel, which agrees with the table
+static void choose_kernel(void) {
+	long long ns, best = -1;
+	int i;
+
+	pthread_once(&tables_once, init_tables);
+	for (i = 0; i < NUM_KERNELS; i++) {
+		if (!kernel_supported(&kernels[i]))
+			continue;
+		if (!kernel_verify(&kernels[i])) {
+			SYSLOG(LOG_ERR, "FCS kernel %s doesn't match the FCS table\n",
+					kernels[i].name);
+			continue;
+		}
+		// which kernel wins depends on the CPU, so they are timed here
+		ns = kernel_time(&kernels[i]);
+		if (best < 0 || ns < best) {
+			gsm0710_fcs = &kernels[i];
+			best = ns;
+		}
+	}
+}
+
+const char *gsm0710_fcs_init(void) {
+	pthread_once(&choose_once, choose_kernel);
+	return gsm0710_fcs->name;
+}
+
+unsigned char gsm0710_make_fcs(const unsigned char *input, int count) {
+	return (0xFF - gsm0710_fcs_update(0xFF, input, count));
+}
@@ -0,0 +1,77 @@
+#ifndef _GSM0710_FCS_H_
+#define _GSM0710_FCS_H_
+/*
+ * fcs.h -- frame check sequence engine for the GSM 0710 protocol
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+// reversed, 8-bit, poly=0x07 byte table. The reference for all kernels.
+extern const unsigned char gsm0710_crctable[256];
+
+// FCS register value of a correct frame after its FCS has been included
+#define FCS_GOOD 0xCF
+
+/* A FCS kernel. update() feeds count characters to the FCS register fcs
+ * and returns the new register value. copy() does the same while copying
+ * the characters from src to dst.
+ */
+typedef struct GSM0710_FcsKernel {
+	const char *name;
+	unsigned char (*update)(unsigned char fcs, const unsigned char *input,
+			int count);
+	unsigned char (*copy)(unsigned char fcs, char *dst, const char *src,
+			int count);
+} GSM0710_FcsKernel;
+
+// the kernel chosen by gsm0710_fcs_init()
+extern const GSM0710_FcsKernel *gsm0710_fcs;
+
+/* Picks the fastest FCS kernel supported by the CPU, timing each on
+ * about 200 kilobytes of frame-sized input. Every kernel is
+ * cross-checked against gsm0710_crctable first and skipped if it disagrees.
+ * The choice is made once, by the first call, which gsm0710_mux_new()
+ * makes at the latest; later calls just return it.
+ *
+ * RETURNS:
+ * name of the chosen kernel
+ */
+const char *gsm0710_fcs_init(void);
+
+/* Returns the kernel with the given name or NULL, if it isn't supported
+ * on this CPU.
+ */
+const GSM0710_FcsKernel *gsm0710_fcs_kernel(const char *name);
+
+// Feeds characters to a FCS register
+#define gsm0710_fcs_update(fcs, input, count) \
+	(gsm0710_fcs->update((fcs), (const unsigned char *) (input), (count)))
+
+// Copies characters and feeds them to a FCS register in the same pass
+#define gsm0710_fcs_copy(fcs, dst, src, count) \
+	(gsm0710_fcs->copy((fcs), (dst), (src), (count)))
+
+/* Calculates frame check sequence from given characters.
+ *
+ * PARAMS:
+ * input - character array
+ * count - number of characters in array (that are included)
+ * RETURNS:
+ * frame check sequence
+ */
+unsigned char gsm0710_make_fcs(const unsigned char *input, int count);
+
+#endif /* _GSM0710_FCS_H_ */
@@ -86,131 +86,872 @@
 #include <sys/wait.h>
 //syslog
 #include <syslog.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "buffer.h"
-#include "gsm0710.h"
+#include "internal.h"
 
-extern int _debug;
-extern int max_frame_size;
-extern int serial_fd;
-extern int faultTolerant;
-extern int restart;
+int gsm0710_debug = 0;
 
-extern volatile int terminate;
-extern Channel_Status *cstatus;
-extern int terminateCount;
-/** Writes a frame to a logical channel. C/R bit is set to 1.
- * Doesn't support FCS counting for UI frames.
+void gsm0710_set_debug(int debug) {
+	gsm0710_debug = debug;
+}
+
+// FCS register after the address and control fields of a command frame,
+// by channel and control field
+static unsigned char header_fcs[64][256];
+// built by the first gsm0710_mux_new(), before any I/O thread runs
+static pthread_once_t header_fcs_once = PTHREAD_ONCE_INIT;
+
+static void init_header_fcs() {
+	unsigned char header[2];
+	int channel, type;
+
+	for (channel = 0; channel < 64; channel++) {
+		header[0] = EA | CR | (channel << 2);
+		for (type = 0; type < 256; type++) {
+			header[1] = type;
+			header_fcs[channel][type] = gsm0710_fcs_update(0xFF, header, 2);
+		}
+	}
+}
+
+long long gsm0710_monotonic_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// header of a frame passed between the threads, followed by its data
+typedef struct GSM0710_Record {
+	unsigned short length;
+	unsigned char channel;
+	unsigned char control;
+} GSM0710_Record;
+
+// Gets the next received frame in the framing chosen for the multiplexer
+#define parse_frame(mux, view) ((mux)->advanced \
+		? gsm0710_buffer_get_adv_frame_view((mux)->in_buf, view) \
+		: gsm0710_buffer_get_frame_view((mux)->in_buf, view))
+
+// size of rx_ring and tx_ring
+#define IO_RING_SIZE 65536
+// the RX thread parses the next frame only when one of any size fits
+#define RX_RECORD_MAX (sizeof(GSM0710_Record) + GSM0710_BUFFER_SIZE)
+// how long a stopped TX thread waits for the serial port to take a frame
+#define TX_DRAIN_TIMEOUT 1000000
+// how often the I/O threads retry the I/O functions of a multiplexer
+// without serial_fd, which they can't wait on, in milliseconds
+#define IO_RETRY_INTERVAL 1
+
+// Starts the hold-off of a channel, which has just got a frame encoded
+static void start_holdoff(GSM0710_Mux *mux, int channel) {
+	long long deadline = gsm0710_monotonic_us() + mux->tx_holdoff[channel];
+
+	if (deadline < mux->tx_deadline)
+		mux->tx_deadline = deadline;
+}
+
+// Tells, how much room a frame may take in the transmit buffer at most
+#define ENCODED_MAX(mux, count) ((mux)->advanced ? 2 * ((count) + 3) + 2 \
+		: (count) + 7)
+
+/* Encodes an advanced option frame to the transmit buffer. There is no
+ * length field, but the address, control, data and FCS are transparent.
  *
- * PARAMS:
- * channel - channel number (0 = control)
+ * RETURNS:
+ * count or 0, if the frame doesn't fit to the transmit buffer
+ */
+static int encode_adv_frame(GSM0710_Mux *mux, int channel,
+		const struct iovec *iov, int iovcnt, int count, unsigned char type) {
+	// EA=1 C channel, frame type
+	char header[2] = { EA | CR | (channel << 2), type };
+	char flag = ADV_FLAG;
+	unsigned char fcs = header_fcs[channel][type];
+	int i;
 
- * input   - the data to be written
- * count   - the length of the data
- * type    - the type of the frame (with possible P/F-bit)
+	if (gsm0710_buffer_free(mux->out_buf) < ENCODED_MAX(mux, count)) {
+		if (DEBUG_ENABLED)
+			syslog(LOG_DEBUG,
+					"No space in the transmit buffer for a frame to the virtual port %d.\n",
+					channel);
+		return 0;
+	}
+	gsm0710_buffer_write(mux->out_buf, &flag, 1);
+	gsm0710_buffer_write_stuffed(mux->out_buf, header, 2);
+	for (i = 0; i < iovcnt && count > 0; i++) {
+		if ((type & ~PF) == UI)
+			fcs = gsm0710_fcs_update(fcs, iov[i].iov_base, iov[i].iov_len);
+		gsm0710_buffer_write_stuffed(mux->out_buf, iov[i].iov_base,
+				iov[i].iov_len);
+	}
+	// CRC checksum
+	fcs = 0xFF - fcs;
+	gsm0710_buffer_write_stuffed(mux->out_buf, (char *) &fcs, 1);
+	gsm0710_buffer_write(mux->out_buf, &flag, 1);
+
+	start_holdoff(mux, channel);
+	return count;
+}
+
+/* Encodes a frame to the transmit buffer. The payload is given as an I/O
+ * vector, so that it can come straight from tx_ring.
  *
  * RETURNS:
- * number of characters written
+ * count or 0, if the frame doesn't fit to the transmit buffer
  */
-int write_frame(int channel, const char *input, int count, unsigned char type) {
+static int encode_frame(GSM0710_Mux *mux, int channel, const struct iovec *iov,
+		int iovcnt, int count, unsigned char type) {
 	// flag, EA=1 C channel, frame type, length 1-2
 	unsigned char prefix[5] = { F_FLAG, EA | CR, 0, 0, 0 };
 	unsigned char postfix[2] = { 0xFF, F_FLAG };
-	int prefix_length = 4, c;
+	int prefix_length = 4;
+	unsigned char fcs;
+	int i;
 
-	if (_debug)
-		syslog(LOG_DEBUG, "send frame to ch: %d \n", channel);
+	if (mux->advanced)
+		return encode_adv_frame(mux, channel, iov, iovcnt, count, type);
 	// EA=1, Command, let's add address
-	prefix[1] = prefix[1] | ((63 & (unsigned char) channel) << 2);
+	prefix[1] = prefix[1] | (channel << 2);
 	// let's set control field
 	prefix[2] = type;
-
-	// let's not use too big frames
-	count = min(max_frame_size, count);
+	fcs = header_fcs[channel][type];
 
 	// length
 	if (count > 127) {
 		prefix_length = 5;
 		prefix[3] = ((127 & count) << 1);
 		prefix[4] = (32640 & count) >> 7;
+		fcs = gsm0710_crctable[gsm0710_crctable[fcs ^ prefix[3]] ^ prefix[4]];
 	} else {
 		prefix[3] = 1 | (count << 1);
+		fcs = gsm0710_crctable[fcs ^ prefix[3]];
 	}
-	// CRC checksum
-	postfix[0] = make_fcs(prefix + 1, prefix_length - 1);
 
-	c = write(serial_fd, prefix, prefix_length);
-	if (c != prefix_length) {
-		if (_debug)
+	if (gsm0710_buffer_free(mux->out_buf) < prefix_length + count + 2) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG,
-					"Couldn't write the whole prefix to the serial port for the virtual port %d. Wrote only %d  bytes.",
-					channel, c);
+					"No space in the transmit buffer for a frame to the virtual port %d.\n",
+					channel);
 		return 0;
 	}
-	if (count > 0) {
-		c = write(serial_fd, input, count);
-		if (count != c) {
-			if (_debug)
-				syslog(LOG_DEBUG,
-						"Couldn't write all data to the serial port from the virtual port %d. Wrote only %d bytes.\n",
-						channel, c);
+	gsm0710_buffer_write(mux->out_buf, (char *) prefix, prefix_length);
+	for (i = 0; i < iovcnt && count > 0; i++) {
+		if ((type & ~PF) == UI)
+			gsm0710_buffer_write_fcs(mux->out_buf, iov[i].iov_base,
+					iov[i].iov_len, &fcs);
+		else
+			gsm0710_buffer_write(mux->out_buf, iov[i].iov_base,
+					iov[i].iov_len);
+	}
+	// CRC checksum
+	postfix[0] = 0xFF - fcs;
+	gsm0710_buffer_write(mux->out_buf, (char *) postfix, 2);
+
+	start_holdoff(mux, channel);
+	return count;
+}
+
+int gsm0710_receive_check_stall(GSM0710_Mux *mux, long long now, int received) {
+	if (!mux->in_buf->incomplete) {
+		mux->rx_stall_deadline = LLONG_MAX;
+		return 0;
+	}
+	if (received || mux->rx_stall_deadline == LLONG_MAX) {
+		mux->rx_stall_deadline = now + RX_STALL_TIMEOUT;
+		return 0;
+	}
+	if (now < mux->rx_stall_deadline)
+		return 0;
+	SYSLOG(LOG_INFO, "Dropping frame: rest of it not received\n");
+	gsm0710_buffer_skip_frame(mux->in_buf);
+	mux->rx_stall_deadline = now + RX_STALL_TIMEOUT;
+	return 1;
+}
+
+int gsm0710_receive_fill(GSM0710_Mux *mux, int size) {
+	unsigned int head = mux->in_buf->head;
+	int len = mux->io_read
+			? gsm0710_buffer_fill_io(mux->in_buf, mux->io_read, mux->io_ctx,
+					size)
+			: gsm0710_buffer_fill(mux->in_buf, mux->serial_fd, size);
+
+	if (len > 0 && mux->capture)
+		gsm0710_capture_buffer(mux->capture, mux->capture_source,
+				CAPTURE_RX_RAW, mux->in_buf, head, len);
+	return len;
+}
+
+// Tells the frame size (N1) we propose for a channel
+static int proposed_frame_size(GSM0710_Mux *mux, int channel) {
+	int size = mux->pn_frame_size[channel];
+
+	if (size <= 0)
+		size = mux->max_frame_size;
+	return min(size, FRAME_SIZE_LIMIT(mux));
+}
+
+// Tells the frame size (N1) of a channel, -f until one has been agreed
+static int frame_size(GSM0710_Mux *mux, int channel) {
+	int size = mux->cstatus[channel].frame_size;
+
+	if (size <= 0)
+		size = mux->max_frame_size;
+	return min(size, FRAME_SIZE_LIMIT(mux));
+}
+
+/* Passes a frame on to the transmit buffer or, in threaded mode, to the
+ * TX thread
+ *
+ * RETURNS:
+ * count or 0, if there is no space for the frame
+ */
+static int queue_frame(GSM0710_Mux *mux, int channel, const struct iovec *iov,
+		int iovcnt, int count, unsigned char type) {
+	GSM0710_Record rec;
+	struct iovec v[3];
+	unsigned int head = mux->out_buf->head;
+
+	if (!mux->threads_running) {
+		encode_frame(mux, channel, iov, iovcnt, count, type);
+		// even an empty frame takes room
+		if (mux->out_buf->head == head) {
+			MUX_TRACE(mux, channel, type, count, TRACE_TX_FULL);
 			return 0;
 		}
+		MUX_TRACE(mux, channel, type, count, TRACE_TX);
+		MUX_CAPTURE(mux, CAPTURE_TX_FRAME, channel, type, iov, iovcnt);
+		mux->tx_frames[channel]++;
+		mux->tx_bytes[channel] += count;
+		return count;
 	}
-	c = write(serial_fd, postfix, 2);
-	if (c != 2) {
-		if (_debug)
+
+	rec.length = count;
+	rec.channel = channel;
+	rec.control = type;
+	v[0].iov_base = &rec;
+	v[0].iov_len = sizeof(rec);
+	v[1] = iov[0];
+	if (iovcnt > 1)
+		v[2] = iov[1];
+	if (gsm0710_spsc_push(mux->tx_ring, v, 1 + iovcnt) != 0) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG,
-					"Couldn't write the whole postfix to the serial port for the virtual port %d. Wrote only %d bytes.",
-					channel, c);
+					"No space in the TX queue for a frame to the virtual port %d.\n",
+					channel);
+		MUX_TRACE(mux, channel, type, count, TRACE_TX_FULL);
 		return 0;
 	}
+	MUX_TRACE(mux, channel, type, count, TRACE_TX);
+	MUX_CAPTURE(mux, CAPTURE_TX_FRAME, channel, type, iov, iovcnt);
+	mux->tx_frames[channel]++;
+	mux->tx_bytes[channel] += count;
+	return count;
+}
+
+/** Writes a frame to a logical channel. C/R bit is set to 1.
+ * For UI frames the FCS covers the data too.
+ *
+ * The frame is queued to the transmit buffer as a whole. Frames from all
+ * channels are collected there and written by gsm0710_write_frame_flush() in one
+ * go, at the latest when the hold-off of the channel expires. The FCS of
+ * the header
+ * comes from a table by channel and type, so only the length octets are fed
+ * to the FCS per frame. In threaded mode the frame is queued to tx_ring
+ * instead and encoded by the TX thread.
+ *
+ * PARAMS:
+ * mux     - the multiplexer
+ * channel - channel number (0 = control)
+ * input   - the data to be written
+ * count   - the length of the data
+ * type    - the type of the frame (with possible P/F-bit)
+ *
+ * RETURNS:
+ * number of characters written, 0 if the frame doesn't fit to the
+ * transmit buffer
+ */
+int gsm0710_write_frame(GSM0710_Mux *mux, int channel, const char *input,
+		int count, unsigned char type) {
+	struct iovec iov;
+
+	if (DEBUG_ENABLED)
+		syslog(LOG_DEBUG, "send frame to ch: %d \n", channel);
+	// let's not use too big frames
+	count = min(frame_size(mux, channel & 63), count);
+	iov.iov_base = (void *) input;
+	iov.iov_len = count;
+	return queue_frame(mux, channel & 63, &iov, 1, count, type);
+}
+
+void gsm0710_write_frame_set_holdoff(GSM0710_Mux *mux, int channel, int usec) {
+	mux->tx_holdoff[channel & (MAX_DLCS - 1)] = usec;
+}
+
+static long long out_buf_due(GSM0710_Mux *mux) {
+	long long due;
+
+	if (gsm0710_buffer_length(mux->out_buf) == 0)
+		return -1;
+	if (gsm0710_buffer_length(mux->out_buf) >= GSM0710_BUFFER_SIZE / 2)
+		return 0;
+	due = mux->tx_deadline - gsm0710_monotonic_us();
+	return (due > 0) ? due : 0;
+}
+
+static int out_buf_flush(GSM0710_Mux *mux, int force) {
+	unsigned int tail = mux->out_buf->tail;
+	int c;
+
+	if (!force && out_buf_due(mux) != 0)
+		return 0;
+	c = mux->io_write
+			? gsm0710_buffer_flush_io(mux->out_buf, mux->io_write, mux->io_ctx)
+			: gsm0710_buffer_flush(mux->out_buf, mux->serial_fd);
+	if (c < 0)
+		SYSLOG(LOG_ERR, "%s: Couldn't write to the serial port. %s (%d).\n", mux->serportdev,
+				strerror(errno), errno);
+	// the written characters stay in place until the next frame
+	else if (c > 0 && mux->capture)
+		gsm0710_capture_buffer(mux->capture, mux->capture_source,
+				CAPTURE_TX_RAW, mux->out_buf, tail, c);
+	if (gsm0710_buffer_length(mux->out_buf) == 0)
+		mux->tx_deadline = LLONG_MAX;
+	return c;
+}
+
+// the TX thread owns the transmit buffer, while it is running
+long long gsm0710_write_frame_due(GSM0710_Mux *mux) {
+	return mux->threads_running ? -1 : out_buf_due(mux);
+}
+
+int gsm0710_write_frame_flush(GSM0710_Mux *mux, int force) {
+	return mux->threads_running ? 0 : out_buf_flush(mux, force);
+}
 
+/* Tells, how much data fits to the transmit buffer (or to tx_ring in
+ * threaded mode) when it is split to frames of the given size.
+ */
+int gsm0710_write_frame_capacity(GSM0710_Mux *mux, int size) {
+	int overhead, space, rest;
+
+	if (mux->threads_running) {
+		overhead = sizeof(GSM0710_Record);
+		space = gsm0710_spsc_free(mux->tx_ring);
+		// let the TX thread wake up the main loop, when it makes room
+		if (space <= overhead
+				&& gsm0710_spsc_want_space(mux->tx_ring, overhead + 1))
+			space = gsm0710_spsc_free(mux->tx_ring);
+	} else if (mux->advanced) {
+		// every character might need a control escape
+		overhead = 4;
+		space = gsm0710_buffer_free(mux->out_buf) / 2;
+	} else {
+		overhead = (size > 127) ? 7 : 6;
+		space = gsm0710_buffer_free(mux->out_buf);
+	}
+	rest = space % (size + overhead) - overhead;
+	return (space / (size + overhead)) * size + ((rest > 0) ? rest : 0);
+}
+
+int gsm0710_write_frame_queue_init(GSM0710_Mux *mux) {
+	GSM0710_TxQueue *q;
+	int i, size;
+
+	if (mux->numOfPorts < 0 || mux->numOfPorts >= MAX_DLCS)
+		return -1;
+	for (i = 1; i <= mux->numOfPorts; i++) {
+		q = &mux->txq[i];
+		size = max(TXQ_FRAMES * proposed_frame_size(mux, i),
+				GSM0710_BUFFER_SIZE);
+		if (q->buf ? gsm0710_buffer_resize(q->buf, size) != 0
+				: !(q->buf = mux->mirrored
+						? gsm0710_buffer_init_mirrored(size)
+						: gsm0710_buffer_init_size(size)))
+			return -1;
+	}
+	return 0;
+}
+
+// Remembers, when count characters arrived to a transmit queue
+static void account_chunk(GSM0710_TxQueue *q, int count) {
+	int last;
+
+	if (q->chunk_count == GSM0710_TXQ_CHUNKS) {
+		// out of slots, the data is accounted to the newest chunk
+		last = (q->chunk_first + GSM0710_TXQ_CHUNKS - 1)
+				% GSM0710_TXQ_CHUNKS;
+		q->chunk_bytes[last] += count;
+	} else {
+		last = (q->chunk_first + q->chunk_count++) % GSM0710_TXQ_CHUNKS;
+		q->chunk_time[last] = gsm0710_monotonic_us();
+		q->chunk_bytes[last] = count;
+	}
+	if (gsm0710_buffer_length(q->buf) > q->max_depth)
+		q->max_depth = gsm0710_buffer_length(q->buf);
+}
+
+int gsm0710_write_frame_enqueue(GSM0710_Mux *mux, int channel, const char *input,
+		int count) {
+	GSM0710_TxQueue *q = &mux->txq[channel & (MAX_DLCS - 1)];
+
+	if (!q->buf && !(q->buf = gsm0710_buffer_init()))
+		return 0;
+	if ((count = gsm0710_buffer_write(q->buf, input, count)) <= 0)
+		return 0;
+	account_chunk(q, count);
+	return count;
+}
+
+int gsm0710_write_frame_enqueue_fd(GSM0710_Mux *mux, int channel, int fd,
+		int count) {
+	GSM0710_TxQueue *q = &mux->txq[channel & (MAX_DLCS - 1)];
+
+	if (!q->buf && !(q->buf = gsm0710_buffer_init())) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if ((count = gsm0710_buffer_fill(q->buf, fd, count)) > 0)
+		account_chunk(q, count);
 	return count;
 }
 
+int gsm0710_write_frame_queue_free(GSM0710_Mux *mux, int channel) {
+	GSM0710_TxQueue *q = &mux->txq[channel & (MAX_DLCS - 1)];
+
+	return q->buf ? gsm0710_buffer_free(q->buf) : GSM0710_BUFFER_SIZE;
+}
+
+void gsm0710_write_frame_set_weight(GSM0710_Mux *mux, int channel, int weight) {
+	GSM0710_TxQueue *q = &mux->txq[channel & (MAX_DLCS - 1)];
+
+	q->priority = (weight == 0);
+	q->weight = weight;
+}
+
+// characters waiting for the serial port below the scheduler
+static int tx_backlog(GSM0710_Mux *mux) {
+	if (mux->threads_running)
+		return gsm0710_spsc_length(mux->tx_ring);
+	return gsm0710_buffer_length(mux->out_buf);
+}
+
+#define queue_length(q) ((q)->buf ? (int) gsm0710_buffer_length((q)->buf) : 0)
+// Tells, if the modem accepts frames on a DLC
+#define queue_open(mux, dlc) (!(mux)->stopped && !(mux)->cstatus[dlc].stopped)
+
+/* Chooses the transmit queue to take the next frame from: the priority
+ * class round robin, then the others by deficit round robin. The quantum
+ * of a queue is its weight in frames of the channel's maximum size, so
+ * every queue with data gets at least one frame per round.
+ *
+ * RETURNS:
+ * the queue or NULL, if nothing should be sent now
+ */
+static GSM0710_TxQueue *next_queue(GSM0710_Mux *mux) {
+	GSM0710_TxQueue *q;
+	int i, dlc, len, size, n = mux->numOfPorts;
+
+	if (n == 0)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		dlc = 1 + (mux->prio_next + i) % n;
+		q = &mux->txq[dlc];
+		if (q->priority && queue_length(q) > 0 && queue_open(mux, dlc)) {
+			mux->prio_next = dlc % n;
+			return q;
+		}
+	}
+	if (tx_backlog(mux) >= TX_BACKLOG)
+		return NULL;
+	for (i = 0; i <= n; i++) {
+		q = &mux->txq[1 + mux->drr_next];
+		size = frame_size(mux, 1 + mux->drr_next);
+		if (!q->priority && (len = queue_length(q)) > 0
+				&& queue_open(mux, 1 + mux->drr_next)) {
+			if (!q->visited) {
+				q->deficit += max(q->weight, 1) * size;
+				q->visited = 1;
+			}
+			if (q->deficit >= min(len, size))
+				return q;
+		} else {
+			q->deficit = 0;
+		}
+		// the round of this queue is over
+		q->visited = 0;
+		mux->drr_next = (mux->drr_next + 1) % n;
+	}
+	return NULL;
+}
+
+/* Sends the next count characters of a transmit queue as one frame,
+ * straight from the queue.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the frame doesn't fit, the data stays queued then
+ */
+static int send_queued_frame(GSM0710_Mux *mux, GSM0710_TxQueue *q, int count,
+		long long now) {
+	GSM0710_Buffer *b = q->buf;
+	struct iovec seg[2];
+	long long wait = now - q->chunk_time[q->chunk_first];
+	int c, n;
+
+	if (queue_frame(mux, q - mux->txq, seg,
+			gsm0710_buffer_peek(b, 0, seg, count), count, UIH) == 0)
+		return -1;
+	gsm0710_buffer_consume(b, count);
+
+	q->frames++;
+	q->bytes += count;
+	q->wait_total += wait;
+	if (wait > q->wait_max)
+		q->wait_max = wait;
+	if (!q->priority)
+		q->deficit -= count;
+	for (c = count; c > 0 && q->chunk_count > 0; c -= n) {
+		n = min(c, q->chunk_bytes[q->chunk_first]);
+		if ((q->chunk_bytes[q->chunk_first] -= n) == 0) {
+			q->chunk_first = (q->chunk_first + 1) % GSM0710_TXQ_CHUNKS;
+			q->chunk_count--;
+		}
+	}
+	return 0;
+}
+
+int gsm0710_write_frame_schedule(GSM0710_Mux *mux) {
+	long long now = gsm0710_monotonic_us();
+	GSM0710_TxQueue *q;
+	int count, size, frames = 0;
+
+	while ((q = next_queue(mux))) {
+		size = frame_size(mux, q - mux->txq);
+		count = min(gsm0710_buffer_length(q->buf), size);
+		if (gsm0710_write_frame_capacity(mux, size) < count
+				|| send_queued_frame(mux, q, count, now) != 0)
+			break;
+		frames++;
+	}
+	return frames;
+}
+
+/* Tells, if a frame of count characters fits to the transmit buffer (or
+ * to tx_ring) now. In threaded mode the TX thread is asked to wake up the
+ * main loop, when it has made room for it.
+ */
+static int frame_fits(GSM0710_Mux *mux, int count) {
+	if (mux->threads_running)
+		return gsm0710_spsc_want_space(mux->tx_ring,
+				sizeof(GSM0710_Record) + count);
+	return gsm0710_write_frame_capacity(mux, count) >= count;
+}
+
+int gsm0710_write_frame_schedulable(GSM0710_Mux *mux) {
+	int i, head, bulk = 0, priority = 0;
+
+	// the largest frame at the head of a queue of either class
+	for (i = 1; i <= mux->numOfPorts; i++) {
+		if (queue_length(&mux->txq[i]) > 0 && queue_open(mux, i)) {
+			head = min(queue_length(&mux->txq[i]), frame_size(mux, i));
+			if (mux->txq[i].priority)
+				priority = max(priority, head);
+			else
+				bulk = max(bulk, head);
+		}
+	}
+	if (!priority && !(bulk && tx_backlog(mux) < TX_BACKLOG)) {
+		// let the TX thread wake up the main loop, when the backlog shrinks
+		if (bulk && mux->threads_running
+				&& gsm0710_spsc_want_space(mux->tx_ring,
+						mux->tx_ring->size - TX_BACKLOG + 1))
+			return 1;
+		return 0;
+	}
+	/* room for the frame gsm0710_write_frame_schedule() takes next,
+	 * whichever queue it is, or the main loop would spin until the serial
+	 * port takes more
+	 */
+	return frame_fits(mux, priority ? priority : bulk);
+}
+
+void gsm0710_write_frame_log_stats(GSM0710_Mux *mux) {
+	GSM0710_TxQueue *q;
+	long long now = gsm0710_monotonic_us();
+	char class[24];
+	int i;
+
+	for (i = 1; i <= mux->numOfPorts; i++) {
+		q = &mux->txq[i];
+		if (q->priority)
+			strcpy(class, "priority");
+		else
+			sprintf(class, "weight %d", max(q->weight, 1));
+		SYSLOG(LOG_INFO,
+				"%s: DLC %d (%s): queued %d bytes (max %d, oldest %lld us), sent %lu frames, %llu bytes, wait avg %lld us max %lld us\n",
+				mux->serportdev, i, class, queue_length(q), q->max_depth,
+				q->chunk_count > 0 ? now - q->chunk_time[q->chunk_first] : 0,
+				q->frames, q->bytes,
+				q->frames > 0 ? q->wait_total / (long long) q->frames : 0,
+				q->wait_max);
+	}
+	SYSLOG(LOG_INFO,
+			"%s: input buffer %u bytes, overflows: stopped %lu times, grown %lu times, %lu frames (%lu bytes) dropped\n",
+			mux->serportdev, mux->in_buf->size, mux->in_buf->stopped_count,
+			mux->in_buf->grown_count, mux->in_buf->discarded_count,
+			mux->in_buf->discarded_bytes);
+}
+
+/* The RX thread: reads the serial port, parses frames and passes them to
+ * the main thread in rx_ring. When rx_ring is full, it stops parsing and
+ * eventually reading, so the modem gets flow controlled by the UART
+ * instead of frames getting lost. Without serial_fd it calls io_read
+ * every IO_RETRY_INTERVAL, while nothing arrives.
+ */
+static void *rx_thread(void *arg) {
+	GSM0710_Mux *mux = arg;
+	GSM0710_Spsc *r = mux->rx_ring;
+	GSM0710_FrameView view;
+	GSM0710_Record rec;
+	struct iovec iov[3];
+	struct pollfd fds[3];
+	int len = 0, size, room, timeout, received;
+	int retry = mux->serial_fd < 0;
+
+	fds[0].fd = mux->stop_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = mux->serial_fd;
+	fds[2].fd = r->space_fd;
+	fds[2].events = POLLIN;
+	for (;;) {
+		while ((room = (gsm0710_spsc_free(r) >= RX_RECORD_MAX
+				|| gsm0710_spsc_want_space(r, RX_RECORD_MAX)))
+				&& parse_frame(mux, &view)) {
+			rec.length = view.data_length;
+			rec.channel = view.channel;
+			rec.control = view.control;
+			iov[0].iov_base = &rec;
+			iov[0].iov_len = sizeof(rec);
+			iov[1] = view.seg[0];
+			iov[2] = view.seg[1];
+			gsm0710_spsc_push(r, iov, 1 + view.segments);
+		}
+		if (gsm0710_receive_check_stall(mux, gsm0710_monotonic_us(), len > 0))
+			continue;
+		received = len > 0;
+		len = 0;
+		size = gsm0710_buffer_make_room(mux->in_buf,
+				mux->advanced ? ADV_FLAG : F_FLAG);
+		fds[1].events = (size > 0) ? POLLIN : 0;
+		timeout = -1;
+		if (mux->rx_stall_deadline != LLONG_MAX)
+			timeout = max(0, (mux->rx_stall_deadline
+					- gsm0710_monotonic_us()) / 1000 + 1);
+		if (retry && size > 0)
+			timeout = received ? 0 : (timeout < 0) ? IO_RETRY_INTERVAL
+					: min(timeout, IO_RETRY_INTERVAL);
+		if (poll(fds, 3, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			SYSLOG(LOG_ERR, "%s: RX thread failed. %s (%d).\n",
+					mux->serportdev, strerror(errno), errno);
+			break;
+		}
+		if (fds[0].revents)
+			break;
+		if (fds[2].revents)
+			gsm0710_spsc_clear(r->space_fd);
+		if (fds[1].revents & (POLLERR | POLLNVAL)) {
+			SYSLOG(LOG_ERR, "%s: Serial port failed.\n", mux->serportdev);
+			fds[1].fd = -1;
+		} else if (size > 0 && (fds[1].revents || retry)) {
+			len = gsm0710_receive_fill(mux, size);
+			if (len == 0
+					|| (len < 0 && errno != EAGAIN && errno != EINTR)) {
+				// the port is gone, leave it to the restart logic
+				SYSLOG(LOG_ERR, "%s: Couldn't read from the serial port.\n",
+						mux->serportdev);
+				fds[1].fd = -1;
+				retry = 0;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* The TX thread: encodes the frames queued to tx_ring and writes them to
+ * the serial port, honoring the hold-off of the channels. When it is
+ * stopped, it keeps writing until the rest of tx_ring fits to the
+ * transmit buffer, or until the port hasn't taken anything for
+ * TX_DRAIN_TIMEOUT. Without serial_fd it calls io_write every
+ * IO_RETRY_INTERVAL, while the port doesn't take the frames.
+ */
+static void *tx_thread(void *arg) {
+	GSM0710_Mux *mux = arg;
+	GSM0710_Spsc *r = mux->tx_ring;
+	GSM0710_Record rec;
+	struct iovec seg[2];
+	struct pollfd fds[3];
+	long long due, drain_deadline = 0;
+	int segments, c, timeout, stop = 0;
+	int retry = mux->serial_fd < 0;
+
+	fds[0].fd = mux->stop_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = r->data_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = mux->serial_fd;
+	for (;;) {
+		while (gsm0710_spsc_length(r) >= sizeof(rec)) {
+			gsm0710_spsc_copy(r, 0, &rec, sizeof(rec));
+			if (gsm0710_buffer_free(mux->out_buf)
+					< ENCODED_MAX(mux, rec.length))
+				break;
+			segments = gsm0710_spsc_peek(r, sizeof(rec), seg, rec.length);
+			encode_frame(mux, rec.channel, seg, segments, rec.length,
+					rec.control);
+			gsm0710_spsc_consume(r, sizeof(rec) + rec.length);
+		}
+		if (stop) {
+			if (gsm0710_spsc_length(r) == 0)
+				break;
+			if ((c = out_buf_flush(mux, 1)) > 0)
+				drain_deadline = gsm0710_monotonic_us() + TX_DRAIN_TIMEOUT;
+			else if (c < 0 || gsm0710_monotonic_us() > drain_deadline) {
+				SYSLOG(LOG_WARNING, "%s: Dropping %d characters of frames, "
+						"the serial port doesn't take them.\n",
+						mux->serportdev, gsm0710_spsc_length(r));
+				gsm0710_spsc_consume(r, gsm0710_spsc_length(r));
+				break;
+			}
+			fds[2].events = POLLOUT;
+			poll(&fds[2], 1, retry ? IO_RETRY_INTERVAL : 100);
+			continue;
+		}
+		if ((due = out_buf_due(mux)) == 0) {
+			// encode more, if the port took something
+			if ((c = out_buf_flush(mux, 1)) > 0)
+				continue;
+			// the error has been logged, retry later
+			due = (c < 0) ? 100000 : out_buf_due(mux);
+		}
+		fds[2].events = (due == 0) ? POLLOUT : 0;
+		timeout = -1;
+		if (due > 0)
+			timeout = (due + 999) / 1000;
+		else if (due == 0 && retry)
+			timeout = IO_RETRY_INTERVAL;
+		if (poll(fds, 3, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			SYSLOG(LOG_ERR, "%s: TX thread failed. %s (%d).\n",
+					mux->serportdev, strerror(errno), errno);
+			break;
+		}
+		if (fds[1].revents)
+			gsm0710_spsc_clear(r->data_fd);
+		// encode what is left, the caller flushes the last of it
+		if ((stop = fds[0].revents))
+			drain_deadline = gsm0710_monotonic_us() + TX_DRAIN_TIMEOUT;
+	}
+	return NULL;
+}
+
+int gsm0710_start_io_threads(GSM0710_Mux *mux) {
+	sigset_t all, old;
+	int err;
+
+	// the threads need a port to wait on or functions to retry
+	if (mux->serial_fd < 0 && (!mux->io_read || !mux->io_write)) {
+		SYSLOG(LOG_ERR, "%s: Can't start the I/O threads without a serial "
+				"port.\n", mux->serportdev);
+		errno = EBADF;
+		return -1;
+	}
+	if (!mux->rx_ring && !(mux->rx_ring = gsm0710_spsc_init(IO_RING_SIZE)))
+		return -1;
+	if (!mux->tx_ring && !(mux->tx_ring = gsm0710_spsc_init(IO_RING_SIZE)))
+		return -1;
+	if (mux->stop_fd < 0
+			&& (mux->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return -1;
+	gsm0710_spsc_clear(mux->stop_fd);
+
+	// signals are handled by the main thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if ((err = pthread_create(&mux->rx_thread, NULL, rx_thread, mux)) == 0) {
+		if ((err = pthread_create(&mux->tx_thread, NULL, tx_thread, mux))
+				!= 0) {
+			eventfd_write(mux->stop_fd, 1);
+			pthread_join(mux->rx_thread, NULL);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		SYSLOG(LOG_ERR, "%s: Can't start the I/O threads. %s (%d).\n",
+				mux->serportdev, strerror(err), err);
+		return -1;
+	}
+	mux->threads_running = 1;
+	return 0;
+}
+
+void gsm0710_stop_io_threads(GSM0710_Mux *mux) {
+	if (!mux->threads_running)
+		return;
+	eventfd_write(mux->stop_fd, 1);
+	pthread_join(mux->rx_thread, NULL);
+	pthread_join(mux->tx_thread, NULL);
+	mux->threads_running = 0;
+}
+
 // Prints information on a frame
-void print_frame(GSM0710_Frame * frame) {
-	if (_debug) {
+static void print_frame(GSM0710_Frame * frame) {
+	if (DEBUG_ENABLED) {
 		syslog(LOG_DEBUG, "is in %s\n", __FUNCTION__);
 		syslog(LOG_DEBUG, "Received ");
 	}
 
 	switch ((frame->control & ~PF)) {
 	case SABM:
-		if (_debug)
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "SABM ");
 		break;
 	case UIH:
-		if (_debug)
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "UIH ");
 		break;
 	case UA:
-		if (_debug)
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "UA ");
 		break;
 	case DM:
-		if (_debug)
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "DM ");
 		break;
 	case DISC:
-		if (_debug)
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "DISC ");
 		break;
 	case UI:
-		if (_debug)
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "UI ");
 		break;
 	default:
-		if (_debug)
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "unkown (control=%d) ", frame->control);
 		break;
 	}
-	if (_debug)
+	if (DEBUG_ENABLED)
 		syslog(LOG_DEBUG, " frame for channel %d.\n", frame->channel);
 
 	if (frame->data_length > 0) {
-		if (_debug) {
+		if (DEBUG_ENABLED) {
 			syslog(LOG_DEBUG, "frame->data = %s / size = %d\n", frame->data,
 					frame->data_length);
 			//fwrite(frame->data, sizeof(char), frame->data_length, stdout);
@@ -220,16 +961,92 @@ void print_frame(GSM0710_Frame * frame) {
 
 }
 
+// length of the value of a PN command
+#define PN_LENGTH 8
+
+/* Sends an MSC command with the FC signal set or cleared for a DLC, if
+ * the signal changes
+ */
+void gsm0710_send_flow_control(GSM0710_Mux *mux, int channel, int stop) {
+	GSM0710_ChannelStatus *cs = &mux->cstatus[channel];
+	unsigned char signals = stop ? (cs->v24_signals | S_FC)
+			: (cs->v24_signals & ~S_FC);
+	char msc[4] = { C_MSC | CR, EA | (2 << 1), EA | CR | (channel << 2), 0 };
+
+	if (signals == cs->v24_signals)
+		return;
+	cs->v24_signals = signals;
+	msc[3] = signals;
+	if (DEBUG_ENABLED)
+		syslog(LOG_DEBUG, "%s frames on channel %d.\n",
+				stop ? "Stopping" : "Resuming", channel);
+	gsm0710_write_frame(mux, 0, msc, sizeof(msc), UIH);
+}
+
+/* Sends a PN command proposing our frame size and the priority of the
+ * transmit queue for a DLC
+ */
+void gsm0710_send_parameter_negotiation(GSM0710_Mux *mux, int channel) {
+	unsigned char pn[2 + PN_LENGTH];
+	int size = proposed_frame_size(mux, channel);
+
+	pn[0] = C_PN | CR;
+	pn[1] = EA | (PN_LENGTH << 1);
+	pn[2] = channel & 63;
+	pn[3] = 0; // UIH frames, convergence layer type 1
+	// the default priority of the DLC, unless it is in the priority class
+	pn[4] = mux->txq[channel & 63].priority ? 1 : (channel | 7);
+	pn[5] = 10; // T1 100 ms
+	pn[6] = size & 255;
+	pn[7] = size >> 8;
+	pn[8] = 3; // N2
+	pn[9] = 0; // k, not used in basic mode
+	gsm0710_write_frame(mux, 0, (char *) pn, sizeof(pn), UIH);
+}
+
+/* Applies the value of a PN command or response to the status of the DLC
+ *
+ * PARAMS:
+ * mux     - the multiplexer
+ * pn      - the value, which is adjusted to our answer for a command
+ * command - set, if the modem has sent the command
+ */
+static void handle_parameters(GSM0710_Mux *mux, unsigned char *pn,
+		int command) {
+	int channel = pn[0] & 63;
+	int size = pn[4] | (pn[5] << 8);
+	GSM0710_ChannelStatus *cs = &mux->cstatus[channel];
+
+	size = min(size, proposed_frame_size(mux, channel));
+	if (command) {
+		// only UIH frames of the basic convergence layer are supported
+		pn[1] = 0;
+		pn[4] = size & 255;
+		pn[5] = size >> 8;
+		pn[7] = 0;
+	}
+	if (size <= 0)
+		return;
+	cs->frame_size = size;
+	cs->priority = pn[2] & 63;
+	cs->ack_timer = pn[3];
+	cs->retransmissions = pn[6];
+	SYSLOG(LOG_INFO,
+			"%s: DLC %d: frame size %d, priority %d, T1 %d ms, N2 %d\n",
+			mux->serportdev, channel, cs->frame_size, cs->priority,
+			cs->ack_timer * 10, cs->retransmissions);
+}
+
 /* Handles commands received from the control channel.
  */
-void handle_command(GSM0710_Frame * frame) {
+static void handle_command(GSM0710_Mux *mux, GSM0710_Frame * frame) {
 #if 1
 	unsigned char type, signals;
 	int length = 0, i, type_length, channel, supported = 1;
 	char *response;
 	// struct ussp_operation op;
 
-	if (_debug)
+	if (DEBUG_ENABLED)
 		syslog(LOG_DEBUG, "is in %s\n", __FUNCTION__);
 
 	if (frame->data_length > 0) {
@@ -239,33 +1056,32 @@ void handle_command(GSM0710_Frame * frame) {
 			;
 		i++;
 		type_length = i;
+		// extract frame length
+		while (frame->data_length > i) {
+			length = (length * 128) + ((frame->data[i] & 254) >> 1);
+			if ((frame->data[i] & 1) == 1)
+				break;
+			i++;
+		}
+		i++;
 		if ((type & CR) == CR) {
 			// command not ack
 
-			// extract frame length
-			while (frame->data_length > i) {
-				length = (length * 128) + ((frame->data[i] & 254) >> 1);
-				if ((frame->data[i] & 1) == 1)
-					break;
-				i++;
-			}
-			i++;
-
 			switch ((type & ~CR)) {
 			case C_CLD:
-				syslog(LOG_INFO,
-						"The mobile station requested mux-mode termination.\n");
-				if (faultTolerant) {
+				SYSLOG(LOG_INFO,
+						"%s: The mobile station requested mux-mode termination.\n", mux->serportdev);
+				if (mux->faultTolerant) {
 					// Signal restart
-					restart = 1;
+					mux->restart = 1;
 				} else {
-					terminate = 1;
-					terminateCount = -1;    // don't need to close down channels
+					mux->terminate = 1;
+					mux->terminateCount = -1;    // don't need to close down channels
 				}
 				break;
 			case C_TEST:
 
-				if(_debug){
+				if (DEBUG_ENABLED){
 					syslog(LOG_DEBUG,"Test command: ");
 					syslog(LOG_DEBUG,"frame->data = %s  / frame->data_length = %d\n",frame->data + i, frame->data_length - i);
 					//fwrite(frame->data + i, sizeof(char), frame->data_length - i, stdout);
@@ -281,44 +1097,68 @@ void handle_command(GSM0710_Frame * frame) {
 					// op.arg = USSP_RTS;
 					// op.len = 0;
 
-					if (_debug)
+					if (DEBUG_ENABLED)
 						syslog(LOG_DEBUG,
 								"Modem status command on channel %d.\n",
 								channel);
+					// the scheduler holds the frames of the channel back
+					// and the pty isn't read, once its queue is full
 					if ((signals & S_FC) == S_FC) {
-						if (_debug)
+						if (DEBUG_ENABLED)
 							syslog(LOG_DEBUG, "No frames allowed.\n");
+						mux->cstatus[channel].stopped = 1;
 					} else {
 						// op.arg |= USSP_CTS;
-						if (_debug)
+						if (DEBUG_ENABLED)
 							syslog(LOG_DEBUG, "Frames allowed.\n");
+						mux->cstatus[channel].stopped = 0;
 					}
 					if ((signals & S_RTC) == S_RTC) {
 						// op.arg |= USSP_DSR;
-						if (_debug)
+						if (DEBUG_ENABLED)
 							syslog(LOG_DEBUG, "RTC\n");
 					}
 					if ((signals & S_IC) == S_IC) {
 						// op.arg |= USSP_RI;
-						if (_debug)
+						if (DEBUG_ENABLED)
 							syslog(LOG_DEBUG, "Ring\n");
 					}
 					if ((signals & S_DV) == S_DV) {
 						// op.arg |= USSP_DCD;
-						if (_debug)
+						if (DEBUG_ENABLED)
 							syslog(LOG_DEBUG, "DV\n");
 					}
 					// if (channel > 0)
 					//     write(ussp_fd[(channel - 1)], &op, sizeof(op));
 				} else {
-					syslog(LOG_ERR,
-							"ERROR: Modem status command, but no info. i: %d, len: %d, data-len: %d\n",
+					SYSLOG(LOG_ERR,
+							"%s: ERROR: Modem status command, but no info. i: %d, len: %d, data-len: %d\n", mux->serportdev,
 							i, length, frame->data_length);
 				}
 				break;
+			case C_FCON:
+			case C_FCOFF:
+				// aggregate flow control of all DLCs
+				mux->stopped = COMMAND_IS(C_FCOFF, type);
+				if (DEBUG_ENABLED)
+					syslog(LOG_DEBUG, "%s: Frames %sallowed.\n",
+							mux->serportdev, mux->stopped ? "not " : "");
+				break;
+			case C_PN:
+				if (i + PN_LENGTH <= frame->data_length) {
+					// agree to the parameters of the modem, but not to
+					// larger frames than we would have proposed
+					handle_parameters(mux, (unsigned char *) frame->data + i,
+							1);
+				} else {
+					SYSLOG(LOG_ERR,
+							"%s: ERROR: Parameter negotiation, but no info.\n",
+							mux->serportdev);
+				}
+				break;
 			default:
-				syslog(LOG_ALERT,
-						"Unknown command (%d) from the control channel.\n",
+				SYSLOG(LOG_ALERT,
+						"%s: Unknown command (%d) from the control channel.\n", mux->serportdev,
 						type);
 				response = malloc(sizeof(char) * (2 + type_length));
 				response[0] = C_NSC;
@@ -329,7 +1169,7 @@ void handle_command(GSM0710_Frame * frame) {
 					response[i] = frame->data[(i - 2)];
 					i++;
 				}
-				write_frame(0, response, i, UIH);
+				gsm0710_write_frame(mux, 0, response, i, UIH);
 				free(response);
 				supported = 0;
 				break;
@@ -338,15 +1178,23 @@ void handle_command(GSM0710_Frame * frame) {
 			if (supported) {
 				// acknowledge the command
 				frame->data[0] = frame->data[0] & ~CR;
-				write_frame(0, frame->data, frame->data_length, UIH);
+				gsm0710_write_frame(mux, 0, frame->data, frame->data_length,
+						UIH);
 			}
 		} else {
 			// received ack for a command
 			if (COMMAND_IS(C_NSC, type)) {
-				syslog(LOG_ALERT,
-						"The mobile station didn't support the command sent.\n");
+				SYSLOG(LOG_ALERT,
+						"%s: The mobile station didn't support the command sent.\n", mux->serportdev);
+			} else if (COMMAND_IS(C_PN, type)
+					&& i + PN_LENGTH <= frame->data_length) {
+				handle_parameters(mux, (unsigned char *) frame->data + i, 0);
+			} else if (COMMAND_IS(C_TEST, type) && mux->ping_time > 0) {
+				// the answer to our ping
+				mux->ping_rtt = gsm0710_monotonic_us() - mux->ping_time;
+				mux->ping_time = 0;
 			} else {
-				if (_debug)
+				if (DEBUG_ENABLED)
 					syslog(LOG_DEBUG,
 							"Command acknowledged by the mobile station.\n");
 			}
@@ -355,131 +1203,265 @@ void handle_command(GSM0710_Frame * frame) {
 #endif
 }
 
+/* Gets the next received frame: from the receive buffer or, in threaded
+ * mode, from the frames the RX thread has parsed. A frame taken from
+ * rx_ring stays there until the next call, which releases it.
+ *
+ * PARAMS:
+ * mux     - the multiplexer
+ * view    - filled in with the frame
+ * pending - size of the frame to release from rx_ring, 0 at first
+ * RETURNS:
+ * 1 if a frame was found, 0 otherwise
+ */
+static int next_frame_view(GSM0710_Mux *mux, GSM0710_FrameView *view,
+		unsigned int *pending) {
+	GSM0710_Spsc *r = mux->rx_ring;
+	GSM0710_Record rec;
+
+	if (!mux->threads_running)
+		return parse_frame(mux, view);
+	if (*pending > 0) {
+		gsm0710_spsc_consume(r, *pending);
+		*pending = 0;
+	}
+	if (gsm0710_spsc_length(r) < sizeof(rec))
+		return 0;
+	gsm0710_spsc_copy(r, 0, &rec, sizeof(rec));
+	view->channel = rec.channel;
+	view->control = rec.control;
+	view->data_length = rec.length;
+	view->segments = (rec.length > 0) ?
+			gsm0710_spsc_peek(r, sizeof(rec), view->seg, rec.length) : 0;
+	*pending = sizeof(rec) + rec.length;
+	return 1;
+}
+
 /* Extracts and handles frames from the receiver buffer.
  *
  * PARAMS:
- * buf - the receiver buffer
+ * mux - the multiplexer
  */
-int extract_frames(GSM0710_Buffer * buf) {
+int gsm0710_extract_frames(GSM0710_Mux *mux) {
 	// version test for Siemens terminals to enable version 2 functions
 	static char version_test[] = "\x23\x21\x04TEMUXVERSION2\0\0";
 	int framesExtracted = 0;
+	// payload of control channel and non-information frames, which are
+	// handled as contiguous data
+	char frame_data[GSM0710_BUFFER_SIZE];
 
-	GSM0710_Frame *frame;
+	GSM0710_FrameView view;
+	GSM0710_Frame frame_s, *frame = &frame_s;
+	unsigned int pending = 0;
 
-	if (_debug)
+	if (DEBUG_ENABLED)
 		syslog(LOG_DEBUG, "is in %s\n", __FUNCTION__);
-	while ((frame = gsm0710_buffer_get_frame(buf))) {
+	while (next_frame_view(mux, &view, &pending)) {
 		++framesExtracted;
+		mux->rx_frames[view.channel]++;
+		mux->rx_bytes[view.channel] += view.data_length;
+		MUX_CAPTURE(mux, CAPTURE_RX_FRAME, view.channel, view.control,
+				view.seg, view.segments);
+		if ((FRAME_IS(UI, (&view)) || FRAME_IS(UIH, (&view))) && view.channel > 0) {
+			if (DEBUG_ENABLED)
+				syslog(LOG_DEBUG, "Sending data to DLC channel %d\n", view.channel);
+			// data from logical channel, passed on without copying
+			if (mux->on_data[view.channel])
+				mux->on_data[view.channel](mux, view.channel, view.seg,
+						view.segments, mux->on_data_ctx[view.channel]);
+			continue;
+		}
+		frame->channel = view.channel;
+		frame->control = view.control;
+		frame->data = frame_data;
+		frame->data_length = gsm0710_frame_view_copy(&view, frame_data,
+				sizeof(frame_data));
 		if ((FRAME_IS(UI, frame) || FRAME_IS(UIH, frame))) {
-			if (_debug)
+			if (DEBUG_ENABLED)
 				syslog(LOG_DEBUG,
 						"is (FRAME_IS(UI, frame) || FRAME_IS(UIH, frame))\n");
-			if (frame->channel > 0) {
-				if (_debug)
-					syslog(LOG_DEBUG, "Sending data to DLC channel %d\n", frame->channel);
-				// data from logical channel
-				ussp_send_data(frame->data, frame->data_length,
-						frame->channel - 1);
-			} else {
-				// control channel command
-				if (_debug)
-					syslog(LOG_DEBUG, "control channel command\n");
-				handle_command(frame);
-			}
+			// control channel command
+			if (DEBUG_ENABLED)
+				syslog(LOG_DEBUG, "control channel command\n");
+			handle_command(mux, frame);
 		} else {
 			// not an information frame
-			if (_debug){
+			if (DEBUG_ENABLED){
 				syslog(LOG_DEBUG, "not an information frame\n");
 				print_frame(frame);
 			}
 			switch ((frame->control & ~PF)) {
 			case UA:
-				if (_debug)
+				if (DEBUG_ENABLED)
 					syslog(LOG_DEBUG, "is FRAME_IS(UA, frame)\n");
-				if (cstatus[frame->channel].opened == 1) {
-					syslog(LOG_INFO, "Logical channel %d closed.\n",
+				if (mux->cstatus[frame->channel].opened == 1) {
+					SYSLOG(LOG_INFO, "%s: Logical channel %d closed.\n", mux->serportdev,
 							frame->channel);
-					cstatus[frame->channel].opened = 0;
+					mux->cstatus[frame->channel].opened = 0;
 				} else {
-					cstatus[frame->channel].opened = 1;
+					mux->cstatus[frame->channel].opened = 1;
 					if (frame->channel == 0) {
-						syslog(LOG_INFO, "Control channel opened.\n");
+						SYSLOG(LOG_INFO, "%s: Control channel opened.\n", mux->serportdev);
 						// send version Siemens version test
-						write_frame(0, version_test, 18, UIH);
+						gsm0710_write_frame(mux, 0, version_test, 18, UIH);
 					} else {
-						syslog(LOG_INFO, "Logical channel %d opened.\n",
+						SYSLOG(LOG_INFO, "%s: Logical channel %d opened.\n", mux->serportdev,
 								frame->channel);
 					}
 				}
 				break;
 			case DM:
-				if (cstatus[frame->channel].opened) {
-					syslog(LOG_INFO,
-							"DM received, so the channel %d was already closed.\n",
+				if (mux->cstatus[frame->channel].opened) {
+					SYSLOG(LOG_INFO,
+							"%s: DM received, so the channel %d was already closed.\n", mux->serportdev,
 							frame->channel);
-					cstatus[frame->channel].opened = 0;
+					mux->cstatus[frame->channel].opened = 0;
 				} else {
 					if (frame->channel == 0) {
-						syslog(LOG_INFO,
-								"Couldn't open control channel.\n->Terminating.\n");
-						terminate = 1;
-						terminateCount = -1;    // don't need to close channels
+						SYSLOG(LOG_INFO,
+								"%s: Couldn't open control channel.\n->Terminating.\n", mux->serportdev);
+						mux->terminate = 1;
+						mux->terminateCount = -1;    // don't need to close channels
 					} else {
-						syslog(LOG_INFO,
-								"Logical channel %d couldn't be opened.\n",
+						SYSLOG(LOG_INFO,
+								"%s: Logical channel %d couldn't be opened.\n", mux->serportdev,
 								frame->channel);
 					}
 				}
 				break;
 			case DISC:
-				if (cstatus[frame->channel].opened) {
-					cstatus[frame->channel].opened = 0;
-					write_frame(frame->channel, NULL, 0, UA | PF);
+				if (mux->cstatus[frame->channel].opened) {
+					mux->cstatus[frame->channel].opened = 0;
+					gsm0710_write_frame(mux, frame->channel, NULL, 0, UA | PF);
 					if (frame->channel == 0) {
-						syslog(LOG_INFO, "Control channel closed.\n");
-						if (faultTolerant) {
-							restart = 1;
+						SYSLOG(LOG_INFO, "%s: Control channel closed.\n", mux->serportdev);
+						if (mux->faultTolerant) {
+							mux->restart = 1;
 						} else {
-							terminate = 1;
-							terminateCount = -1; // don't need to close channels
+							mux->terminate = 1;
+							mux->terminateCount = -1; // don't need to close channels
 						}
 					} else {
-						syslog(LOG_INFO, "Logical channel %d closed.\n",
+						SYSLOG(LOG_INFO, "%s: Logical channel %d closed.\n", mux->serportdev,
 								frame->channel);
 					}
 				} else {
 					// channel already closed
-					syslog(LOG_INFO,
-							"Received DISC even though channel %d was already closed.\n",
+					SYSLOG(LOG_INFO,
+							"%s: Received DISC even though channel %d was already closed.\n", mux->serportdev,
 							frame->channel);
-					write_frame(frame->channel, NULL, 0, DM | PF);
+					gsm0710_write_frame(mux, frame->channel, NULL, 0, DM | PF);
 				}
 				break;
 			case SABM:
 				// channel open request
-				if (cstatus[frame->channel].opened == 0) {
+				if (mux->cstatus[frame->channel].opened == 0) {
 					if (frame->channel == 0) {
-						syslog(LOG_INFO, "Control channel opened.\n");
+						SYSLOG(LOG_INFO, "%s: Control channel opened.\n", mux->serportdev);
 					} else {
-						syslog(LOG_INFO, "Logical channel %d opened.\n",
+						SYSLOG(LOG_INFO, "%s: Logical channel %d opened.\n", mux->serportdev,
 								frame->channel);
 					}
 				} else {
 					// channel already opened
-					syslog(LOG_INFO,
-							"Received SABM even though channel %d was already closed.\n",
+					SYSLOG(LOG_INFO,
+							"%s: Received SABM even though channel %d was already closed.\n", mux->serportdev,
 							frame->channel);
 				}
-				cstatus[frame->channel].opened = 1;
-				write_frame(frame->channel, NULL, 0, UA | PF);
+				mux->cstatus[frame->channel].opened = 1;
+				gsm0710_write_frame(mux, frame->channel, NULL, 0, UA | PF);
 				break;
 			}
 		}
-
-		destroy_frame(frame);
 	}
-	if (_debug)
+	if (DEBUG_ENABLED)
 		syslog(LOG_DEBUG, "out of %s; framesExtracted: %d\n", __FUNCTION__, framesExtracted);
 	return framesExtracted;
 }
+
+GSM0710_Mux *gsm0710_mux_new() {
+	GSM0710_Mux *mux;
+
+	gsm0710_fcs_init();
+	pthread_once(&header_fcs_once, init_header_fcs);
+	if (!(mux = calloc(1, sizeof(GSM0710_Mux))))
+		return NULL;
+	if (!(mux->in_buf = gsm0710_buffer_init())
+			|| !(mux->out_buf = gsm0710_buffer_init())) {
+		gsm0710_buffer_destroy(mux->in_buf);
+		free(mux);
+		return NULL;
+	}
+	mux->serportdev = "/dev/modem";
+	mux->max_frame_size = 31; // The limit of Sony-Ericsson GM47
+	mux->serial_fd = -1;
+	mux->stop_fd = -1;
+	mux->tx_deadline = LLONG_MAX;
+	mux->rx_stall_deadline = LLONG_MAX;
+	mux->pingNumber = 1;
+	return mux;
+}
+
+void gsm0710_mux_free(GSM0710_Mux *mux) {
+	int i;
+
+	gsm0710_buffer_destroy(mux->in_buf);
+	gsm0710_buffer_destroy(mux->out_buf);
+	for (i = 0; i < MAX_DLCS; i++)
+		gsm0710_buffer_destroy(mux->txq[i].buf);
+	gsm0710_spsc_destroy(mux->rx_ring);
+	gsm0710_spsc_destroy(mux->tx_ring);
+	if (mux->stop_fd >= 0)
+		close(mux->stop_fd);
+	free(mux);
+}
+
+int gsm0710_mux_set_mirrored(GSM0710_Mux *mux, int mirrored) {
+	int i;
+
+	mux->mirrored = mirrored;
+	if (gsm0710_buffer_set_mirrored(mux->in_buf, mirrored) != 0
+			|| gsm0710_buffer_set_mirrored(mux->out_buf, mirrored) != 0)
+		return -1;
+	for (i = 0; i < MAX_DLCS; i++) {
+		if (mux->txq[i].buf
+				&& gsm0710_buffer_set_mirrored(mux->txq[i].buf, mirrored) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+void gsm0710_mux_set_io(GSM0710_Mux *mux, GSM0710_IoFunc read,
+		GSM0710_IoFunc write, void *ctx) {
+	mux->io_read = read;
+	mux->io_write = write;
+	mux->io_ctx = ctx;
+}
+
+void gsm0710_mux_set_data_callback(GSM0710_Mux *mux, int dlc,
+		GSM0710_DataCallback callback, void *ctx) {
+	dlc &= MAX_DLCS - 1;
+	mux->on_data[dlc] = callback;
+	mux->on_data_ctx[dlc] = ctx;
+}
+
+int gsm0710_mux_input(GSM0710_Mux *mux, const char *data, int count) {
+	unsigned int head;
+	int i, n;
+
+	for (i = 0; i < count; i += n) {
+		if (gsm0710_buffer_make_room(mux->in_buf,
+				mux->advanced ? ADV_FLAG : F_FLAG) == 0)
+			break;
+		head = mux->in_buf->head;
+		n = gsm0710_buffer_write(mux->in_buf, data + i, count - i);
+		if (mux->capture)
+			gsm0710_capture_buffer(mux->capture, mux->capture_source,
+					CAPTURE_RX_RAW, mux->in_buf, head, n);
+		gsm0710_extract_frames(mux);
+	}
+	// give up a frame, whose rest doesn't arrive
+	if (gsm0710_receive_check_stall(mux, gsm0710_monotonic_us(), i > 0))
+		gsm0710_extract_frames(mux);
+	return i;
+}
@@ -8,6 +8,20 @@
  * 
  * Version 1.0 October 2003
  *
+ * This is the interface of libgsm0710 too. A program drives a modem in
+ * process through a multiplexer from gsm0710_mux_new(): it sets the
+ * serial I/O (serial_fd or gsm0710_mux_set_io()) and a data callback for
+ * every DLC it uses, opens the channels by gsm0710_write_frame() with
+ * GSM0710_SABM, and passes what the modem sends to
+ * gsm0710_receive_fill() or gsm0710_mux_input(). Received frames are
+ * handled by gsm0710_extract_frames(), data is sent by
+ * gsm0710_write_frame() and written by gsm0710_write_frame_flush().
+ * gsmMuxd is such a program, which connects the DLCs to pseudo TTYs.
+ * Multiplexers share nothing, so one process can drive many. All names
+ * this header exports start with gsm0710_ or GSM0710_, the short names
+ * the library and gsmMuxd use among themselves are in internal.h, which
+ * isn't part of the interface.
+ *
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
@@ -25,60 +39,353 @@
  *
  */
 
-// for debugging
-#ifdef DEBUG
-#  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
-#else
-#  define PDEBUG(fmt, args...) /* not debugging: nothing */
-#endif
-
-// basic mode flag for frame start and end
-#define F_FLAG 0xF9
-
-// bits: Poll/final, Command/Response, Extension
-#define PF 16
-#define CR 2
-#define EA 1
-// the types of the frames
-#define SABM 47
-#define UA 99
-#define DM 15
-#define DISC 67
-#define UIH 239
-#define UI 3
-// the types of the control channel commands
-#define C_CLD 193
-#define C_TEST 33
-#define C_MSC 225
-#define C_NSC 17
-// V.24 signals: flow control, ready to communicate, ring indicator, data valid
-// three last ones are not supported by Siemens TC_3x
-#define S_FC 2
-#define S_RTC 4
-#define S_RTR 8
-#define S_IC 64
-#define S_DV 128
-
-#define COMMAND_IS(command, type) ((type & ~CR) == command)
-#define PF_ISSET(frame) ((frame->control & PF) == PF)
-#define FRAME_IS(type, frame) ((frame->control & ~PF) == type)
+#include <pthread.h>
+#include "buffer.h"
+
+struct GSM0710_Spsc;
+struct GSM0710_Capture;
+
+// debug messages are logged, if set by gsm0710_set_debug(), e.g. for
+// gsmMuxd -d
+extern int gsm0710_debug;
+void gsm0710_set_debug(int debug);
+
+// the Poll/Final bit and the types of the frames for gsm0710_write_frame()
+#define GSM0710_PF 16
+#define GSM0710_SABM 47
+#define GSM0710_UA 99
+#define GSM0710_DM 15
+#define GSM0710_DISC 67
+#define GSM0710_UIH 239
+#define GSM0710_UI 3
 
 // Channel status tells if the DLC is open and what were the last
-// v.24 signals sent
-typedef struct Channel_Status {
+// v.24 signals sent, and the parameters agreed for it
+typedef struct GSM0710_ChannelStatus {
 	int opened;
 	unsigned char v24_signals;
-} Channel_Status;
+	int frame_size; // N1, 0 until agreed by parameter negotiation
+	int priority;   // 0 is the highest
+	int ack_timer;  // T1 in units of 10 ms
+	int retransmissions; // N2
+	int stopped;    // the modem doesn't accept frames (MSC with FC)
+} GSM0710_ChannelStatus;
+
+// the number of DLCs the address field can express
+#define GSM0710_MAX_DLCS 64
+
+// number of enqueue times kept per transmit queue, for the wait times
+#define GSM0710_TXQ_CHUNKS 16
+
+/* Data of a virtual port waiting to be sent on its DLC. The transmit
+ * scheduler takes frames from these queues: the priority class first, the
+ * other channels by deficit round robin according to their weights.
+ */
+typedef struct GSM0710_TxQueue {
+	GSM0710_Buffer *buf; // allocated, when the ports are opened
+	int weight;    // maximum size frames per round, at least one
+	int priority;  // strict priority class, preempts the others
+	int deficit;
+	int visited;   // the quantum of the current round has been added
+	// enqueue times of the queued data, oldest first
+	long long chunk_time[GSM0710_TXQ_CHUNKS];
+	int chunk_bytes[GSM0710_TXQ_CHUNKS];
+	int chunk_first;
+	int chunk_count;
+	// statistics
+	unsigned long frames;
+	unsigned long long bytes;
+	int max_depth;
+	long long wait_total; // of all frames in microseconds
+	long long wait_max;
+} GSM0710_TxQueue;
+
+struct GSM0710_Mux;
+
+/* Receives the data of the UI and UIH frames of a DLC. The data points
+ * into the receive buffer and is valid during the call only.
+ */
+typedef void (*GSM0710_DataCallback)(struct GSM0710_Mux *mux, int dlc,
+		const struct iovec *iov, int iovcnt, void *ctx);
+
+/* The protocol state of one multiplexer, i.e. of one modem and its DLCs.
+ * What the DLCs are connected to is up to the program. Nothing is shared
+ * between multiplexers, so one process can drive many.
+ */
+typedef struct GSM0710_Mux {
+	// configuration
+	char *serportdev;
+	int max_frame_size;
+	int pn_frame_size[GSM0710_MAX_DLCS]; // N1 to propose by DLC, 0 for max_frame_size
+	int advanced; // advanced option framing, AT+CMUX=1
+	int faultTolerant;
+	int mirrored; // buffers are mapped twice, see gsm0710_mux_set_mirrored()
+	int numOfPorts; // DLCs 1 .. numOfPorts carry data, below GSM0710_MAX_DLCS
+
+	// protocol state
+	int serial_fd; // the I/O threads and the event loop of gsmMuxd wait on it
+	// serial I/O, readv() and writev() of serial_fd by default
+	GSM0710_IoFunc io_read;
+	GSM0710_IoFunc io_write;
+	void *io_ctx;
+	// receivers of the data by DLC, the data of the others is dropped
+	GSM0710_DataCallback on_data[GSM0710_MAX_DLCS];
+	void *on_data_ctx[GSM0710_MAX_DLCS];
+	GSM0710_Buffer *in_buf;  // input buffer
+	GSM0710_Buffer *out_buf; // frames waiting for the serial port
+	GSM0710_ChannelStatus cstatus[GSM0710_MAX_DLCS];
+	int tx_holdoff[GSM0710_MAX_DLCS];
+	long long tx_deadline;
+	long long rx_stall_deadline; // when a started frame in in_buf is given up
+	int stopped; // the modem doesn't accept frames on any DLC (FCoff)
+	GSM0710_TxQueue txq[GSM0710_MAX_DLCS]; // by DLC, 0 is unused
+	int drr_next;  // the DLC being served by deficit round robin - 1
+	int prio_next; // where the search in the priority class starts - 1
+
+	// life cycle
+	int terminate;
+	int terminateCount;
+	int restart;
+	int pingNumber;
+
+	// statistics by DLC, the receive errors are counted by in_buf
+	unsigned long rx_frames[GSM0710_MAX_DLCS];
+	unsigned long long rx_bytes[GSM0710_MAX_DLCS];
+	unsigned long tx_frames[GSM0710_MAX_DLCS];
+	unsigned long long tx_bytes[GSM0710_MAX_DLCS];
+	long long ping_time; // when the unanswered ping was sent, 0 if none
+	long long ping_rtt;  // of the last answered ping in microseconds
+
+	// serial data and frames are recorded here, if not NULL, as coming
+	// from multiplexer capture_source
+	struct GSM0710_Capture *capture;
+	int capture_source;
+
+	/* threaded mode: the RX thread reads the serial port and passes the
+	 * parsed frames to the main thread in rx_ring, the TX thread encodes
+	 * the frames the main thread queues to tx_ring and writes them */
+	int threads_running;
+	pthread_t rx_thread;
+	pthread_t tx_thread;
+	int stop_fd; // eventfd telling the threads to exit
+	struct GSM0710_Spsc *rx_ring;
+	struct GSM0710_Spsc *tx_ring;
+} GSM0710_Mux;
+
+/* Allocates a multiplexer with the defaults: no ports, basic framing,
+ * frames of 31 characters and serial I/O on serial_fd, which is -1. The
+ * first call picks the FCS kernel by gsm0710_fcs_init(), unless the
+ * program has done so.
+ *
+ * RETURNS:
+ * the multiplexer or NULL, if out of memory
+ */
+GSM0710_Mux *gsm0710_mux_new();
+
+/* Frees a multiplexer, whose I/O threads have been stopped. serial_fd is
+ * left to the caller.
+ */
+void gsm0710_mux_free(GSM0710_Mux *mux);
+
+/* Sets the serial I/O of a multiplexer, e.g. for a modem on a socket or
+ * a USB library. The functions return like readv() and writev() and set
+ * errno, EAGAIN if they would block. The I/O threads of threaded mode
+ * call them too: they wait for serial_fd to become ready, if it is set,
+ * or else retry the functions every millisecond, while they return
+ * EAGAIN.
+ *
+ * PARAMS:
+ * mux   - the multiplexer
+ * read  - reads from the modem, NULL for readv() of serial_fd
+ * write - writes to the modem, NULL for writev() of serial_fd
+ * ctx   - passed to both
+ */
+void gsm0710_mux_set_io(GSM0710_Mux *mux, GSM0710_IoFunc read,
+		GSM0710_IoFunc write, void *ctx);
+
+/* Chooses the storage of the buffers of a multiplexer: the input and the
+ * transmit buffer and the transmit queues. Plain rings by default; the
+ * pages of mirrored ones are mapped twice, so frames are parsed and
+ * written without wrapping around, at the cost of a page per buffer at
+ * least.
+ *
+ * RETURNS:
+ * 0 on success, -1 if out of memory
+ */
+int gsm0710_mux_set_mirrored(GSM0710_Mux *mux, int mirrored);
+
+/* Sets the receiver of the data of a DLC
+ *
+ * PARAMS:
+ * mux      - the multiplexer
+ * dlc      - 1 to 63
+ * callback - called for every frame with data, NULL drops the data
+ * ctx      - passed to the callback
+ */
+void gsm0710_mux_set_data_callback(GSM0710_Mux *mux, int dlc,
+		GSM0710_DataCallback callback, void *ctx);
+
+/* Passes characters received from the modem to a multiplexer, which
+ * doesn't read the serial port itself, and handles the frames they
+ * complete. The frames are passed on to the data callbacks before
+ * returning, answers go to the transmit buffer. Not in threaded mode,
+ * where the RX thread owns the receive buffer.
+ *
+ * RETURNS:
+ * the number of characters taken, less than count only if the receive
+ * buffer is full with the STOP overflow policy
+ */
+int gsm0710_mux_input(GSM0710_Mux *mux, const char *data, int count);
+
+int gsm0710_write_frame(GSM0710_Mux *mux, int channel, const char *input,
+		int count, unsigned char type);
+int gsm0710_write_frame_capacity(GSM0710_Mux *mux, int size);
+
+/* Sets how long frames of a channel may wait in the transmit buffer for
+ * frames of other channels, so that they can be written together.
+ *
+ * PARAMS:
+ * mux     - the multiplexer
+ * channel - channel number (0 = control)
+ * usec    - the hold-off in microseconds
+ */
+void gsm0710_write_frame_set_holdoff(GSM0710_Mux *mux, int channel, int usec);
+
+/* Tells, when the queued frames have to be written
+ *
+ * RETURNS:
+ * microseconds until the frames are due, 0 if they are due now, -1 if
+ * there aren't any queued frames
+ */
+long long gsm0710_write_frame_due(GSM0710_Mux *mux);
+
+/* Writes the queued frames to the serial port as far as it accepts them
+ * without blocking, if they are due or force is set
+ *
+ * RETURNS:
+ * number of characters written or -1 on error
+ */
+int gsm0710_write_frame_flush(GSM0710_Mux *mux, int force);
+
+/* Allocates the transmit queues of the virtual ports or resizes them to
+ * hold TXQ_FRAMES frames of the size proposed for the channel, so data
+ * read from the ptys is framed in place
+ *
+ * RETURNS:
+ * 0 on success, -1 if out of memory or numOfPorts is out of range
+ */
+int gsm0710_write_frame_queue_init(GSM0710_Mux *mux);
+
+/* Queues data of a virtual port for the transmit scheduler
+ *
+ * PARAMS:
+ * mux     - the multiplexer
+ * channel - the DLC (1 .. number of ports)
+ * input   - the data
+ * count   - the length of the data
+ * RETURNS:
+ * number of characters queued
+ */
+int gsm0710_write_frame_enqueue(GSM0710_Mux *mux, int channel, const char *input,
+		int count);
+
+/* Reads data of a virtual port straight into the transmit queue of its
+ * channel
+ *
+ * PARAMS:
+ * mux     - the multiplexer
+ * channel - the DLC (1 .. number of ports)
+ * fd      - the pty to read from
+ * count   - how many characters to read at most
+ * RETURNS:
+ * number of characters queued, 0 at end of file or -1 on error
+ */
+int gsm0710_write_frame_enqueue_fd(GSM0710_Mux *mux, int channel, int fd,
+		int count);
+
+// Tells, how much data the transmit queue of a channel still takes
+int gsm0710_write_frame_queue_free(GSM0710_Mux *mux, int channel);
+
+/* Sets the deficit round robin weight of a channel, i.e. how many frames
+ * of the maximum size it may send per round. A weight of 0 puts the
+ * channel to the strict priority class instead.
+ */
+void gsm0710_write_frame_set_weight(GSM0710_Mux *mux, int channel, int weight);
 
-// for debugging 
-#define print_bits(n) printf("%d%d%d%d%d%d%d%d", ((n&128) == 128), \
-			     ((n&64) == 64),((n&32) == 32),((n&16) == 16), \
-			     ((n&8) == 8),((n&4) == 4),((n&2) == 2), \
-			     ((n&1) == 1));
+/* Moves frames from the transmit queues to the transmit buffer. Frames
+ * of the priority class are taken as long as they fit, the others only
+ * while less than TX_BACKLOG characters wait for the serial port, so
+ * that a priority frame never waits behind much bulk data.
+ *
+ * RETURNS:
+ * number of frames moved
+ */
+int gsm0710_write_frame_schedule(GSM0710_Mux *mux);
+
+// Tells, if gsm0710_write_frame_schedule() would move anything now
+int gsm0710_write_frame_schedulable(GSM0710_Mux *mux);
+
+// Logs the depth, wait times and throughput of the transmit queues
+void gsm0710_write_frame_log_stats(GSM0710_Mux *mux);
+
+/* Tells the modem to stop or to resume sending frames on a DLC by an MSC
+ * command with the FC signal. Nothing is sent, if the signal is already
+ * in the requested state.
+ */
+void gsm0710_send_flow_control(GSM0710_Mux *mux, int channel, int stop);
+
+/* Proposes the parameters of a DLC to the modem by a PN command on the
+ * control channel: the frame size given for the DLC, UIH frames and a
+ * priority, which is the highest for the strict priority class of the
+ * transmit scheduler. The parameters are applied, when the modem answers.
+ * Send it before the SABM of the DLC, as 07.10 requires.
+ */
+void gsm0710_send_parameter_negotiation(GSM0710_Mux *mux, int channel);
 
-int write_frame(int channel, const char *input, int count, unsigned char type);
-int extract_frames(GSM0710_Buffer * buf);
-int ussp_send_data(char *buf, int n, int port);
+// Returns CLOCK_MONOTONIC time in microseconds
+long long gsm0710_monotonic_us();
+int gsm0710_extract_frames(GSM0710_Mux *mux);
+
+/* Watches for a frame in the receive buffer, whose rest doesn't arrive,
+ * e.g. because its length field was corrupted, and gives it up after
+ * RX_STALL_TIMEOUT. Called by the owner of the receive buffer after
+ * parsing.
+ *
+ * PARAMS:
+ * mux      - the multiplexer
+ * now      - the current time
+ * received - set, if characters have been received since the last call
+ * RETURNS:
+ * 1 if a frame was given up and the buffer should be parsed again
+ */
+int gsm0710_receive_check_stall(GSM0710_Mux *mux, long long now, int received);
+
+/* Reads the serial port to the receive buffer and records what was read
+ * in the capture. Called by the owner of the receive buffer.
+ *
+ * PARAMS:
+ * mux  - the multiplexer
+ * size - how much to read at most, e.g. the free space of the buffer
+ * RETURNS:
+ * the number of characters read, 0 at end of file or -1 on error
+ */
+int gsm0710_receive_fill(GSM0710_Mux *mux, int size);
+
+/* Starts the RX and TX threads of a multiplexer. From now on the main
+ * thread only touches the serial port through rx_ring and tx_ring.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error, e.g. EBADF, if there is neither serial_fd
+ * nor both I/O functions
+ */
+int gsm0710_start_io_threads(GSM0710_Mux *mux);
+
+/* Stops the RX and TX threads of a multiplexer. The TX thread writes
+ * the frames left in tx_ring before it exits, the last ones are left in
+ * the transmit buffer to be flushed by the caller. Frames are only
+ * dropped, if the serial port doesn't take anything for a second.
+ */
+void gsm0710_stop_io_threads(GSM0710_Mux *mux);
 
 #endif /* _GSM0710_H_ */
 
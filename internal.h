@@ -0,0 +1,140 @@
+#ifndef _GSM0710_INTERNAL_H_
+#define _GSM0710_INTERNAL_H_
+/*
+ * internal.h -- definitions libgsm0710 shares with gsmMuxd and its tools,
+ *               which aren't part of the interface of the library: the
+ *               frame format of 07.10 by its short names, logging and the
+ *               helpers of the multiplexer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <syslog.h>
+#include "buffer.h"
+#include "gsm0710.h"
+#include "fcs.h"
+#include "spsc.h"
+#include "trace.h"
+#include "capture.h"
+
+// for debugging
+#ifdef DEBUG
+#  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
+#else
+#  define PDEBUG(fmt, args...) /* not debugging: nothing */
+#endif
+
+// the least important syslog priority compiled in, e.g. -DLOG_LEVEL=6
+// leaves out the LOG_DEBUG messages
+#ifndef LOG_LEVEL
+#  ifdef DEBUG
+#    define LOG_LEVEL LOG_DEBUG
+#  else
+#    define LOG_LEVEL LOG_INFO
+#  endif
+#endif
+
+// true if debug messages are compiled in and asked for by
+// gsm0710_set_debug(), a constant 0 lets the compiler drop the whole
+// message
+#define DEBUG_ENABLED (LOG_LEVEL >= LOG_DEBUG && gsm0710_debug)
+// syslog(), which is left out below LOG_LEVEL
+#define SYSLOG(level, fmt, args...) do { \
+		if ((level) <= LOG_LEVEL) \
+			syslog(level, fmt, ## args); \
+	} while (0)
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+// basic mode flag for frame start and end
+#define F_FLAG 0xF9
+// advanced option flag, control escape and the bit flipped by the escape
+#define ADV_FLAG 0x7E
+#define ADV_ESCAPE 0x7D
+#define ADV_XOR 0x20
+// the largest amount of data the two octet length field can describe
+#define MAX_FRAME_DATA 32767
+// a started frame is given up, if the serial port stays silent this long
+#define RX_STALL_TIMEOUT 500000 // us
+
+// bits: Poll/final, Command/Response, Extension
+#define PF GSM0710_PF
+#define CR 2
+#define EA 1
+// the types of the frames
+#define SABM GSM0710_SABM
+#define UA GSM0710_UA
+#define DM GSM0710_DM
+#define DISC GSM0710_DISC
+#define UIH GSM0710_UIH
+#define UI GSM0710_UI
+// the types of the control channel commands
+#define C_CLD 193
+#define C_TEST 33
+#define C_MSC 225
+#define C_NSC 17
+#define C_PN 129
+#define C_FCON 161
+#define C_FCOFF 97
+// V.24 signals: flow control, ready to communicate, ring indicator, data valid
+// three last ones are not supported by Siemens TC_3x
+#define S_FC 2
+#define S_RTC 4
+#define S_RTR 8
+#define S_IC 64
+#define S_DV 128
+
+#define COMMAND_IS(command, type) ((type & ~CR) == command)
+#define PF_ISSET(frame) ((frame->control & PF) == PF)
+#define FRAME_IS(type, frame) ((frame->control & ~PF) == type)
+
+// for debugging
+#define print_bits(n) printf("%d%d%d%d%d%d%d%d", ((n&128) == 128), \
+			     ((n&64) == 64),((n&32) == 32),((n&16) == 16), \
+			     ((n&8) == 8),((n&4) == 4),((n&2) == 2), \
+			     ((n&1) == 1));
+
+#define MAX_DLCS GSM0710_MAX_DLCS
+
+// a transmit queue holds this many frames of the channel at least
+#define TXQ_FRAMES 8
+// bulk data waiting for the serial port, before the scheduler holds back
+#define TX_BACKLOG 512
+// the longest frame data, which fits to in_buf and out_buf in the framing
+// of a multiplexer, i.e. the largest N1 we can agree on
+#define FRAME_SIZE_LIMIT(mux) ((mux)->advanced \
+		? (GSM0710_BUFFER_FRAME_MAX - 1) / 2 : GSM0710_BUFFER_FRAME_MAX)
+
+// records a frame event in the trace ring, which the multiplexer shares
+// with its input buffer
+#define MUX_TRACE(mux, dlc, control, length, verdict) \
+	gsm0710_trace((mux)->in_buf->trace, (mux)->in_buf->trace_source, \
+			(dlc), (control), (length), (verdict))
+
+// records serial data or a frame in the capture, if there is one
+#define MUX_CAPTURE(mux, type, dlc, control, iov, iovcnt) do { \
+		if ((mux)->capture) \
+			gsm0710_capture_write((mux)->capture, (mux)->capture_source, \
+					(type), (dlc), (control), (iov), (iovcnt)); \
+	} while (0)
+
+#endif /* _GSM0710_INTERNAL_H_ */
@@ -84,15 +84,22 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <limits.h>
 //syslog
 #include <syslog.h>
 
 #include "buffer.h"
-#include "gsm0710.h"
+#include "internal.h"
+#include "metrics.h"
+#include "muxd.h"
 
 #define DEFAULT_NUMBER_OF_PORTS 3
-#define WRITE_RETRIES 5
-#define MAX_CHANNELS   32
+// the largest number of modems one daemon drives
+#define MAX_MUXES 16
 //vitorio, only to use if necessary (don't ask in what i was thinking  when i wrote this)
 #define TRUE	1
 #define FALSE	0
@@ -105,37 +112,53 @@
 // The value is in seconds
 #define POLLING_INTERVAL 1
 #define MAX_PINGS 2
-
-volatile int terminate = 0;
-int terminateCount = 0;
-static char* devSymlinkPrefix = 0;
-
-typedef struct {
+// Interval of closing down channels on termination in microseconds
+#define TERMINATE_STEP 100000
+#define MAX_EVENTS 64
+// Serial port reads per event loop round before the ports get their turn
+#define MAX_READS_PER_ROUND 16
+// Interval of attempts to restart the mux in microseconds
+#define RESTART_INTERVAL 1000000
+// Frame events kept by -T
+#define TRACE_SIZE 16384
+// Connections to the control socket served at once
+#define MAX_CONTROL_CLIENTS 4
+
+// A client of the control socket, whose command is being read
+typedef struct ControlClient {
+	Source src; // must be first
 	int fd;
-	char * name;
-}ussp_fd_t;
+	char line[64];
+	int length;
+} ControlClient;
 
-static ussp_fd_t *ussp_fd;
-int serial_fd;
-Channel_Status *cstatus;
-int max_frame_size = 31; // The limit of Sony-Ericsson GM47
+// set by signals, closes down all multiplexers
+volatile int terminate = 0;
+volatile int dump_stats = 0;
 static int wait_for_daemon_status = 0;
+// -d: log debug messages and don't fork
+static int debug = 0;
 
-
-static GSM0710_Buffer *in_buf;  // input buffer
-int _debug = 0;
 static pid_t the_pid;
 int _priority;
-int _modem_type;
-static char *serportdev;
-static int pin_code = 0;
-static char *ptydev[MAX_CHANNELS];
-static int numOfPorts;
-static int maxfd;
-static int baudrate = 0;
-static int *remaining;
-int faultTolerant = 0;
-int restart = 0;
+static Modem *modems[MAX_MUXES];
+static int numOfMuxes = 0;
+static int epoll_fd = -1;
+static Source timer_src;
+static int timer_fd = -1;
+static char *metricsPath = NULL;
+static Source metrics_src;
+static int metrics_fd = -1;
+static char *controlPath = NULL;
+static Source control_src;
+static int control_fd = -1;
+static ControlClient controlClients[MAX_CONTROL_CLIENTS];
+static char *traceFile = NULL;
+static GSM0710_Trace *trace = NULL;
+static char *captureFile = NULL;
+static char *tapPath = NULL;
+static GSM0710_Capture *capture = NULL;
+static char *replayFile = NULL;
 
 /* The following arrays must have equal length and the values must
  * correspond.
@@ -146,46 +169,131 @@ static int baudrates[] =
 static speed_t baud_bits[] = { 0, B9600, B19200, B38400, B57600, B115200,
 		B230400, B460800 };
 
-/* Handles received data from ussp device.
+/* Handles received data from ussp device. The data is read straight into
+ * the transmit queue of the logical channel, where the scheduler makes
+ * frames of it, when it is the turn of the channel.
  *
  * This function is derived from a similar function in RFCOMM Implementation
  * with USSPs made by Marcel Holtmann.
  *
  * PARAMS:
- * buf   - buffer, which contains received data
- * len   - the length of the buffer
+ * m     - the modem
  * port  - the number of ussp device (logical channel), where data was
  *         received
+ * room  - how much the transmit queue takes
+ * RETURNS:
+ * the number of bytes read, 0 at end of file or -1 on error
+ */
+int ussp_recv_data(Modem *m, int port, int room) {
+	int len = gsm0710_write_frame_enqueue_fd(m->mux, port + 1,
+			m->ports[port].fd, room);
+
+	if (DEBUG_ENABLED)
+		syslog(LOG_DEBUG, "Data from %s: %d bytes\n", m->ports[port].name,
+				len);
+	return len;
+}
+
+/* Passes data received from a logical channel to its pseudo TTY. What
+ * the pty doesn't take at once is queued, until it becomes writable.
+ *
+ * PARAMS:
+ * m      - the modem
+ * iov    - segments of the received data
+ * iovcnt - number of segments
+ * port   - the number of ussp device (logical channel)
  * RETURNS:
- * the number of remaining bytes in partial packet
+ * the number of bytes written or queued
  */
-int ussp_recv_data(char *buf, int len, int port) {
-
-	int written = 0;
-	int i = 0;
-	int last = 0;
-	// try to write 5 times
-	while (written != len && i < WRITE_RETRIES) {
-		last = write_frame(port + 1, buf + written, len - written, UIH);
-		written += last;
-		if (last == 0) {
-			i++;
+int ussp_send_data(Modem *m, const struct iovec *iov, int iovcnt,
+		int port) {
+	GSM0710_Mux *mux = m->mux;
+	Port *p;
+	int written = 0, queued = 0, count = 0, skip, i;
+
+	if (port >= mux->numOfPorts)
+		return 0;
+	p = &m->ports[port];
+	if (DEBUG_ENABLED)
+		syslog(LOG_DEBUG, "send data to port virtual port %s\n", p->name);
+	for (i = 0; i < iovcnt; i++)
+		count += iov[i].iov_len;
+	// data mustn't overtake what is queued already
+	if (!p->rxq || gsm0710_buffer_length(p->rxq) == 0) {
+		if ((written = writev(p->fd, iov, iovcnt)) == count)
+			return written;
+		if (written < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		written = max(written, 0);
+		// wait for the next edge
+		p->src.writable = 0;
+	}
+	if (!p->rxq && !(p->rxq = p->src.modem->mux->mirrored
+			? gsm0710_buffer_init_mirrored(RXQ_SIZE)
+			: gsm0710_buffer_init_size(RXQ_SIZE)))
+		return written;
+	for (i = 0, skip = written; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
 		}
+		queued += gsm0710_buffer_write(p->rxq,
+				(char *) iov[i].iov_base + skip, iov[i].iov_len - skip);
+		skip = 0;
 	}
-	if (i == WRITE_RETRIES) {
-		if (_debug)
-			syslog(LOG_DEBUG,
-					"Couldn't write data to channel %d. Wrote only %d bytes, when should have written %ld.\n",
-					(port + 1), written, (long) len);
+	if (written + queued < count) {
+		p->rx_dropped += count - written - queued;
+		MUX_TRACE(mux, port + 1, 0, count - written - queued, TRACE_PTY_DROP);
+		SYSLOG(LOG_WARNING, "Dropped %d bytes for %s, its queue is full.\n",
+				count - written - queued, p->name);
 	}
-	return 0;
+	// the reader of the pty is congested, stop the modem
+	if (gsm0710_buffer_length(p->rxq) >= RXQ_HIGH)
+		gsm0710_send_flow_control(mux, port + 1, 1);
+	return written + queued;
+}
+
+// Receives the data of a logical channel for its pseudo TTY, ctx is the modem
+static void receivePortData(GSM0710_Mux *mux, int dlc,
+		const struct iovec *iov, int iovcnt, void *ctx) {
+	ussp_send_data(ctx, iov, iovcnt, dlc - 1);
 }
 
-int ussp_send_data(char *buf, int n, int port) {
-	if (_debug)
-		syslog(LOG_DEBUG, "send data to port virtual port %s\n", ussp_fd[port].name);
-	write(ussp_fd[port].fd, buf, n);
-	return n;
+/* Writes the data queued for a pseudo TTY, as far as the pty takes it,
+ * and lets the modem send again, once the queue is below the low
+ * watermark.
+ */
+void flushPort(Modem *m, Port *port) {
+	GSM0710_Mux *mux = m->mux;
+	int dlc = port - m->ports + 1;
+
+	if (port->rxq && gsm0710_buffer_length(port->rxq) > 0
+			&& (gsm0710_buffer_flush(port->rxq, port->fd) < 0
+					|| gsm0710_buffer_length(port->rxq) > 0)) {
+		// wait for the next edge
+		port->src.writable = 0;
+	}
+	if ((mux->cstatus[dlc].v24_signals & S_FC)
+			&& (!port->rxq || gsm0710_buffer_length(port->rxq) <= RXQ_LOW))
+		gsm0710_send_flow_control(mux, dlc, 0);
+}
+
+// Logs the transmit queues of a modem and the data waiting for its ptys
+void logPortStats(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	Port *p;
+	int i;
+
+	gsm0710_write_frame_log_stats(mux);
+	for (i = 0; i < mux->numOfPorts; i++) {
+		p = &m->ports[i];
+		SYSLOG(LOG_INFO,
+				"%s: DLC %d: %d bytes waiting for the pty, %lu dropped%s\n",
+				mux->serportdev, i + 1,
+				p->rxq ? (int) gsm0710_buffer_length(p->rxq) : 0,
+				p->rx_dropped, (mux->cstatus[i + 1].v24_signals & S_FC)
+						? ", modem stopped" : "");
+	}
 }
 
 // Returns 1 if found, 0 otherwise. needle must be null-terminated.
@@ -229,12 +337,12 @@ int at_command(int fd, char *cmd, int to) {
 	int sel, len, i;
 	int returnCode = 0;
 
-	if (_debug)
+	if (DEBUG_ENABLED)
 		syslog(LOG_DEBUG, "is in %s\n", __FUNCTION__);
 
 	write(fd, cmd, strlen(cmd));
 
-	if (_debug)
+	if (DEBUG_ENABLED)
 		syslog(LOG_DEBUG, "Wrote  %s \n", cmd);
 
 	tcdrain(fd);
@@ -257,7 +365,7 @@ int at_command(int fd, char *cmd, int to) {
 			if (FD_ISSET(fd, &rfds)) {
 				memset(buf, 0, sizeof(buf));
 				len = read(fd, buf, sizeof(buf));
-				if (_debug)
+				if (DEBUG_ENABLED)
 					syslog(LOG_DEBUG, " read %d bytes == %s\n", len, buf);
 
 				//if (strstr(buf, "\r\nOK\r\n") != NULL)
@@ -276,19 +384,19 @@ int at_command(int fd, char *cmd, int to) {
 	return returnCode;
 }
 
-char *createSymlinkName(int idx) {
-	if (devSymlinkPrefix == NULL) {
+char *createSymlinkName(Modem *m, int idx) {
+	if (m->devSymlinkPrefix == NULL) {
 		return NULL;
 	}
-	char* symLinkName = malloc(strlen(devSymlinkPrefix) + 255);
-	sprintf(symLinkName, "%s%d", devSymlinkPrefix, idx);
+	char* symLinkName = malloc(strlen(m->devSymlinkPrefix) + 255);
+	sprintf(symLinkName, "%s%d", m->devSymlinkPrefix, idx);
 	return symLinkName;
 }
 
-int open_pty(char* devname, int idx) {
+int open_pty(Modem *m, char* devname, int idx) {
 	struct termios options;
 	int fd = open(devname, O_RDWR | O_NONBLOCK);
-	char *symLinkName = createSymlinkName(idx);
+	char *symLinkName = createSymlinkName(m, idx);
 	if (fd != -1) {
 		if (symLinkName) {
 			char* ptsSlaveName = ptsname(fd);
@@ -296,7 +404,7 @@ int open_pty(char* devname, int idx) {
 			// Create symbolic device name, e.g. /dev/mux0
 			unlink(symLinkName);
 			if (symlink(ptsSlaveName, symLinkName) != 0) {
-				syslog(LOG_ERR,
+				SYSLOG(LOG_ERR,
 						"Can't create symbolic link %s -> %s. %s (%d).\n",
 						symLinkName, ptsSlaveName, strerror(errno), errno);
 			}
@@ -347,7 +455,8 @@ void setAdvancedOptions(int fd, speed_t baud) {
 	struct termios options;
 	struct termios options_cpy;
 
-	fcntl(fd, F_SETFL, 0);
+	// writing to the serial port must not stall the main loop
+	fcntl(fd, F_SETFL, O_NONBLOCK);
 
 	// get the parameters
 	tcgetattr(fd, &options);
@@ -401,19 +510,20 @@ void setAdvancedOptions(int fd, speed_t baud) {
 /* Opens serial port, set's it to 57600bps 8N1 RTS/CTS mode.
  *
  * PARAMS:
+ * m   - the modem
  * dev - device name
  * RETURNS :
  * file descriptor or -1 on error
  */
-int open_serialport(char *dev) {
+int open_serialport(Modem *m, char *dev) {
 	int fd;
 
-	if (_debug)
+	if (DEBUG_ENABLED)
 		syslog(LOG_DEBUG, "is in %s\n", __FUNCTION__);
 	fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
 	if (fd != -1) {
-		int index = indexOfBaud(baudrate);
-		if (_debug)
+		int index = indexOfBaud(m->baudrate);
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "serial opened\n");
 		if (index > 0) {
 			// Switch the baud rate to zero and back up to wake up
@@ -422,7 +532,8 @@ int open_serialport(char *dev) {
 		} else {
 			struct termios options;
 			// The old way. Let's not change baud settings
-			fcntl(fd, F_SETFL, 0);
+			// writing to the serial port must not stall the main loop
+			fcntl(fd, F_SETFL, O_NONBLOCK);
 
 			// get the parameters
 			tcgetattr(fd, &options);
@@ -482,6 +593,43 @@ void usage(char *_name) {
 			"  -w                  : Wait for deamon startup success/failure\n");
 	fprintf(stderr,
 			"  -r                  : Restart automatically if the modem stops responding\n");
+	fprintf(stderr,
+			"  -t                  : Threaded mode, serial I/O on own RX and TX threads\n");
+	fprintf(stderr,
+			"  -a                  : Advanced option framing with transparency (AT+CMUX=1)\n");
+	fprintf(stderr,
+			"  -H <dlc>:<usec>     : Hold-off for coalescing frames of a channel [0]\n");
+	fprintf(stderr,
+			"  -W <dlc>:<weight>   : Transmit scheduler weight of a channel, 0 for\n"
+			"                        strict priority [1]\n");
+	fprintf(stderr,
+			"  -N <dlc>:<framsize> : Frame size to negotiate for a channel [-f]\n");
+	fprintf(stderr,
+			"  -B <size>           : Input buffer size, a power of two [2048]\n");
+	fprintf(stderr,
+			"  -O <policy>         : Input buffer overflow: stop, grow or drop [stop]\n");
+	fprintf(stderr,
+			"  -x                  : Mirrored buffers, mapped twice so that frames\n"
+			"                        never wrap around\n");
+	fprintf(stderr,
+			"  -c <config-file>    : Read further modems from a file, one line\n"
+			"                        of -p -f -m -b -P -s -r -t -a -H -W -N -B -O -x\n"
+			"                        options and ptys per modem\n");
+	fprintf(stderr,
+			"  -M <socket>         : Serve metrics on a Unix socket (Prometheus text)\n");
+	fprintf(stderr,
+			"  -K <socket>         : Take commands on a Unix socket: trace writes\n"
+			"                        the trace of -T, stats logs the statistics\n");
+	fprintf(stderr,
+			"  -T <file>           : Trace frames, written to the file on SIGUSR2\n"
+			"                        and exit, decoded by gsmTrace\n");
+	fprintf(stderr,
+			"  -C <file>           : Capture serial data and frames to a file\n");
+	fprintf(stderr,
+			"  -L <socket>         : Stream the capture records on a Unix socket\n");
+	fprintf(stderr,
+			"  -R <file>           : Replay the received data of a capture through\n"
+			"                        the parser at full speed and exit\n");
 	fprintf(stderr, "  -h                  : Show this help message\n");
 }
 
@@ -495,8 +643,8 @@ void parent_signal_treatment(int param) {
 /**
  * Daemonize process, this process  create teh daemon
  */
-int daemonize(int _debug) {
-	if (!_debug) {
+int daemonize(int debug) {
+	if (!debug) {
 		signal(SIGHUP, parent_signal_treatment);
 		if ((the_pid = fork()) < 0) {
 			wait_for_daemon_status = 0;
@@ -553,6 +701,9 @@ void signal_treatment(int param) {
 		terminate = 1;
 		//sig_term(param);
 		break;
+	case SIGUSR2:
+		dump_stats = 1;
+		break;
 	case SIGTERM:
 		terminate = 1;
 		break;
@@ -567,97 +718,103 @@ void signal_treatment(int param) {
  * Function to init Modemd Siemes MC35 families
  * Siemens need and special step-by for after get-in MUX state
  */
-int initSiemensMC35() {
-	char mux_command[] = "AT+CMUX=0\r\n";
+int initSiemensMC35(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	char mux_command[20];
 	char speed_command[20] = "AT+IPR=57600\r\n";
 	char close_mux[2] = { C_CLD | CR, 1 };
 
-	int baud = indexOfBaud(baudrate);
+	int baud = indexOfBaud(m->baudrate);
+	sprintf(mux_command, "AT+CMUX=%d\r\n", mux->advanced);
 	//Modem Init for Siemens MC35i
-	if (!at_command(serial_fd, "AT\r\n", 10000)) {
-		if (_debug)
+	if (!at_command(mux->serial_fd, "AT\r\n", 10000)) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "ERROR AT %d\r\n", __LINE__);
 
-		syslog(LOG_INFO,
+		SYSLOG(LOG_INFO,
 				"Modem does not respond to AT commands, trying close MUX mode");
-		write_frame(0, close_mux, 2, UIH);
-		at_command(serial_fd, "AT\r\n", 10000);
+		gsm0710_write_frame(mux, 0, close_mux, 2, UIH);
+		gsm0710_write_frame_flush(mux, 1);
+		at_command(mux->serial_fd, "AT\r\n", 10000);
 	}
 
 	if (baud != 0) {
-		sprintf(speed_command, "AT+IPR=%d\r\n", baudrate);
+		sprintf(speed_command, "AT+IPR=%d\r\n", m->baudrate);
 	}
-	if (!at_command(serial_fd, speed_command, 10000)) {
-		if (_debug)
+	if (!at_command(mux->serial_fd, speed_command, 10000)) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "ERROR %s %d \r\n", speed_command, __LINE__);
 	}
-	if (!at_command(serial_fd, "AT\r\n", 10000)) {
-		if (_debug)
+	if (!at_command(mux->serial_fd, "AT\r\n", 10000)) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "ERROR AT %d \r\n", __LINE__);
 	}
 
-	if (!at_command(serial_fd, "AT&S0\r\n", 10000)) {
-		if (_debug)
+	if (!at_command(mux->serial_fd, "AT&S0\r\n", 10000)) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "ERRO AT&S0 %d\r\n", __LINE__);
 	}
-	if (!at_command(serial_fd, "AT\\Q3\r\n", 10000)) {
-		if (_debug)
+	if (!at_command(mux->serial_fd, "AT\\Q3\r\n", 10000)) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "ERRO AT\\Q3 %d\r\n", __LINE__);
 	}
-	if (pin_code > 0 && pin_code < 10000) {
+	if (m->pin_code > 0 && m->pin_code < 10000) {
 		// Some modems, such as webbox, will sometimes hang if SIM code
 		// is given in virtual channel
 		char pin_command[20];
-		sprintf(pin_command, "AT+CPIN=\"%d\"\r\n", pin_code);
-		if (!at_command(serial_fd, pin_command, 20000)) {
-			if (_debug)
+		sprintf(pin_command, "AT+CPIN=\"%d\"\r\n", m->pin_code);
+		if (!at_command(mux->serial_fd, pin_command, 20000)) {
+			if (DEBUG_ENABLED)
 				syslog(LOG_DEBUG, "ERROR AT+CPIN %d\r\n", __LINE__);
 		}
 	}
-	if (!at_command(serial_fd, mux_command, 10000)) {
-		syslog(LOG_ERR, "MUX mode doesn't function.\n");
+	if (!at_command(mux->serial_fd, mux_command, 10000)) {
+		SYSLOG(LOG_ERR, "MUX mode doesn't function.\n");
 		return -1;
 	}
 	return 0;
 }
 
-int initIRZ52IT() {
-	char mux_command[20] = "AT+CMUX=0\r\n";
+int initIRZ52IT(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	char mux_command[20];
 	char baud_command[] = "AT+IPR=115200\r\n";
 	char close_mux[2] = { C_CLD | CR, 1 };
 
-	int baud = indexOfBaud(baudrate);
+	int baud = indexOfBaud(m->baudrate);
+	sprintf(mux_command, "AT+CMUX=%d\r\n", mux->advanced);
 	if (baud != 0) {
 		// Setup the speed explicitly, if given
-		sprintf(baud_command, "AT+IPR=%d\r\n", baudrate);
+		sprintf(baud_command, "AT+IPR=%d\r\n", m->baudrate);
 	}
 
-	at_command(serial_fd, baud_command, 10000);
-	at_command(serial_fd, "AT\r\n", 10000);
-	at_command(serial_fd, "AT&S0\\Q3\r\n", 10000);
+	at_command(mux->serial_fd, baud_command, 10000);
+	at_command(mux->serial_fd, "AT\r\n", 10000);
+	at_command(mux->serial_fd, "AT&S0\\Q3\r\n", 10000);
 
-	if (!at_command(serial_fd, "AT\r\n", 10000)) {
-		if (_debug)
+	if (!at_command(mux->serial_fd, "AT\r\n", 10000)) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "ERROR AT %d\r\n", __LINE__);
 
-		syslog(LOG_INFO,
+		SYSLOG(LOG_INFO,
 				"Modem does not respond to AT commands, trying close MUX mode");
-		write_frame(0, close_mux, 2, UIH);
-		at_command(serial_fd, "AT\r\n", 10000);
+		gsm0710_write_frame(mux, 0, close_mux, 2, UIH);
+		gsm0710_write_frame_flush(mux, 1);
+		at_command(mux->serial_fd, "AT\r\n", 10000);
 	}
-	if (pin_code > 0 && pin_code < 10000) {
+	if (m->pin_code > 0 && m->pin_code < 10000) {
 		// Some modems, such as webbox, will sometimes hang if SIM code
 		// is given in virtual channel
 		char pin_command[20];
-		sprintf(pin_command, "AT+CPIN=%d\r\n", pin_code);
-		if (!at_command(serial_fd, pin_command, 20000)) {
-			if (_debug)
+		sprintf(pin_command, "AT+CPIN=%d\r\n", m->pin_code);
+		if (!at_command(mux->serial_fd, pin_command, 20000)) {
+			if (DEBUG_ENABLED)
 				syslog(LOG_DEBUG, "ERROR AT+CPIN %d\r\n", __LINE__);
 		}
 	}
 
-	if (!at_command(serial_fd, mux_command, 10000)) {
-		syslog(LOG_ERR, "MUX mode doesn't function.\n");
+	if (!at_command(mux->serial_fd, mux_command, 10000)) {
+		SYSLOG(LOG_ERR, "MUX mode doesn't function.\n");
 		return -1;
 	}
 	return 0;
@@ -666,42 +823,46 @@ int initIRZ52IT() {
 /**
  * Function to start modems that only needs at+cmux=X to get-in mux state
  */
-int initGeneric() {
-	char mux_command[20] = "AT+CMUX=0\r\n";
+int initGeneric(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	char mux_command[20];
 	char close_mux[2] = { C_CLD | CR, 1 };
 
-	int baud = indexOfBaud(baudrate);
+	int baud = indexOfBaud(m->baudrate);
 	if (baud != 0) {
 		// Setup the speed explicitly, if given
-		sprintf(mux_command, "AT+CMUX=0,0,%d\r\n", baud);
+		sprintf(mux_command, "AT+CMUX=%d,0,%d\r\n", mux->advanced, baud);
+	} else {
+		sprintf(mux_command, "AT+CMUX=%d\r\n", mux->advanced);
 	}
 
 	/**
 	 * Modem Init for Siemens Generic like Sony
 	 * that don't need initialization sequence like Siemens MC35
 	 */
-	if (!at_command(serial_fd, "AT\r\n", 10000)) {
-		if (_debug)
+	if (!at_command(mux->serial_fd, "AT\r\n", 10000)) {
+		if (DEBUG_ENABLED)
 			syslog(LOG_DEBUG, "ERROR AT %d\r\n", __LINE__);
 
-		syslog(LOG_INFO,
+		SYSLOG(LOG_INFO,
 				"Modem does not respond to AT commands, trying close MUX mode");
-		write_frame(0, close_mux, 2, UIH);
-		at_command(serial_fd, "AT\r\n", 10000);
+		gsm0710_write_frame(mux, 0, close_mux, 2, UIH);
+		gsm0710_write_frame_flush(mux, 1);
+		at_command(mux->serial_fd, "AT\r\n", 10000);
 	}
-	if (pin_code > 0 && pin_code < 10000) {
+	if (m->pin_code > 0 && m->pin_code < 10000) {
 		// Some modems, such as webbox, will sometimes hang if SIM code
 		// is given in virtual channel
 		char pin_command[20];
-		sprintf(pin_command, "AT+CPIN=%d\r\n", pin_code);
-		if (!at_command(serial_fd, pin_command, 20000)) {
-			if (_debug)
+		sprintf(pin_command, "AT+CPIN=%d\r\n", m->pin_code);
+		if (!at_command(mux->serial_fd, pin_command, 20000)) {
+			if (DEBUG_ENABLED)
 				syslog(LOG_DEBUG, "ERROR AT+CPIN %d\r\n", __LINE__);
 		}
 	}
 
-	if (!at_command(serial_fd, mux_command, 10000)) {
-		syslog(LOG_ERR, "MUX mode doesn't function.\n");
+	if (!at_command(mux->serial_fd, mux_command, 10000)) {
+		SYSLOG(LOG_ERR, "MUX mode doesn't function.\n");
 		return -1;
 	}
 	return 0;
@@ -709,52 +870,61 @@ int initGeneric() {
 
 
 
-int openDevices() {
-	syslog(LOG_INFO, "Open devices...\n");
+int openDevices(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	int i;
+
+	SYSLOG(LOG_INFO, "Open devices...\n");
 	// open ussp devices
-	maxfd = 0;
-	for (int i = 0; i < numOfPorts; i++) {
-		remaining[i] = 0;
-		if ((ussp_fd[i].fd = open_pty(ptydev[i], i)) < 0) {
-			syslog(LOG_ERR, "Can't open %s. %s (%d).\n", ptydev[i],
+	for (i = 0; i < mux->numOfPorts; i++) {
+		m->ports[i].src.readable = 0;
+		if ((m->ports[i].fd = open_pty(m, m->ports[i].dev, i)) < 0) {
+			SYSLOG(LOG_ERR, "Can't open %s. %s (%d).\n", m->ports[i].dev,
 					strerror(errno), errno);
 			return -1;
-		} else if (ussp_fd[i].fd > maxfd)
-			maxfd = ussp_fd[i].fd;
-		cstatus[i].opened = 0;
-		cstatus[i].v24_signals = S_DV | S_RTR | S_RTC | EA;
+		}
+	}
+	if (gsm0710_write_frame_queue_init(mux) != 0) {
+		SYSLOG(LOG_ALERT, "Out of memory for the transmit queues.\n");
+		return -1;
+	}
+	for (i = 1; i <= mux->numOfPorts; i++)
+		gsm0710_mux_set_data_callback(mux, i, receivePortData, m);
+	for (i = 0; i < MAX_DLCS; i++) {
+		mux->cstatus[i].opened = 0;
+		mux->cstatus[i].v24_signals = S_DV | S_RTR | S_RTC | EA;
 	}
 
-	syslog(LOG_INFO, "Open serial port...\n");
+	SYSLOG(LOG_INFO, "Open serial port...\n");
 
 	// open the serial port
-	if ((serial_fd = open_serialport(serportdev)) < 0) {
-		syslog(LOG_ALERT, "Can't open %s. %s (%d).\n", serportdev,
+	if ((mux->serial_fd = open_serialport(m, mux->serportdev)) < 0) {
+		SYSLOG(LOG_ALERT, "Can't open %s. %s (%d).\n", mux->serportdev,
 				strerror(errno), errno);
 		return -1;
-	} else if (serial_fd > maxfd)
-		maxfd = serial_fd;
-	syslog(LOG_INFO, "Opened serial port. Switching to mux-mode.\n");
+	}
+	SYSLOG(LOG_INFO, "Opened serial port. Switching to mux-mode.\n");
 
 	return 0;
 }
 
-int openMux() {
-	int ret = -1;
-	switch (_modem_type) {
+int openMux(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	int ret = -1, size, i;
+	switch (m->modem_type) {
 	case MC35:
 		//we coould have other models like XP48 TC45/35
-		ret = initSiemensMC35();
+		ret = initSiemensMC35(m);
 		break;
 	case IRZ52IT:
 		//we coould have other models like XP48 TC45/35
-		ret = initIRZ52IT();
+		ret = initIRZ52IT(m);
 		break;
 	case GENERIC:
-		ret = initGeneric();
+		ret = initGeneric(m);
 		break;
 		// case default:
-		// syslog(LOG_ERR, "OOPS Strange modem\n");
+		// SYSLOG(LOG_ERR, "OOPS Strange modem\n");
 	}
 
 	if (ret != 0) {
@@ -762,30 +932,73 @@ int openMux() {
 	}
 	//End Modem Init
 
-	terminateCount = numOfPorts;
-	syslog(LOG_INFO, "Waiting for mux-mode.\n");
+	// frames up to 127 characters are accepted even above our N1, as
+	// modems usually keep their default
+	size = max(mux->max_frame_size, 127);
+	for (i = 0; i < MAX_DLCS; i++) {
+		size = max(size, mux->pn_frame_size[i]);
+		// parameters are negotiated again
+		mux->cstatus[i].frame_size = 0;
+		mux->cstatus[i].stopped = 0;
+		mux->cstatus[i].v24_signals &= ~S_FC;
+	}
+	mux->stopped = 0;
+	mux->in_buf->frame_limit = min(size, FRAME_SIZE_LIMIT(mux));
+	mux->terminateCount = mux->numOfPorts;
+	if (mux->capture) {
+		uint32_t limit = mux->in_buf->frame_limit;
+		struct iovec v[2] = { { &limit, sizeof(limit) },
+				{ mux->serportdev, strlen(mux->serportdev) } };
+
+		MUX_CAPTURE(mux, CAPTURE_OPEN, 0, mux->advanced, v, 2);
+	}
+	SYSLOG(LOG_INFO, "Waiting for mux-mode.\n");
 	sleep(1);
-	syslog(LOG_INFO, "Opening control channel.\n");
-	write_frame(0, NULL, 0, SABM | PF);
-	syslog(LOG_INFO, "Opening logical channels.\n");
-	for (int i = 1; i <= numOfPorts; i++) {
+	SYSLOG(LOG_INFO, "Opening control channel.\n");
+	gsm0710_write_frame(mux, 0, NULL, 0, SABM | PF);
+	gsm0710_write_frame_flush(mux, 1);
+	SYSLOG(LOG_INFO, "Opening logical channels.\n");
+	for (i = 1; i <= mux->numOfPorts; i++) {
 		sleep(1);
-		write_frame(i, NULL, 0, SABM | PF);
-		char *name = ptsname(ussp_fd[i - 1].fd);
-		ussp_fd[i-1].name = name;
-		syslog(LOG_INFO, "Connecting %s to virtual channel %d on %s\n",
-				name, i, serportdev);
+		/* PN goes before the SABM, not after it: 07.10 (5.4.6.3.1) has
+		 * the parameters of a DLC negotiated before the DLC is opened,
+		 * and the modem applies them when the SABM opens it
+		 */
+		gsm0710_send_parameter_negotiation(mux, i);
+		gsm0710_write_frame(mux, i, NULL, 0, SABM | PF);
+		gsm0710_write_frame_flush(mux, 1);
+		free(m->ports[i - 1].name);
+		m->ports[i - 1].name = strdup(ptsname(m->ports[i - 1].fd));
+		SYSLOG(LOG_INFO, "Connecting %s to virtual channel %d on %s\n",
+				m->ports[i - 1].name, i, mux->serportdev);
 	}
 	return ret;
 }
 
-void closeDevices() {
+void closeDevices(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
 	int i;
-	close(serial_fd);
+	fd_set wfds;
+	struct timeval timeout;
 
-	for (i = 0; i < numOfPorts; i++) {
-		char *symlinkName = createSymlinkName(i);
-		close(ussp_fd[i].fd);
+	gsm0710_stop_io_threads(mux);
+	// give the queued frames, such as the close down request, a moment to
+	// reach the modem
+	for (i = 0; i < 10 && gsm0710_buffer_length(mux->out_buf) > 0; i++) {
+		FD_ZERO(&wfds);
+		FD_SET(mux->serial_fd, &wfds);
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100000;
+		if (select(mux->serial_fd + 1, NULL, &wfds, NULL, &timeout) > 0
+				&& gsm0710_write_frame_flush(mux, 1) < 0)
+			break;
+	}
+	close(mux->serial_fd);
+	mux->serial_fd = -1;
+
+	for (i = 0; i < mux->numOfPorts; i++) {
+		char *symlinkName = createSymlinkName(m, i);
+		close(m->ports[i].fd);
 		if (symlinkName) {
 			// Remove the symbolic link to the slave device
 			unlink(symlinkName);
@@ -794,28 +1007,825 @@ void closeDevices() {
 	}
 }
 
+/* Allocates a modem and its multiplexer with the default configuration
+ * of gsmMuxd
+ *
+ * RETURNS:
+ * the modem or NULL, if out of memory
+ */
+Modem *newModem() {
+	Modem *m;
+	int i;
+
+	if (!(m = calloc(1, sizeof(Modem))))
+		return NULL;
+	if (!(m->mux = gsm0710_mux_new())) {
+		free(m);
+		return NULL;
+	}
+	m->modem_type = GENERIC;
+	m->serial_src.kind = SRC_SERIAL;
+	m->serial_src.modem = m;
+	m->tx_space_src.kind = SRC_WAKEUP;
+	m->tx_space_src.modem = m;
+	m->restart_src.kind = SRC_RESTART;
+	m->restart_src.modem = m;
+	m->restart_fd = -1;
+	for (i = 0; i < MAX_CHANNELS; i++) {
+		m->ports[i].src.kind = SRC_PORT;
+		m->ports[i].src.modem = m;
+		m->ports[i].fd = -1;
+	}
+	return m;
+}
+
+void freeModem(Modem *m) {
+	int i;
+
+	for (i = 0; i < m->mux->numOfPorts; i++) {
+		free(m->ports[i].name);
+		gsm0710_buffer_destroy(m->ports[i].rxq);
+	}
+	if (m->restart_fd >= 0)
+		close(m->restart_fd);
+	gsm0710_mux_free(m->mux);
+	free(m->configLine);
+	free(m);
+}
+
+/* Applies a command line option, that configures a single modem
+ *
+ * RETURNS:
+ * 0 on success, -1 if the option or its argument isn't valid
+ */
+int setMuxOption(Modem *m, int opt, char *arg) {
+	GSM0710_Mux *mux = m->mux;
+	int dlc, usec, weight, size;
+
+	switch (opt) {
+	case 'p':
+		mux->serportdev = arg;
+		break;
+	case 'f':
+		mux->max_frame_size = atoi(arg);
+		break;
+	case 'm':
+		if (!strcmp(arg, "mc35"))
+			m->modem_type = MC35;
+		else if (!strcmp(arg, "mc75"))
+			m->modem_type = MC35;
+		else if (!strcmp(arg, "irz52it"))
+			m->modem_type = IRZ52IT;
+		else if (!strcmp(arg, "generic"))
+			m->modem_type = GENERIC;
+		else
+			m->modem_type = UNKNOW_MODEM;
+		break;
+	case 'b':
+		m->baudrate = atoi(arg);
+		break;
+	case 's':
+		m->devSymlinkPrefix = arg;
+		break;
+	case 'P':
+		m->pin_code = atoi(arg);
+		break;
+	case 'r':
+		mux->faultTolerant = 1;
+		break;
+	case 't':
+		m->threaded = 1;
+		break;
+	case 'a':
+		mux->advanced = 1;
+		break;
+	case 'H':
+		if (sscanf(arg, "%d:%d", &dlc, &usec) != 2 || dlc < 0
+				|| dlc >= MAX_DLCS || usec < 0)
+			return -1;
+		gsm0710_write_frame_set_holdoff(mux, dlc, usec);
+		break;
+	case 'W':
+		if (sscanf(arg, "%d:%d", &dlc, &weight) != 2 || dlc < 1
+				|| dlc > MAX_CHANNELS || weight < 0)
+			return -1;
+		gsm0710_write_frame_set_weight(mux, dlc, weight);
+		break;
+	case 'N':
+		if (sscanf(arg, "%d:%d", &dlc, &size) != 2 || dlc < 1
+				|| dlc > MAX_CHANNELS || size < 1 || size > MAX_FRAME_DATA)
+			return -1;
+		mux->pn_frame_size[dlc] = size;
+		break;
+	case 'B':
+		// the longest frame has to fit
+		if ((size = atoi(arg)) < GSM0710_BUFFER_SIZE
+				|| size > GSM0710_BUFFER_MAX
+				|| gsm0710_buffer_resize(mux->in_buf, size) != 0)
+			return -1;
+		break;
+	case 'O':
+		if (!strcmp(arg, "stop"))
+			mux->in_buf->overflow = GSM0710_OVERFLOW_STOP;
+		else if (!strcmp(arg, "grow"))
+			mux->in_buf->overflow = GSM0710_OVERFLOW_GROW;
+		else if (!strcmp(arg, "drop"))
+			mux->in_buf->overflow = GSM0710_OVERFLOW_DROP;
+		else
+			return -1;
+		break;
+	case 'x':
+		if (gsm0710_mux_set_mirrored(mux, 1) != 0)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+// Assigns the pty devices to the virtual ports of a multiplexer
+void addPorts(Modem *m, int count, char *devs[]) {
+	int i;
+
+	for (i = 0; i < count && i < MAX_CHANNELS; i++) {
+		SYSLOG(LOG_INFO, "Port %d : %s\n", i, devs[i]);
+		m->ports[i].dev = devs[i];
+	}
+	m->mux->numOfPorts = i;
+}
+
+/* Reads modems from a configuration file. Each line describes one modem
+ * with the same options and pty devices as the command line, e.g.
+ * "-p /dev/ttyUSB0 -b 115200 -s /dev/muxA /dev/ptmx /dev/ptmx". Text
+ * after a '#' is ignored.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int readConfig(char *file) {
+	FILE *f;
+	char line[1024], *p, *words, *args[64];
+	int n, opt, lineno = 0;
+	Modem *m;
+
+	if (!(f = fopen(file, "r"))) {
+		SYSLOG(LOG_ERR, "Can't open %s. %s (%d).\n", file, strerror(errno),
+				errno);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((p = strchr(line, '#')))
+			*p = '\0';
+		// the options keep pointers to the words, so they are taken from
+		// a copy of the line, which the modem owns
+		if (!(words = strdup(line))) {
+			SYSLOG(LOG_ALERT, "Out of memory\n");
+			fclose(f);
+			return -1;
+		}
+		n = 0;
+		args[n++] = file;
+		for (p = strtok(words, " \t\r\n"); p && n < 63; p = strtok(NULL, " \t\r\n"))
+			args[n++] = p;
+		args[n] = NULL;
+		if (n == 1) {
+			free(words);
+			continue;
+		}
+		if (numOfMuxes >= MAX_MUXES || !(m = newModem())) {
+			SYSLOG(LOG_ERR, "%s:%d: Too many modems\n", file, lineno);
+			free(words);
+			fclose(f);
+			return -1;
+		}
+		m->configLine = words;
+		optind = 0; // start over with a new argument vector
+		while ((opt = getopt(n, args, "p:f:rtam:b:P:s:H:W:N:B:O:x")) > 0) {
+			if (setMuxOption(m, opt, optarg) != 0) {
+				SYSLOG(LOG_ERR, "%s:%d: Invalid option -%c\n", file, lineno,
+						opt);
+				freeModem(m);
+				fclose(f);
+				return -1;
+			}
+		}
+		addPorts(m, n - optind, args + optind);
+		if (m->mux->numOfPorts == 0) {
+			SYSLOG(LOG_ERR, "%s:%d: No pty devices given for %s\n", file,
+					lineno, m->mux->serportdev);
+			freeModem(m);
+			fclose(f);
+			return -1;
+		}
+		modems[numOfMuxes++] = m;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Adds a file descriptor to the event loop.
+ *
+ * PARAMS:
+ * fd     - the file descriptor
+ * ptr    - the state of the source, returned with its events
+ * events - epoll events to wait for
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int watchFd(int fd, void *ptr, uint32_t events) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		SYSLOG(LOG_ERR, "Can't watch file descriptor %d. %s (%d).\n", fd,
+				strerror(errno), errno);
+		return -1;
+	}
+	return 0;
+}
+
+// Queues a virtual port for reading
+void markReady(Port *port) {
+	Modem *m = port->src.modem;
+
+	if (!port->src.readable) {
+		port->src.readable = 1;
+		m->readyPorts[m->numReadyPorts++] = port;
+	}
+}
+
+// Logs the statistics of all modems and writes the trace, for SIGUSR2
+void dumpStats() {
+	int i;
+
+	for (i = 0; i < numOfMuxes; i++)
+		logPortStats(modems[i]);
+	if (trace && (i = gsm0710_trace_dump(trace, traceFile)) >= 0)
+		SYSLOG(LOG_INFO, "Wrote %d frame events to %s\n", i, traceFile);
+}
+
+// Accepts the pending connections of the control socket
+void acceptControl() {
+	ControlClient *c;
+	int fd, i;
+
+	while ((fd = accept4(control_fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		for (i = 0; i < MAX_CONTROL_CLIENTS && controlClients[i].fd >= 0; i++)
+			;
+		if (i == MAX_CONTROL_CLIENTS) {
+			SYSLOG(LOG_WARNING, "Too many control clients.\n");
+			close(fd);
+			continue;
+		}
+		c = &controlClients[i];
+		c->src.kind = SRC_CLIENT;
+		c->fd = fd;
+		c->length = 0;
+		if (watchFd(fd, c, EPOLLIN) != 0) {
+			close(fd);
+			c->fd = -1;
+		}
+	}
+}
+
+/* Carries out a command of the control socket
+ *
+ * PARAMS:
+ * cmd   - the command line without the newline
+ * reply - where to write the answer
+ * size  - size of reply
+ */
+void runControl(const char *cmd, char *reply, int size) {
+	int n;
+
+	if (!strcmp(cmd, "trace")) {
+		if (!trace)
+			snprintf(reply, size, "error: no trace, start with -T\n");
+		else if ((n = gsm0710_trace_dump(trace, traceFile)) < 0)
+			snprintf(reply, size, "error: can't write %s\n", traceFile);
+		else
+			snprintf(reply, size, "wrote %d frame events to %s\n", n,
+					traceFile);
+	} else if (!strcmp(cmd, "stats")) {
+		dumpStats();
+		snprintf(reply, size, "logged\n");
+	} else {
+		snprintf(reply, size, "error: unknown command, try trace or stats\n");
+	}
+}
+
+/* Reads the command of a control client, one line, answers it and closes
+ * the connection. A client, which closes its side after the command, may
+ * leave out the newline.
+ */
+void serveControl(ControlClient *c) {
+	char reply[PATH_MAX + 64];
+	int n;
+
+	n = read(c->fd, c->line + c->length, sizeof(c->line) - 1 - c->length);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0) {
+		c->length += n;
+		c->line[c->length] = '\0';
+		// wait for the rest of the line
+		if (!strchr(c->line, '\n') && c->length < sizeof(c->line) - 1)
+			return;
+	}
+	if (n >= 0 && c->length > 0) {
+		c->line[strcspn(c->line, "\r\n")] = '\0';
+		runControl(c->line, reply, sizeof(reply));
+		send(c->fd, reply, strlen(reply), MSG_NOSIGNAL);
+	}
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* Creates the event loop shared by all multiplexers. Serial ports and
+ * virtual ports are watched edge triggered, timers are served by a single
+ * timerfd.
+ */
+int openEventLoop() {
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0
+			|| (timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		SYSLOG(LOG_ALERT, "Can't create the event loop. %s (%d).\n",
+				strerror(errno), errno);
+		return -1;
+	}
+	timer_src.kind = SRC_TIMER;
+	return watchFd(timer_fd, &timer_src, EPOLLIN);
+}
+
+/* Adds the serial port and the virtual ports of a multiplexer to the loop.
+ * In threaded mode the serial port belongs to the I/O threads, the loop
+ * watches their rings instead.
+ */
+int watchMux(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	int i;
+
+	// check both directions once, the edges may already have passed
+	m->serial_src.readable = m->serial_src.writable = 1;
+	if (m->threaded) {
+		if (gsm0710_start_io_threads(mux) != 0)
+			return -1;
+		if (watchFd(mux->rx_ring->data_fd, &m->serial_src, EPOLLIN) != 0
+				|| watchFd(mux->tx_ring->space_fd, &m->tx_space_src,
+						EPOLLIN) != 0)
+			return -1;
+	} else if (watchFd(mux->serial_fd, &m->serial_src,
+			EPOLLIN | EPOLLOUT | EPOLLET) != 0)
+		return -1;
+	// restart threads report back by restart_fd
+	if (mux->faultTolerant && ((m->restart_fd = eventfd(0,
+			EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+			|| watchFd(m->restart_fd, &m->restart_src, EPOLLIN) != 0))
+		return -1;
+	for (i = 0; i < mux->numOfPorts; i++) {
+		if (watchFd(m->ports[i].fd, &m->ports[i],
+				EPOLLIN | EPOLLOUT | EPOLLET) != 0)
+			return -1;
+		markReady(&m->ports[i]);
+	}
+	return 0;
+}
+
+/* Arms the timer of the event loop
+ *
+ * PARAMS:
+ * deadline - CLOCK_MONOTONIC time in microseconds, LLONG_MAX disarms
+ */
+void armTimer(long long deadline) {
+	static long long armed = LLONG_MAX;
+	struct itimerspec its;
+
+	if (deadline == armed)
+		return;
+	memset(&its, 0, sizeof(its));
+	if (deadline != LLONG_MAX) {
+		// zero would disarm the timer
+		its.it_value.tv_sec = deadline / 1000000;
+		its.it_value.tv_nsec = (deadline % 1000000) * 1000 + 1;
+	}
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	armed = deadline;
+}
+
+/* Tells, when the main loop has to run next for a multiplexer without any
+ * input: to write held off frames, to ping or restart the modem or to take
+ * the next step in closing down.
+ */
+long long nextDeadline(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	long long deadline = LLONG_MAX, due;
+
+	// the restart thread wakes the loop up
+	if (m->restarting)
+		return LLONG_MAX;
+	if ((due = gsm0710_write_frame_due(mux)) > 0)
+		deadline = gsm0710_monotonic_us() + due;
+	if (!mux->threads_running)
+		deadline = min(deadline, mux->rx_stall_deadline);
+	if (mux->terminate) {
+		deadline = min(deadline, m->terminateTime);
+	} else if (mux->restart) {
+		deadline = min(deadline, m->restartTime);
+	} else if (mux->faultTolerant) {
+		deadline = min(deadline, m->frameReceiveTime
+				+ POLLING_INTERVAL * 1000000LL * mux->pingNumber + 1);
+	}
+	return deadline;
+}
+
+// Tells, if a multiplexer can make progress without waiting for events
+int hasWork(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	int t;
+
+	if (m->restarting)
+		return 0;
+	if (gsm0710_write_frame_schedulable(mux))
+		return 1;
+	// a full input buffer waits for the stall timer
+	if (m->serial_src.readable && (mux->threads_running
+			|| gsm0710_buffer_free(mux->in_buf) > 0))
+		return 1;
+	for (t = 0; t < m->numReadyPorts; t++) {
+		if (gsm0710_write_frame_queue_free(mux,
+				m->readyPorts[t] - m->ports + 1) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+// Runs openMux() for a restart and wakes the event loop up, when done
+static void *restartThread(void *arg) {
+	Modem *m = arg;
+
+	m->restart_result = openMux(m);
+	eventfd_write(m->restart_fd, 1);
+	return NULL;
+}
+
+/* Starts to restart a modem on a thread of its own. The I/O threads of
+ * the multiplexer must have been stopped.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the thread can't be started
+ */
+int startRestart(Modem *m) {
+	sigset_t all, old;
+	int err;
+
+	// signals are handled by the main thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&m->restart_thread, NULL, restartThread, m);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		SYSLOG(LOG_ERR, "%s: Can't start the restart thread. %s (%d).\n",
+				m->mux->serportdev, strerror(err), err);
+		return -1;
+	}
+	m->restarting = 1;
+	return 0;
+}
+
+// Takes a modem back to the event loop, whose restart thread is done
+void finishRestart(Modem *m) {
+	GSM0710_Mux *mux = m->mux;
+	eventfd_t value;
+
+	eventfd_read(m->restart_fd, &value);
+	if (!m->restarting)
+		return;
+	pthread_join(m->restart_thread, NULL);
+	m->restarting = 0;
+	if (m->restart_result == 0) {
+		// The modem is up again
+		mux->restart = 0;
+		m->restarts++;
+		m->frameReceiveTime = gsm0710_monotonic_us();
+		mux->pingNumber = 1;
+	} else {
+		m->restartTime = gsm0710_monotonic_us() + RESTART_INTERVAL;
+	}
+	// check both directions once, the edges may have passed meanwhile
+	m->serial_src.readable = m->serial_src.writable = 1;
+	if (m->threaded && gsm0710_start_io_threads(mux) != 0)
+		mux->terminate = 1;
+}
+
+/* Runs one round of the event loop for a multiplexer: moves data between
+ * the serial port and the virtual ports and takes care of pinging,
+ * restarting and closing down. A multiplexer, which is being restarted,
+ * is left to its restart thread.
+ *
+ * RETURNS:
+ * 1 if the multiplexer is still running, 0 if it has closed down
+ */
+int serviceMux(Modem *m, long long currentTime) {
+	GSM0710_Mux *mux = m->mux;
+#define PING_TEST_LEN 6
+	static char ping_test[] = "\x23\x09PING";
+	char close_mux[2] = { C_CLD | CR, 1 };
+	int len, size, t, i, room, received = 0;
+	Port *port;
+
+	if (m->restarting)
+		return 1;
+	// pass queued data on to ptys, which have become writable
+	for (i = 0; i < mux->numOfPorts; i++) {
+		if (m->ports[i].src.writable)
+			flushPort(m, &m->ports[i]);
+	}
+
+	if (mux->threads_running) {
+		// frames parsed by the RX thread
+		if (m->serial_src.readable) {
+			gsm0710_spsc_clear(mux->rx_ring->data_fd);
+			m->serial_src.readable = 0;
+			if (gsm0710_extract_frames(mux) > 0 && mux->faultTolerant) {
+				m->frameReceiveTime = currentTime;
+				mux->pingNumber = 1;
+			}
+		}
+	} else if (m->serial_src.writable && gsm0710_write_frame_due(mux) == 0) {
+		gsm0710_write_frame_flush(mux, 0);
+		// wait for the next edge, if the port didn't take everything
+		if (gsm0710_buffer_length(mux->out_buf) > 0)
+			m->serial_src.writable = 0;
+	}
+
+	// input from serial port
+	for (t = 0; !mux->threads_running && m->serial_src.readable
+			&& t < MAX_READS_PER_ROUND; t++) {
+		if ((size = gsm0710_buffer_make_room(mux->in_buf,
+				mux->advanced ? ADV_FLAG : F_FLAG)) == 0) {
+			// until the stalled frame is consumed or dropped
+			if (DEBUG_ENABLED)
+				syslog(LOG_DEBUG, "No space in GSM buffer\n");
+			break;
+		}
+		len = gsm0710_receive_fill(mux, size);
+		if (len <= 0) {
+			if (len == 0 || errno != EINTR)
+				m->serial_src.readable = 0;
+			continue;
+		}
+		if (DEBUG_ENABLED)
+			syslog(LOG_DEBUG, "Got data from serial: %d bytes; buffer free: %d\n", len, size);
+		received = 1;
+		// extract and handle ready frames
+		if (gsm0710_extract_frames(mux) > 0 && mux->faultTolerant) {
+			m->frameReceiveTime = currentTime;
+			mux->pingNumber = 1;
+		}
+	}
+	// give up a frame, whose rest doesn't arrive
+	if (!mux->threads_running
+			&& gsm0710_receive_check_stall(mux, currentTime, received))
+		gsm0710_extract_frames(mux);
+
+	// check virtual ports that have reported input
+	for (t = 0; t < m->numReadyPorts; ) {
+		port = m->readyPorts[t];
+		i = port - m->ports;
+		if ((room = gsm0710_write_frame_queue_free(mux, i + 1)) <= 0) {
+			// the queue is full, come back when frames have been sent
+			t++;
+			continue;
+		}
+
+		// information from virtual port
+		len = ussp_recv_data(m, i, room);
+		if (len == 0 || (len < 0
+				&& (errno == EAGAIN || errno == EWOULDBLOCK))) {
+			// drained, wait for the next edge
+			len = 0;
+			port->src.readable = 0;
+		} else if (len < 0) {
+			// Re-open pty, the data queued for the old one is lost
+			if (port->rxq)
+				gsm0710_buffer_clear(port->rxq);
+			close(port->fd);
+			port->src.readable = 0;
+			if ((port->fd = open_pty(m, port->dev, i)) < 0) {
+				if (DEBUG_ENABLED)
+					syslog(LOG_DEBUG,
+							"Can't re-open %s. %s (%d).\n",
+							port->dev, strerror(errno), errno);
+				mux->terminate = 1;
+			} else {
+				watchFd(port->fd, port, EPOLLIN | EPOLLOUT | EPOLLET);
+			}
+		}
+		if (port->src.readable) {
+			t++;
+		} else {
+			m->readyPorts[t] = m->readyPorts[--m->numReadyPorts];
+		}
+	}
+
+	if (terminate)
+		mux->terminate = 1;
+	if (mux->terminate) {
+		// terminate command given. Close channels one by one and finaly
+		// close the mux mode
+		if (currentTime >= m->terminateTime) {
+			if (mux->terminateCount > 0) {
+				SYSLOG(LOG_INFO, "Closing down the logical channel %d.\n",
+						mux->terminateCount);
+				if (mux->cstatus[mux->terminateCount].opened)
+					gsm0710_write_frame(mux, mux->terminateCount, NULL, 0,
+							DISC | PF);
+			} else if (mux->terminateCount == 0) {
+				SYSLOG(LOG_INFO,
+						"Sending close down request to the multiplexer.\n");
+				gsm0710_write_frame(mux, 0, close_mux, 2, UIH);
+			}
+			mux->terminateCount--;
+			m->terminateTime = currentTime + TERMINATE_STEP;
+		}
+	} else if (mux->faultTolerant) {
+		if (mux->restart || (mux->pingNumber >= MAX_PINGS
+				&& m->frameReceiveTime + POLLING_INTERVAL * 1000000LL
+						* mux->pingNumber < currentTime)) {
+			if (mux->restart == 0) {
+				// Modem seems to be dead
+				SYSLOG(LOG_ALERT,
+						"%s: Modem is not responding trying to restart the mux.\n",
+						mux->serportdev);
+				mux->restart = 1;
+				m->restartTime = currentTime + RESTART_INTERVAL;
+			} else if (currentTime >= m->restartTime) {
+				// Modem has closed down the multiplexer mode or didn't
+				// respond. The AT commands take seconds, so they are sent
+				// by a thread, while the other modems are served.
+				SYSLOG(LOG_INFO, "%s: Trying to restart the mux.\n",
+						mux->serportdev);
+				mux->terminateCount = -1;
+				gsm0710_stop_io_threads(mux);
+				if (startRestart(m) == 0)
+					return 1;
+				mux->terminate = 1;
+			}
+		} else if (mux->pingNumber < MAX_PINGS && m->frameReceiveTime
+				+ POLLING_INTERVAL * 1000000LL * mux->pingNumber < currentTime) {
+			// Nothing has been received for a while -> test the modem
+			if (DEBUG_ENABLED) {
+				syslog(LOG_DEBUG, "Sending PING to the modem.\n");
+			}
+			gsm0710_write_frame(mux, 0, ping_test, PING_TEST_LEN, UIH);
+			++mux->pingNumber;
+			m->pings++;
+			mux->ping_time = currentTime;
+		}
+	}
+
+	// write the frames collected from all channels during this round
+	gsm0710_write_frame_schedule(mux);
+	if (m->serial_src.writable) {
+		gsm0710_write_frame_flush(mux, 0);
+		if (gsm0710_buffer_length(mux->out_buf) > 0
+				&& gsm0710_write_frame_due(mux) == 0)
+			m->serial_src.writable = 0;
+	}
+
+	return !mux->terminate || mux->terminateCount >= -1;
+}
+
+/* Sets up a multiplexer to parse the data of a capture source
+ *
+ * PARAMS:
+ * config - the multiplexer of the command line
+ * RETURNS:
+ * the multiplexer or NULL, if out of memory
+ */
+static GSM0710_Mux *newReplayMux(GSM0710_Mux *config) {
+	GSM0710_Mux *mux;
+
+	if (!(mux = gsm0710_mux_new()))
+		return NULL;
+	// no ports, data frames are parsed and dropped
+	mux->advanced = config->advanced;
+	mux->in_buf->trace = trace;
+	mux->in_buf->overflow = GSM0710_OVERFLOW_DROP;
+	mux->in_buf->frame_limit = min(max(config->max_frame_size, 127),
+			FRAME_SIZE_LIMIT(mux));
+	return mux;
+}
+
+/* Feeds the received serial data of a capture through the parser and the
+ * frame handling as fast as possible and prints the throughput. Frames
+ * are given up for a stall by the times of the records. Sources without
+ * a CAPTURE_OPEN record are parsed with the -a and -f options.
+ *
+ * PARAMS:
+ * config - the multiplexer of the command line
+ * path   - the capture file
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int replayCapture(GSM0710_Mux *config, const char *path) {
+	GSM0710_Mux *replay[256] = { NULL };
+	GSM0710_CaptureRecord rec;
+	GSM0710_Mux *mux;
+	const char *p, *end, *data;
+	unsigned long frames = 0, dropped = 0;
+	unsigned long long bytes = 0;
+	long long start, elapsed;
+	uint32_t limit;
+	size_t length;
+	char *records;
+	int i, n, ret = 0;
+
+	if (!(records = gsm0710_capture_load(path, &length))) {
+		fprintf(stderr, "Can't read the capture %s. %s (%d).\n", path,
+				strerror(errno), errno);
+		return -1;
+	}
+	if (traceFile && !(trace = gsm0710_trace_init(TRACE_SIZE))) {
+		fprintf(stderr, "Out of memory\n");
+		free(records);
+		return -1;
+	}
+	start = gsm0710_monotonic_us();
+	for (p = records, end = records + length;
+			gsm0710_capture_next(&p, end, &rec, &data); ) {
+		if (rec.type != CAPTURE_OPEN && rec.type != CAPTURE_RX_RAW)
+			continue;
+		if (!(mux = replay[rec.source])
+				&& !(mux = replay[rec.source] = newReplayMux(config))) {
+			fprintf(stderr, "Out of memory\n");
+			ret = -1;
+			break;
+		}
+		mux->in_buf->trace_source = rec.source;
+		if (rec.type == CAPTURE_OPEN) {
+			mux->advanced = rec.control;
+			if (rec.length >= sizeof(limit)) {
+				memcpy(&limit, data, sizeof(limit));
+				mux->in_buf->frame_limit = min(limit, MAX_FRAME_DATA);
+			}
+			continue;
+		}
+		// frames, whose rest came too late, were given up meanwhile
+		while (mux->in_buf->incomplete && mux->rx_stall_deadline <= rec.time
+				&& gsm0710_receive_check_stall(mux, mux->rx_stall_deadline, 0))
+			gsm0710_extract_frames(mux);
+		for (i = 0; i < rec.length; i += n) {
+			if (gsm0710_buffer_make_room(mux->in_buf,
+					mux->advanced ? ADV_FLAG : F_FLAG) == 0)
+				break;
+			n = gsm0710_buffer_write(mux->in_buf, data + i, rec.length - i);
+			gsm0710_extract_frames(mux);
+			// the answers to the modem are thrown away
+			gsm0710_buffer_clear(mux->out_buf);
+		}
+		gsm0710_receive_check_stall(mux, rec.time, 1);
+		bytes += rec.length;
+	}
+	elapsed = max(gsm0710_monotonic_us() - start, 1);
+	for (i = 0; i < 256; i++) {
+		if (!(mux = replay[i]))
+			continue;
+		frames += mux->in_buf->received_count;
+		dropped += mux->in_buf->dropped_count;
+		gsm0710_mux_free(mux);
+	}
+	printf("Replayed %llu bytes in %.6f s: %.1f MB/s, %lu frames"
+			" (%.0f frames/s), %lu dropped\n", bytes, elapsed / 1e6,
+			bytes / (double) elapsed, frames, frames * 1e6 / elapsed, dropped);
+	if (trace) {
+		gsm0710_trace_dump(trace, traceFile);
+		gsm0710_trace_destroy(trace);
+	}
+	free(records);
+	return ret;
+}
 
 /**
  * The main program
  */
 int main(int argc, char *argv[], char *env[]) {
-#define PING_TEST_LEN 6
-	static char ping_test[] = "\x23\x09PING";
 	//struct sigaction sa;
-	int sel, len;
-	fd_set rfds;
-	struct timeval timeout;
-	char buf[4096], **tmp;
+	int sel;
+	struct epoll_event events[MAX_EVENTS];
 	char *programName;
-	int i, size, t;
+	char *configFile = NULL;
+	int i, running, busy;
+	Modem *m;
 
-	char close_mux[2] = { C_CLD | CR, 1 };
 	int opt;
 	pid_t parent_pid;
-	// for fault tolerance
-	int pingNumber = 1;
-	time_t frameReceiveTime;
-	time_t currentTime;
+	long long currentTime, deadline;
 
 	programName = argv[0];
 	/*************************************/
@@ -823,48 +1833,41 @@ int main(int argc, char *argv[], char *env[]) {
 		usage(programName);
 		exit(-1);
 	}
-	_modem_type = GENERIC;
-
-	serportdev = "/dev/modem";
+	if (!(m = newModem())) {
+		fprintf(stderr, "Out of memory\n");
+		exit(-1);
+	}
 
-	while ((opt = getopt(argc, argv, "p:f:h?dwrm:b:P:s:")) > 0) {
+	while ((opt = getopt(argc, argv, "p:f:h?dwrtam:b:P:s:H:W:N:B:O:xc:M:K:T:C:L:R:")) > 0) {
 		switch (opt) {
-		case 'p':
-			serportdev = optarg;
-			break;
-		case 'f':
-			max_frame_size = atoi(optarg);
-			break;
 			//Vitorio
 		case 'd':
-			_debug = 1;
+			debug = 1;
+			gsm0710_set_debug(1);
 			break;
-		case 'm':
-			if (!strcmp(optarg, "mc35"))
-				_modem_type = MC35;
-			else if (!strcmp(optarg, "mc75"))
-				_modem_type = MC35;
-			else if (!strcmp(optarg, "irz52it"))
-				_modem_type = IRZ52IT;
-			else if (!strcmp(optarg, "generic"))
-				_modem_type = GENERIC;
-			else
-				_modem_type = UNKNOW_MODEM;
+		case 'w':
+			wait_for_daemon_status = 1;
 			break;
-		case 'b':
-			baudrate = atoi(optarg);
+		case 'c':
+			configFile = optarg;
 			break;
-		case 's':
-			devSymlinkPrefix = optarg;
+		case 'M':
+			metricsPath = optarg;
 			break;
-		case 'w':
-			wait_for_daemon_status = 1;
+		case 'K':
+			controlPath = optarg;
+			break;
+		case 'T':
+			traceFile = optarg;
+			break;
+		case 'C':
+			captureFile = optarg;
 			break;
-		case 'P':
-			pin_code = atoi(optarg);
+		case 'L':
+			tapPath = optarg;
 			break;
-		case 'r':
-			faultTolerant = 1;
+		case 'R':
+			replayFile = optarg;
 			break;
 		case '?':
 		case 'h':
@@ -872,13 +1875,20 @@ int main(int argc, char *argv[], char *env[]) {
 			exit(0);
 			break;
 		default:
+			// options of the modem given on the command line
+			if (setMuxOption(m, opt, optarg) != 0) {
+				usage(programName);
+				exit(-1);
+			}
 			break;
 		}
 	}
+	if (replayFile)
+		exit(replayCapture(m->mux, replayFile));
 	//DAEMONIZE
 	//SHOW TIME
 	parent_pid = getpid();
-	daemonize(_debug);
+	daemonize(debug);
 	//The Hell is from now-one
 
 	/* SIGNALS treatment*/
@@ -887,195 +1897,190 @@ int main(int argc, char *argv[], char *env[]) {
 	signal(SIGKILL, signal_treatment);
 	signal(SIGINT, signal_treatment);
 	signal(SIGUSR1, signal_treatment);
+	signal(SIGUSR2, signal_treatment);
 	signal(SIGTERM, signal_treatment);
 
 	programName = argv[0];
-	if (_debug) {
+	if (debug) {
 		openlog(programName, LOG_NDELAY | LOG_PID | LOG_PERROR, LOG_LOCAL0);//pode ir at� 7
 		_priority = LOG_DEBUG;
 	} else {
 		openlog(programName, LOG_NDELAY | LOG_PID, LOG_LOCAL0);	//pode ir at� 7
 		_priority = LOG_INFO;
 	}
-
-	for (t = optind; t < argc; t++) {
-		if ((t - optind) >= MAX_CHANNELS)
-			break;
-		syslog(LOG_INFO, "Port %d : %s\n", t - optind, argv[t]);
-		ptydev[t - optind] = argv[t];
-	}
-	//exit(0);
-	numOfPorts = t - optind;
-
-	syslog(LOG_INFO, "Malloc buffers...\n");
-	// allocate memory for data structures
-	if (!(ussp_fd = malloc(sizeof(*ussp_fd) * numOfPorts)) || !(in_buf =
-			gsm0710_buffer_init())
-			|| !(remaining = malloc(sizeof(int) * numOfPorts)) || !(tmp =
-					malloc(sizeof(char *) * numOfPorts))
-			|| !(cstatus = malloc(sizeof(Channel_Status) * (1 + numOfPorts)))) {
-		syslog(LOG_ALERT, "Out of memory\n");
+	SYSLOG(LOG_INFO, "Using %s FCS kernel\n", gsm0710_fcs_init());
+
+	// the modem of the command line, further ones come from the config file
+	addPorts(m, argc - optind, argv + optind);
+	if (m->mux->numOfPorts > 0 || !configFile)
+		modems[numOfMuxes++] = m;
+	else
+		freeModem(m);
+	if (configFile && readConfig(configFile) != 0)
 		exit(-1);
+	if (traceFile) {
+		if (!(trace = gsm0710_trace_init(TRACE_SIZE))) {
+			SYSLOG(LOG_ALERT, "Out of memory\n");
+			exit(-1);
+		}
+		for (i = 0; i < numOfMuxes; i++) {
+			modems[i]->mux->in_buf->trace = trace;
+			modems[i]->mux->in_buf->trace_source = i;
+		}
 	}
-
-	// Initialize modem and virtual ports
-	if (openDevices() != 0) {
-		return -1;
+	if (captureFile || tapPath) {
+		if (!(capture = gsm0710_capture_open(captureFile, tapPath)))
+			exit(-1);
+		for (i = 0; i < numOfMuxes; i++) {
+			modems[i]->mux->capture = capture;
+			modems[i]->mux->capture_source = i;
+		}
 	}
 
-	if (openMux() != 0) {
-		if(!faultTolerant)
+	// Initialize modems and virtual ports
+	for (i = 0; i < numOfMuxes; i++) {
+		if (openDevices(modems[i]) != 0) {
 			return -1;
-		syslog(LOG_WARNING,
-				"Unable to open mux. Will try later\n");
+		}
+	}
+	for (i = 0; i < numOfMuxes; i++) {
+		if (openMux(modems[i]) != 0) {
+			if (!modems[i]->mux->faultTolerant)
+				return -1;
+			SYSLOG(LOG_WARNING,
+					"%s: Unable to open mux. Will try later\n",
+					modems[i]->mux->serportdev);
+		}
 	}
 
-	if (_debug) {
-		syslog(LOG_INFO,
+	if (debug) {
+		SYSLOG(LOG_INFO,
 				"You can quit the MUX daemon with SIGKILL or SIGTERM\n");
 	} else if (wait_for_daemon_status) {
 		kill(parent_pid, SIGHUP);
 	}
 
-	/**
-	 * SUGGESTION:
-	 * substitute this lack for two threads
-	 */
+	if (openEventLoop() != 0)
+		return -1;
+	if (metricsPath) {
+		metrics_src.kind = SRC_METRICS;
+		if ((metrics_fd = gsm0710_metrics_listen(metricsPath)) < 0
+				|| watchFd(metrics_fd, &metrics_src, EPOLLIN) != 0)
+			return -1;
+	}
+	if (controlPath) {
+		for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+			controlClients[i].fd = -1;
+		control_src.kind = SRC_CONTROL;
+		if ((control_fd = gsm0710_metrics_listen(controlPath)) < 0
+				|| watchFd(control_fd, &control_src, EPOLLIN) != 0)
+			return -1;
+	}
+	for (i = 0; i < numOfMuxes; i++) {
+		modems[i]->frameReceiveTime = gsm0710_monotonic_us();
+		if (watchMux(modems[i]) != 0)
+			return -1;
+	}
 	// -- start waiting for input and forwarding it back and forth --
-	while (!terminate || terminateCount >= -1) {
-
-		FD_ZERO(&rfds);
-		FD_SET(serial_fd, &rfds);
-		for (i = 0; i < numOfPorts; i++)
-			FD_SET(ussp_fd[i].fd, &rfds);
-
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-
-		sel = select(maxfd + 1, &rfds, NULL, NULL, &timeout);
-		if (faultTolerant) {
-			// get the current time
-			time(&currentTime);
+	for (running = numOfMuxes; running > 0; ) {
+
+		deadline = LLONG_MAX;
+		busy = 0;
+		for (i = 0; i < numOfMuxes; i++) {
+			if (modems[i]->mux->serial_fd < 0)
+				continue;
+			deadline = min(deadline, nextDeadline(modems[i]));
+			busy |= hasWork(modems[i]);
 		}
-		if (sel > 0) {
-
-			if (FD_ISSET(serial_fd, &rfds)) {
-				// input from serial port
-				if ((size = gsm0710_buffer_free(in_buf)) > 0
-						&& (len = read(serial_fd, buf, min(size, sizeof(buf)))) > 0) {
-					if (_debug)
-						syslog(LOG_DEBUG, "Got data from serial: %d bytes; buffer free: %d\n", len, size);
-					gsm0710_buffer_write(in_buf, buf, len);
-					// extract and handle ready frames
-					if (extract_frames(in_buf) > 0 && faultTolerant) {
-						frameReceiveTime = currentTime;
-						pingNumber = 1;
-					}
-				} else if (size == 0){
-					syslog(LOG_WARNING, "No space in GSM buffer");
-				}
-			}
-
-			// check virtual ports
-			for (i = 0; i < numOfPorts; i++)
-				if (FD_ISSET(ussp_fd[i].fd, &rfds)) {
-
-					// information from virtual port
-					if (remaining[i] > 0) {
-						memcpy(buf, tmp[i], remaining[i]);
-						free(tmp[i]);
-					}
-					if ((len = read(ussp_fd[i].fd, buf + remaining[i],
-							sizeof(buf) - remaining[i])) > 0)
-						remaining[i] = ussp_recv_data(buf, len + remaining[i],
-								i);
-					if (_debug)
-						syslog(LOG_DEBUG, "Data from %s: %d bytes\n", ussp_fd[i].name,
-								len);
-					if (len < 0) {
-						// Re-open pty, so that in
-						remaining[i] = 0;
-						close(ussp_fd[i].fd);
-						if ((ussp_fd[i].fd = open_pty(ptydev[i], i)) < 0) {
-							if (_debug)
-								syslog(LOG_DEBUG,
-										"Can't re-open %s. %s (%d).\n",
-										ptydev[i], strerror(errno), errno);
-							terminate = 1;
-						} else if (ussp_fd[i].fd > maxfd)
-							maxfd = ussp_fd[i].fd;
-					}
-
-					/* copy remaining bytes from last packet into tmp */
-					if (remaining[i] > 0) {
-						tmp[i] = malloc(remaining[i]);
-						memcpy(tmp[i], buf + sizeof(buf) - remaining[i],
-								remaining[i]);
-					}
-				}
+		armTimer(deadline);
+		// don't sleep while a ready source still has work to do
+		sel = epoll_wait(epoll_fd, events, MAX_EVENTS, busy ? 0 : -1);
+		currentTime = gsm0710_monotonic_us();
+		if (dump_stats) {
+			dump_stats = 0;
+			dumpStats();
 		}
 
-		if (terminate) {
-			// terminate command given. Close channels one by one and finaly
-			// close the mux mode
-
-			if (terminateCount > 0) {
-				syslog(LOG_INFO, "Closing down the logical channel %d.\n",
-						terminateCount);
-				if (cstatus[terminateCount].opened)
-					write_frame(terminateCount, NULL, 0, DISC | PF);
-			} else if (terminateCount == 0) {
-				syslog(LOG_INFO,
-						"Sending close down request to the multiplexer.\n");
-				write_frame(0, close_mux, 2, UIH);
+		for (i = 0; i < sel; i++) {
+			Source *src = events[i].data.ptr;
+
+			switch (src->kind) {
+			case SRC_SERIAL:
+				if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+					src->readable = 1;
+				if (events[i].events & EPOLLOUT)
+					src->writable = 1;
+				break;
+			case SRC_PORT:
+				if (events[i].events & EPOLLOUT)
+					src->writable = 1;
+				if (events[i].events & ~EPOLLOUT)
+					markReady((Port *) src);
+				break;
+			case SRC_METRICS:
+				gsm0710_metrics_serve(metrics_fd, modems, numOfMuxes);
+				break;
+			case SRC_CONTROL:
+				acceptControl();
+				break;
+			case SRC_CLIENT:
+				serveControl((ControlClient *) src);
+				break;
+			case SRC_RESTART:
+				finishRestart(src->modem);
+				break;
+			case SRC_WAKEUP:
+				// the TX thread has made room in tx_ring
+				gsm0710_spsc_clear(src->modem->mux->tx_ring->space_fd);
+				break;
+			case SRC_TIMER: {
+				uint64_t expirations;
+				read(timer_fd, &expirations, sizeof(expirations));
+				break;
 			}
-			terminateCount--;
-		} else if (faultTolerant) {
-			if (restart || pingNumber >= MAX_PINGS) {
-				if (restart == 0) {
-					// Modem seems to be dead
-					syslog(LOG_ALERT,
-							"Modem is not responding trying to restart the mux.\n");
-				} else {
-					// Modem has closed down the multiplexer mode
-					restart = 0;
-					syslog(LOG_INFO, "Trying to restart the mux.\n");
-				}
-				do {
-					terminateCount = -1;
-					sleep(1);
-					if (openMux() == 0) {
-						// The modem is up again
-						time(&frameReceiveTime);
-						pingNumber = 1;
-						break;
-					}
-				} while (!terminate);
-
-			} else if (frameReceiveTime + POLLING_INTERVAL * pingNumber
-					< currentTime) {
-				// Nothing has been received for a while -> test the modem
-				if (_debug) {
-					syslog(LOG_DEBUG, "Sending PING to the modem.\n");
-				}
-				write_frame(0, ping_test, PING_TEST_LEN, UIH);
-				++pingNumber;
+			}
+		}
+
+		for (i = 0; i < numOfMuxes; i++) {
+			m = modems[i];
+			if (m->mux->serial_fd < 0)
+				continue;
+			if (!serviceMux(m, currentTime)) {
+				SYSLOG(LOG_INFO,
+						"%s: Received %ld frames and dropped %ld received frames during the mux-mode.\n",
+						m->mux->serportdev, m->mux->in_buf->received_count,
+						m->mux->in_buf->dropped_count);
+				closeDevices(m);
+				running--;
 			}
 		}
 
 	} /* while */
 
 	// finalize everything
-	closeDevices();
-
-	free(ussp_fd);
-	free(tmp);
-	free(remaining);
-	syslog(LOG_INFO,
-			"Received %ld frames and dropped %ld received frames during the mux-mode.\n",
-			in_buf->received_count, in_buf->dropped_count);
-	gsm0710_buffer_destroy(in_buf);
-	syslog(LOG_INFO, "%s finished\n", programName);
+	close(timer_fd);
+	close(epoll_fd);
+	if (metrics_fd >= 0) {
+		close(metrics_fd);
+		unlink(metricsPath);
+	}
+	if (control_fd >= 0) {
+		for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+			if (controlClients[i].fd >= 0)
+				close(controlClients[i].fd);
+		}
+		close(control_fd);
+		unlink(controlPath);
+	}
+	if (trace) {
+		gsm0710_trace_dump(trace, traceFile);
+		gsm0710_trace_destroy(trace);
+	}
+	// the I/O threads have stopped with their multiplexers
+	gsm0710_capture_close(capture);
+	for (i = 0; i < numOfMuxes; i++)
+		freeModem(modems[i]);
+	SYSLOG(LOG_INFO, "%s finished\n", programName);
 	/**
 	 * close  syslog
 	 */
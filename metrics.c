@@ -0,0 +1,221 @@
+/*
+ * metrics.c -- Implementation of functions defined in metrics.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+// To get accept4
+#define _GNU_SOURCE
+#endif
+#include "metrics.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* The counters are plain integers updated where the events happen, so
+ * keeping them costs an increment. In threaded mode the receive errors
+ * are counted by the RX thread and read here without a lock, a sample
+ * may be a moment old.
+ */
+
+int gsm0710_metrics_listen(const char *path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		SYSLOG(LOG_ERR, "Socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+			< 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+			|| listen(fd, 8) != 0) {
+		SYSLOG(LOG_ERR, "Can't listen on %s. %s (%d).\n", path,
+				strerror(errno), errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Starts a metric
+static void family(FILE *f, const char *name, const char *type,
+		const char *help) {
+	fprintf(f, "# HELP gsmmux_%s %s\n# TYPE gsmmux_%s %s\n", name, help, name,
+			type);
+}
+
+/* Writes a sample of a metric
+ *
+ * PARAMS:
+ * f      - where to write
+ * name   - the metric
+ * mux    - the multiplexer
+ * dlc    - the DLC or -1, if the sample is for the whole multiplexer
+ * reason - the reason label or NULL
+ * value  - the value
+ */
+static void sample(FILE *f, const char *name, GSM0710_Mux *mux, int dlc,
+		const char *reason, double value) {
+	const char *p;
+
+	fprintf(f, "gsmmux_%s{port=\"", name);
+	// the label value is escaped as the format requires
+	for (p = mux->serportdev; *p; p++) {
+		if (*p == '\\' || *p == '"')
+			fputc('\\', f);
+		fputc(*p, f);
+	}
+	fputc('"', f);
+	if (dlc >= 0)
+		fprintf(f, ",dlc=\"%d\"", dlc);
+	if (reason)
+		fprintf(f, ",reason=\"%s\"", reason);
+	fprintf(f, "} %.16g\n", value);
+}
+
+// Writes a sample of every multiplexer
+#define EACH_MUX(name, value) \
+	for (i = 0; i < count; i++) { \
+		m = modems[i]; \
+		mux = m->mux; \
+		sample(f, name, mux, -1, NULL, (value)); \
+	}
+
+// Writes a sample of every DLC from first on
+#define EACH_DLC(name, first, value) \
+	for (i = 0; i < count; i++) { \
+		m = modems[i]; \
+		for (mux = m->mux, dlc = (first); dlc <= mux->numOfPorts; dlc++) \
+			sample(f, name, mux, dlc, NULL, (value)); \
+	}
+
+void gsm0710_metrics_write(FILE *f, Modem **modems, int count) {
+	Modem *m;
+	GSM0710_Mux *mux;
+	GSM0710_Buffer *b;
+	int i, dlc;
+
+	family(f, "up", "gauge", "1 if the multiplexer mode is running.");
+	EACH_MUX("up", mux->serial_fd >= 0 && !mux->restart);
+	family(f, "restarts_total", "counter",
+			"Times the multiplexer has been restarted.");
+	EACH_MUX("restarts_total", m->restarts);
+	family(f, "pings_total", "counter", "Test commands sent to the modem.");
+	EACH_MUX("pings_total", m->pings);
+	family(f, "ping_rtt_seconds", "gauge",
+			"Round trip time of the last answered test command.");
+	EACH_MUX("ping_rtt_seconds", mux->ping_rtt / 1e6);
+
+	family(f, "rx_frames_total", "counter", "Frames received.");
+	EACH_DLC("rx_frames_total", 0, mux->rx_frames[dlc]);
+	family(f, "rx_bytes_total", "counter", "Payload bytes received.");
+	EACH_DLC("rx_bytes_total", 0, mux->rx_bytes[dlc]);
+	family(f, "tx_frames_total", "counter", "Frames sent.");
+	EACH_DLC("tx_frames_total", 0, mux->tx_frames[dlc]);
+	family(f, "tx_bytes_total", "counter", "Payload bytes sent.");
+	EACH_DLC("tx_bytes_total", 0, mux->tx_bytes[dlc]);
+
+	family(f, "rx_dropped_frames_total", "counter",
+			"Received frames dropped by reason.");
+	for (i = 0; i < count; i++) {
+		mux = modems[i]->mux;
+		b = mux->in_buf;
+		sample(f, "rx_dropped_frames_total", mux, -1, "fcs", b->dropped_fcs);
+		sample(f, "rx_dropped_frames_total", mux, -1, "end_flag",
+				b->dropped_flag);
+		sample(f, "rx_dropped_frames_total", mux, -1, "length",
+				b->dropped_length);
+		sample(f, "rx_dropped_frames_total", mux, -1, "stall",
+				b->dropped_stall);
+		sample(f, "rx_dropped_frames_total", mux, -1, "buffer_full",
+				b->discarded_count);
+	}
+	family(f, "input_buffer_bytes", "gauge",
+			"Received characters waiting for parsing.");
+	EACH_MUX("input_buffer_bytes", gsm0710_buffer_length(mux->in_buf));
+	family(f, "input_buffer_size_bytes", "gauge", "Size of the input buffer.");
+	EACH_MUX("input_buffer_size_bytes", mux->in_buf->size);
+	family(f, "input_buffer_stopped_total", "counter",
+			"Times reading waited for room in the input buffer.");
+	EACH_MUX("input_buffer_stopped_total", mux->in_buf->stopped_count);
+	family(f, "input_buffer_grown_total", "counter",
+			"Times the input buffer has been grown.");
+	EACH_MUX("input_buffer_grown_total", mux->in_buf->grown_count);
+
+	family(f, "tx_backlog_bytes", "gauge",
+			"Encoded frames waiting for the serial port.");
+	EACH_MUX("tx_backlog_bytes", mux->threads_running
+			? gsm0710_spsc_length(mux->tx_ring)
+			: gsm0710_buffer_length(mux->out_buf));
+	family(f, "tx_queue_bytes", "gauge",
+			"Data from the pty waiting for the scheduler.");
+	EACH_DLC("tx_queue_bytes", 1, mux->txq[dlc].buf
+			? gsm0710_buffer_length(mux->txq[dlc].buf) : 0);
+	family(f, "pty_queue_bytes", "gauge",
+			"Received data waiting for the pty reader.");
+	EACH_DLC("pty_queue_bytes", 1, m->ports[dlc - 1].rxq
+			? gsm0710_buffer_length(m->ports[dlc - 1].rxq) : 0);
+	family(f, "pty_dropped_bytes_total", "counter",
+			"Received data dropped, because the pty queue was full.");
+	EACH_DLC("pty_dropped_bytes_total", 1, m->ports[dlc - 1].rx_dropped);
+
+	family(f, "channel_open", "gauge", "1 if the DLC is open.");
+	EACH_DLC("channel_open", 0, mux->cstatus[dlc].opened);
+	family(f, "msc_signals", "gauge",
+			"V.24 signals last sent to the modem by MSC.");
+	EACH_DLC("msc_signals", 1, mux->cstatus[dlc].v24_signals);
+	family(f, "modem_flow_stopped", "gauge",
+			"1 if the modem has stopped the DLC by MSC or FCoff.");
+	EACH_DLC("modem_flow_stopped", 1,
+			mux->cstatus[dlc].stopped || mux->stopped);
+	family(f, "host_flow_stopped", "gauge",
+			"1 if the modem is stopped by MSC, because the pty is slow.");
+	EACH_DLC("host_flow_stopped", 1,
+			(mux->cstatus[dlc].v24_signals & S_FC) != 0);
+}
+
+void gsm0710_metrics_serve(int fd, Modem **modems, int count) {
+	char *text = NULL;
+	size_t length = 0;
+	FILE *f;
+	int client, written = 0;
+
+	while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))
+			>= 0) {
+		// the same text for all clients of this round
+		if (!written++ && (f = open_memstream(&text, &length))) {
+			gsm0710_metrics_write(f, modems, count);
+			fclose(f);
+		}
+		if (text && send(client, text, length, MSG_NOSIGNAL) < 0)
+			SYSLOG(LOG_INFO, "Can't send the metrics. %s (%d).\n",
+					strerror(errno), errno);
+		close(client);
+	}
+	free(text);
+}
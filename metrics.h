@@ -0,0 +1,59 @@
+#ifndef _GSM0710_METRICS_H_
+#define _GSM0710_METRICS_H_
+/*
+ * metrics.h -- counters of the GSM 0710 multiplexers in the Prometheus
+ *              text exposition format, served on a Unix socket
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include "buffer.h"
+#include "gsm0710.h"
+#include "muxd.h"
+
+/* Creates a listening Unix socket for the metrics or the control commands.
+ * A stale socket at the path is replaced.
+ *
+ * PARAMS:
+ * path - file system path of the socket
+ * RETURNS:
+ * the non-blocking socket or -1 on error
+ */
+int gsm0710_metrics_listen(const char *path);
+
+/* Writes the counters of modems. Each metric is written once with
+ * a sample per multiplexer (label port) and DLC (label dlc).
+ *
+ * PARAMS:
+ * f      - where to write
+ * modems - the modems
+ * count  - number of modems
+ */
+void gsm0710_metrics_write(FILE *f, Modem **modems, int count);
+
+/* Accepts the pending connections of the listening socket, writes the
+ * metrics to each of them and closes it. Doesn't block, a client that
+ * doesn't take the whole text at once gets it truncated.
+ *
+ * PARAMS:
+ * fd     - the listening socket
+ * modems - the modems
+ * count  - number of modems
+ */
+void gsm0710_metrics_serve(int fd, Modem **modems, int count);
+
+#endif /* _GSM0710_METRICS_H_ */
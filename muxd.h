@@ -0,0 +1,103 @@
+#ifndef _GSM0710_MUXD_H_
+#define _GSM0710_MUXD_H_
+/*
+ * muxd.h -- the state gsmMuxd keeps around each multiplexer: the pseudo
+ *           TTYs of the DLCs, the setup of the modem by AT commands and
+ *           the event loop
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "buffer.h"
+#include "gsm0710.h"
+
+// the largest number of virtual ports of a modem
+#define MAX_CHANNELS 32
+
+// Kinds of event sources of the main loop
+#define SRC_SERIAL 1
+#define SRC_PORT 2
+#define SRC_TIMER 3
+#define SRC_WAKEUP 4
+#define SRC_METRICS 5
+#define SRC_CONTROL 6
+#define SRC_CLIENT 7
+#define SRC_RESTART 8
+
+struct Modem;
+
+// Something the event loop watches. Its epoll data points to this.
+typedef struct Source {
+	int kind;
+	struct Modem *modem;
+	int readable; // edge triggered input seen, read until EAGAIN
+	int writable; // edge triggered output space seen, write until EAGAIN
+} Source;
+
+// A virtual port, i.e. the pseudo TTY connected to a logical channel
+typedef struct Port {
+	Source src; // must be first
+	int fd;
+	char *name; // the slave device
+	char *dev;  // the master device to open
+	GSM0710_Buffer *rxq; // data from the modem, which the pty hasn't taken
+	unsigned long rx_dropped;
+} Port;
+
+// the modem is stopped by MSC, when this much data is waiting for a
+// pseudo TTY, and let go again below the low watermark
+#define RXQ_SIZE 8192
+#define RXQ_HIGH (RXQ_SIZE / 8)
+#define RXQ_LOW (RXQ_SIZE / 32)
+
+/* A modem served by gsmMuxd. The protocol state is in the multiplexer,
+ * this is what the daemon adds around it.
+ */
+typedef struct Modem {
+	GSM0710_Mux *mux;
+
+	// configuration
+	char *devSymlinkPrefix;
+	int modem_type;
+	int baudrate;
+	int pin_code;
+	int threaded; // serial I/O on the RX and TX threads of the library
+	Port ports[MAX_CHANNELS]; // by DLC - 1
+	char *configLine; // its line of -c, which the strings above point into
+
+	// life cycle
+	long long terminateTime;
+	long long restartTime;
+	long long frameReceiveTime;
+	unsigned long restarts;
+	unsigned long pings;
+	/* a restart runs openMux() on a thread of its own, which signals
+	 * restart_fd when it's done; the event loop leaves the multiplexer
+	 * alone meanwhile */
+	int restarting;
+	int restart_result;
+	pthread_t restart_thread;
+	int restart_fd;
+
+	// event loop
+	Source serial_src; // the serial port or, in threaded mode, rx_ring
+	Source tx_space_src; // room in tx_ring, threaded mode only
+	Source restart_src;
+	Port *readyPorts[MAX_CHANNELS];
+	int numReadyPorts;
+} Modem;
+
+#endif /* _GSM0710_MUXD_H_ */
@@ -0,0 +1,158 @@
+/*
+ * spsc.c -- Implementation of functions defined in spsc.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "spsc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* All accesses to head, tail and space_wanted are sequentially
+ * consistent. Besides publishing the data, this orders "store head, load
+ * tail" in the producer against "store tail, load head" in the consumer,
+ * so at least one side sees the other and a wakeup can't get lost between
+ * the consumer finding the ring empty and going to sleep. The same holds
+ * for space_wanted and tail.
+ */
+
+static void signal_fd(int fd) {
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0) {
+		// the counter is already set, the other side will wake up
+	}
+}
+
+GSM0710_Spsc *gsm0710_spsc_init(unsigned int size) {
+	GSM0710_Spsc *r;
+	unsigned int s = 64;
+
+	while (s < size)
+		s <<= 1;
+	if (!(r = aligned_alloc(64, sizeof(GSM0710_Spsc))))
+		return NULL;
+	memset(r, 0, sizeof(GSM0710_Spsc));
+	r->size = s;
+	r->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->space_wanted, 0);
+	if (!(r->data = malloc(s)) || r->data_fd < 0 || r->space_fd < 0) {
+		gsm0710_spsc_destroy(r);
+		return NULL;
+	}
+	return r;
+}
+
+void gsm0710_spsc_destroy(GSM0710_Spsc *r) {
+	if (!r)
+		return;
+	if (r->data_fd >= 0)
+		close(r->data_fd);
+	if (r->space_fd >= 0)
+		close(r->space_fd);
+	free(r->data);
+	free(r);
+}
+
+int gsm0710_spsc_push(GSM0710_Spsc *r, const struct iovec *iov, int iovcnt) {
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned int tail = atomic_load(&r->tail);
+	unsigned int pos, c, n, total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (total > r->size - (head - tail))
+		return -1;
+	pos = head;
+	for (i = 0; i < iovcnt; i++) {
+		if ((n = iov[i].iov_len) == 0)
+			continue;
+		c = r->size - (pos & (r->size - 1));
+		if (n > c) {
+			memcpy(r->data + (pos & (r->size - 1)), iov[i].iov_base, c);
+			memcpy(r->data, (char *) iov[i].iov_base + c, n - c);
+		} else {
+			memcpy(r->data + (pos & (r->size - 1)), iov[i].iov_base, n);
+		}
+		pos += n;
+	}
+	atomic_store(&r->head, pos);
+	// wake up the consumer, if it had taken everything before this push
+	if (atomic_load(&r->tail) == head)
+		signal_fd(r->data_fd);
+	return 0;
+}
+
+int gsm0710_spsc_peek(GSM0710_Spsc *r, unsigned int offset, struct iovec seg[2],
+		unsigned int count) {
+	unsigned int pos = (atomic_load_explicit(&r->tail, memory_order_relaxed)
+			+ offset) & (r->size - 1);
+	unsigned int c = r->size - pos;
+
+	seg[0].iov_base = r->data + pos;
+	if (count > c) {
+		seg[0].iov_len = c;
+		seg[1].iov_base = r->data;
+		seg[1].iov_len = count - c;
+		return 2;
+	}
+	seg[0].iov_len = count;
+	return 1;
+}
+
+void gsm0710_spsc_copy(GSM0710_Spsc *r, unsigned int offset, void *output,
+		unsigned int count) {
+	struct iovec seg[2];
+
+	if (gsm0710_spsc_peek(r, offset, seg, count) == 2) {
+		memcpy(output, seg[0].iov_base, seg[0].iov_len);
+		memcpy((char *) output + seg[0].iov_len, seg[1].iov_base,
+				seg[1].iov_len);
+	} else {
+		memcpy(output, seg[0].iov_base, count);
+	}
+}
+
+void gsm0710_spsc_consume(GSM0710_Spsc *r, unsigned int count) {
+	atomic_store(&r->tail,
+			atomic_load_explicit(&r->tail, memory_order_relaxed) + count);
+	if (atomic_load(&r->space_wanted) && atomic_exchange(&r->space_wanted, 0))
+		signal_fd(r->space_fd);
+}
+
+int gsm0710_spsc_want_space(GSM0710_Spsc *r, unsigned int count) {
+	atomic_store(&r->space_wanted, 1);
+	if (gsm0710_spsc_free(r) >= count) {
+		atomic_store(&r->space_wanted, 0);
+		return 1;
+	}
+	return 0;
+}
+
+void gsm0710_spsc_clear(int fd) {
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0) {
+		// wasn't signalled
+	}
+}
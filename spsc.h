@@ -0,0 +1,118 @@
+#ifndef _GSM0710_SPSC_H_
+#define _GSM0710_SPSC_H_
+/*
+ * spsc.h -- bounded lock-free single producer/single consumer ring
+ *           connecting the threads of the GSM 0710 multiplexer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/* A byte ring written by exactly one thread and read by exactly one other
+ * thread. head and tail run freely and are masked with the power of two
+ * size, so neither side takes a lock and a full ring needs no spare byte.
+ *
+ * Two eventfds let the sides sleep in poll()/epoll: data_fd is signalled
+ * when data is pushed to a ring the consumer had emptied, space_fd when
+ * the consumer frees space the producer has asked for with
+ * gsm0710_spsc_want_space().
+ */
+typedef struct GSM0710_Spsc {
+	char *data;
+	unsigned int size;
+	int data_fd;
+	int space_fd;
+	// written by the producer only
+	_Alignas(64) atomic_uint head;
+	// written by the consumer only
+	_Alignas(64) atomic_uint tail;
+	atomic_int space_wanted;
+} GSM0710_Spsc;
+
+/* Allocates a ring and its eventfds
+ *
+ * PARAMS:
+ * size - capacity in characters, rounded up to a power of two
+ * RETURNS:
+ * the ring or NULL on error
+ */
+GSM0710_Spsc *gsm0710_spsc_init(unsigned int size);
+
+// Destroys a ring and closes its eventfds
+void gsm0710_spsc_destroy(GSM0710_Spsc *r);
+
+// Tells, how many characters are waiting in the ring
+#define gsm0710_spsc_length(r) (atomic_load(&(r)->head) - atomic_load(&(r)->tail))
+
+// Tells, how many characters can be pushed to the ring
+#define gsm0710_spsc_free(r) ((r)->size - gsm0710_spsc_length(r))
+
+/* Pushes the contents of an I/O vector to the ring as one unit, i.e. the
+ * consumer sees either all of it or nothing. Called by the producer only.
+ *
+ * PARAMS:
+ * r      - the ring
+ * iov    - the data
+ * iovcnt - number of elements in iov
+ * RETURNS:
+ * 0 on success, -1 if the data doesn't fit to the ring
+ */
+int gsm0710_spsc_push(GSM0710_Spsc *r, const struct iovec *iov, int iovcnt);
+
+/* Describes waiting data without copying it. Called by the consumer only.
+ *
+ * PARAMS:
+ * r      - the ring
+ * offset - position of the data counted from the oldest character
+ * seg    - filled in with one or two segments pointing into the ring
+ * count  - number of characters, offset + count must not exceed the length
+ * RETURNS:
+ * number of segments used
+ */
+int gsm0710_spsc_peek(GSM0710_Spsc *r, unsigned int offset, struct iovec seg[2],
+		unsigned int count);
+
+/* Copies waiting data without removing it. Called by the consumer only.
+ *
+ * PARAMS:
+ * r      - the ring
+ * offset - position of the data counted from the oldest character
+ * output - where to copy the data
+ * count  - number of characters, offset + count must not exceed the length
+ */
+void gsm0710_spsc_copy(GSM0710_Spsc *r, unsigned int offset, void *output,
+		unsigned int count);
+
+/* Removes characters from the ring and wakes up the producer, if it is
+ * waiting for space. Called by the consumer only.
+ */
+void gsm0710_spsc_consume(GSM0710_Spsc *r, unsigned int count);
+
+/* Asks the consumer to signal space_fd when it frees space. Called by the
+ * producer only.
+ *
+ * RETURNS:
+ * 1 if count characters fit to the ring already, 0 if the producer has to
+ * wait for space_fd
+ */
+int gsm0710_spsc_want_space(GSM0710_Spsc *r, unsigned int count);
+
+// Resets a signalled eventfd of a ring. Call before draining the ring.
+void gsm0710_spsc_clear(int fd);
+
+#endif /* _GSM0710_SPSC_H_ */
@@ -0,0 +1,348 @@
+/*
+ * parser.c -- regression test of the frame parsers
+ *
+ * Streams of known frames in both framings are fed through the input
+ * buffer in reads of different sizes, with garbage between the frames,
+ * with a frame that never completes and with false start flags. Every
+ * frame has to come out once, intact and in order, and the work spent on
+ * false start flags has to stay bounded.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../buffer.h"
+#include "../fcs.h"
+#include "../internal.h"
+
+#define STREAM_SIZE (1 << 18)
+#define MAX_FRAMES 8192
+// frame data of the streams, above 127 for the two octet length field
+#define FRAME_MAX 300
+#define NUM_DLCS 4
+
+// a frame, which has to be received
+typedef struct Expected {
+	int channel;
+	int control;
+	int length;
+	unsigned int sum;
+} Expected;
+
+typedef struct Stream {
+	char *data;
+	int length;
+	Expected frames[MAX_FRAMES];
+	int count;
+	// frames received, which weren't sent
+	int extra;
+} Stream;
+
+static int failures;
+
+// a fixed generator, so that the streams are the same everywhere
+static unsigned int rand_state = 1;
+
+static unsigned int next_rand() {
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 16;
+}
+
+static unsigned int checksum(const struct iovec *iov, int iovcnt) {
+	unsigned int sum = 0;
+	int i, j;
+
+	for (i = 0; i < iovcnt; i++)
+		for (j = 0; j < iov[i].iov_len; j++)
+			sum = sum * 31 + ((unsigned char *) iov[i].iov_base)[j];
+	return sum;
+}
+
+static void append(Stream *s, const char *data, int length) {
+	if (s->length + length > STREAM_SIZE) {
+		fprintf(stderr, "Stream too long\n");
+		exit(1);
+	}
+	memcpy(s->data + s->length, data, length);
+	s->length += length;
+}
+
+static Stream *new_stream() {
+	Stream *s;
+
+	if (!(s = calloc(1, sizeof(Stream))) || !(s->data = malloc(STREAM_SIZE))) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return s;
+}
+
+static void free_stream(Stream *s) {
+	free(s->data);
+	free(s);
+}
+
+/* Appends count frames of random data, lengths and types, encoded by
+ * gsm0710_write_frame(), and garbage between them, if asked for
+ */
+static void add_frames(Stream *s, int advanced, int count, int garbage) {
+	GSM0710_Mux *mux;
+	char data[FRAME_MAX], junk[64];
+	struct iovec seg[2];
+	Expected *e;
+	int i, j, n;
+
+	if (!(mux = gsm0710_mux_new())) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	mux->advanced = advanced;
+	mux->max_frame_size = FRAME_MAX;
+	for (i = 0; i < count; i++) {
+		if (s->count == MAX_FRAMES) {
+			fprintf(stderr, "Too many frames\n");
+			exit(1);
+		}
+		e = &s->frames[s->count++];
+		e->channel = 1 + next_rand() % NUM_DLCS;
+		e->control = (next_rand() % 4 == 0) ? UI : UIH;
+		e->length = next_rand() % (FRAME_MAX + 1);
+		for (j = 0; j < e->length; j++)
+			data[j] = next_rand();
+		seg[0].iov_base = data;
+		seg[0].iov_len = e->length;
+		e->sum = checksum(seg, 1);
+		gsm0710_write_frame(mux, e->channel, data, e->length, e->control);
+		n = gsm0710_buffer_peek(mux->out_buf, 0, seg,
+				gsm0710_buffer_length(mux->out_buf));
+		for (j = 0; j < n; j++)
+			append(s, seg[j].iov_base, seg[j].iov_len);
+		gsm0710_buffer_clear(mux->out_buf);
+		if (garbage && next_rand() % 2) {
+			// flags and random headers, which have to be resynchronized
+			n = 1 + next_rand() % sizeof(junk);
+			for (j = 0; j < n; j++)
+				junk[j] = (next_rand() % 8 == 0)
+						? (advanced ? ADV_FLAG : F_FLAG) : next_rand();
+			append(s, junk, n);
+		}
+	}
+	gsm0710_mux_free(mux);
+}
+
+static GSM0710_Buffer *new_buffer(int mirrored) {
+	GSM0710_Buffer *b = mirrored
+			? gsm0710_buffer_init_mirrored(GSM0710_BUFFER_SIZE)
+			: gsm0710_buffer_init_size(GSM0710_BUFFER_SIZE);
+
+	if (!b) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return b;
+}
+
+/* Parses the frames in the buffer and checks them against the expected
+ * ones from *next on. A frame, which matches none of them, has been made
+ * of noise and passed the FCS by chance; it's counted as extra.
+ *
+ * RETURNS:
+ * the number of expected frames, which were skipped
+ */
+static int parse(GSM0710_Buffer *b, int advanced, Stream *s, int *next) {
+	GSM0710_FrameView view;
+	Expected *e;
+	unsigned int sum;
+	int i, errors = 0;
+
+	while (advanced ? gsm0710_buffer_get_adv_frame_view(b, &view)
+			: gsm0710_buffer_get_frame_view(b, &view)) {
+		sum = checksum(view.seg, view.segments);
+		for (i = *next; i < s->count; i++) {
+			e = &s->frames[i];
+			if (view.channel == e->channel && view.control == e->control
+					&& view.data_length == e->length && sum == e->sum)
+				break;
+		}
+		if (i == s->count) {
+			s->extra++;
+			continue;
+		}
+		errors += i - *next;
+		*next = i + 1;
+	}
+	return errors;
+}
+
+/* Feeds a stream to a buffer in reads of chunk characters and parses it
+ * after every read. A frame, which never completes, is given up at the
+ * end like the stall timer would.
+ *
+ * RETURNS:
+ * the number of frames, which were lost
+ */
+static int feed(GSM0710_Buffer *b, int advanced, Stream *s, int chunk) {
+	int i, n, next = 0, errors = 0;
+
+	s->extra = 0;
+	for (i = 0; i < s->length; i += n) {
+		n = gsm0710_buffer_write(b, s->data + i, min(chunk, s->length - i));
+		errors += parse(b, advanced, s, &next);
+		if (n == 0) {
+			// a full buffer, which doesn't hold a frame
+			if (!b->incomplete)
+				return errors + s->count - next;
+			gsm0710_buffer_skip_frame(b);
+		}
+	}
+	while (b->incomplete) {
+		gsm0710_buffer_skip_frame(b);
+		errors += parse(b, advanced, s, &next);
+	}
+	return errors + s->count - next;
+}
+
+static void check(const char *name, int errors) {
+	printf("%-40s %s\n", name, errors ? "FAIL" : "ok");
+	if (errors) {
+		printf("  %d frames lost, damaged or made up\n", errors);
+		failures++;
+	}
+}
+
+// Every frame of a stream comes out, however the reads split it
+static void test_reads(int advanced, int garbage) {
+	static const int chunks[] = { 1, 3, 61, 1000, 4096 };
+	char name[64];
+	Stream *s = new_stream();
+	GSM0710_Buffer *b;
+	int i, mirrored;
+
+	add_frames(s, advanced, 1000, garbage);
+	for (mirrored = 0; mirrored < 2; mirrored++) {
+		for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+			b = new_buffer(mirrored);
+			snprintf(name, sizeof(name), "%s %s, %s, reads of %d",
+					advanced ? "advanced" : "basic",
+					garbage ? "noisy" : "clean",
+					mirrored ? "mirrored" : "ring", chunks[i]);
+			// noise may pass the FCS, but not the length check too
+			check(name, feed(b, advanced, s, chunks[i])
+					+ ((!garbage || !advanced) ? s->extra : 0));
+			gsm0710_buffer_destroy(b);
+		}
+	}
+	free_stream(s);
+}
+
+/* A frame, whose rest never arrives, holds the parser until it is given
+ * up, and the frames after it are received
+ */
+static void test_stall(int advanced) {
+	// the length field claims 100 characters
+	static const char basic[] = { F_FLAG, EA | CR | (1 << 2), UIH,
+			1 | (100 << 1), 'a', 'b', 'c' };
+	static const char adv[] = { ADV_FLAG, EA | CR | (1 << 2), UIH, 'a', 'b' };
+	GSM0710_Buffer *b = new_buffer(1);
+	Stream *s = new_stream();
+	int next = 0, errors = 0;
+
+	add_frames(s, advanced, 100, 0);
+	if (advanced)
+		gsm0710_buffer_write(b, adv, sizeof(adv));
+	else
+		gsm0710_buffer_write(b, basic, sizeof(basic));
+	errors += parse(b, advanced, s, &next);
+	if (!b->incomplete)
+		errors++;
+	gsm0710_buffer_skip_frame(b);
+	errors += feed(b, advanced, s, 61);
+	check(advanced ? "advanced stalled frame" : "basic stalled frame",
+			errors + next + s->extra);
+	gsm0710_buffer_destroy(b);
+	free_stream(s);
+}
+
+// characters fed to the FCS kernel
+static unsigned long long hashed;
+static const GSM0710_FcsKernel *real_kernel;
+
+static unsigned char count_update(unsigned char fcs,
+		const unsigned char *input, int count) {
+	hashed += count;
+	return real_kernel->update(fcs, input, count);
+}
+
+static unsigned char count_copy(unsigned char fcs, char *dst,
+		const char *src, int count) {
+	hashed += count;
+	return real_kernel->copy(fcs, dst, src, count);
+}
+
+static const GSM0710_FcsKernel counting = { "counting", count_update,
+		count_copy };
+
+/* A start flag every five characters, each followed by the header of a UI
+ * frame claiming 2000 characters. The FCS of the claimed data mustn't be
+ * computed for the false frames, and the frames after them are received.
+ */
+static void test_false_flags() {
+	static const char header[] = { F_FLAG, EA | CR | (1 << 2), UI,
+			(2000 & 127) << 1, 2000 >> 7 };
+	GSM0710_Buffer *b = new_buffer(1);
+	Stream *s = new_stream(), *frames = new_stream();
+	int i, errors = 0;
+
+	for (i = 0; i < 20000; i++)
+		append(s, header, sizeof(header));
+	real_kernel = gsm0710_fcs;
+	gsm0710_fcs = &counting;
+	errors += feed(b, 0, s, 4096);
+	gsm0710_fcs = real_kernel;
+	check("basic false start flags, bounded work",
+			errors + (hashed > s->length));
+	if (hashed > s->length)
+		printf("  %llu characters hashed for %d received\n", hashed,
+				s->length);
+
+	// the parser still waits for the data of the last false frames
+	add_frames(frames, 0, 100, 0);
+	errors = feed(b, 0, frames, 61);
+	check("basic frames after false start flags", errors + frames->extra);
+	gsm0710_buffer_destroy(b);
+	free_stream(frames);
+	free_stream(s);
+}
+
+int main(int argc, char *argv[]) {
+	int advanced;
+
+	gsm0710_fcs_init();
+	for (advanced = 0; advanced < 2; advanced++) {
+		test_reads(advanced, 0);
+		test_reads(advanced, 1);
+		test_stall(advanced);
+	}
+	test_false_flags();
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}
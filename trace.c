@@ -0,0 +1,138 @@
+/*
+ * trace.c -- Implementation of functions defined in trace.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "trace.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+
+GSM0710_Trace *gsm0710_trace_init(unsigned int size) {
+	GSM0710_Trace *t;
+	unsigned int n;
+
+	for (n = 1; n < size; n <<= 1)
+		;
+	if (!(t = malloc(sizeof(GSM0710_Trace))))
+		return NULL;
+	if (!(t->records = calloc(n, sizeof(GSM0710_TraceRecord)))) {
+		free(t);
+		return NULL;
+	}
+	atomic_init(&t->head, 0);
+	t->mask = n - 1;
+	return t;
+}
+
+void gsm0710_trace_destroy(GSM0710_Trace *t) {
+	if (!t)
+		return;
+	free(t->records);
+	free(t);
+}
+
+// Writes all of count characters
+static int write_all(int fd, const void *p, size_t count) {
+	ssize_t n;
+
+	while (count > 0) {
+		if ((n = write(fd, p, count)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p = (const char *) p + n;
+		count -= n;
+	}
+	return 0;
+}
+
+int gsm0710_trace_dump(GSM0710_Trace *t, const char *path) {
+	GSM0710_TraceHeader header;
+	GSM0710_TraceRecord *copy, *r;
+	unsigned int head, pos, count = 0;
+	uint32_t seq;
+	int fd, ret = -1;
+
+	if (!(copy = malloc((t->mask + 1) * sizeof(GSM0710_TraceRecord))))
+		return -1;
+	head = atomic_load_explicit(&t->head, memory_order_acquire);
+	pos = (head > t->mask) ? head - t->mask - 1 : 0;
+	for (; pos != head; pos++) {
+		r = &t->records[pos & t->mask];
+		// a record is taken, if its seq is the same before and after
+		// the copy, i.e. it hasn't been rewritten meanwhile
+		seq = atomic_load_explicit((_Atomic uint32_t *) &r->seq,
+				memory_order_acquire);
+		if (seq != pos + 1)
+			continue;
+		copy[count] = *r;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit((_Atomic uint32_t *) &r->seq,
+				memory_order_relaxed) == seq)
+			count++;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(GSM0710_TraceRecord);
+	header.count = count;
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		SYSLOG(LOG_ERR, "Can't open %s. %s (%d).\n", path, strerror(errno),
+				errno);
+	else if (write_all(fd, &header, sizeof(header)) != 0
+			|| write_all(fd, copy, count * sizeof(GSM0710_TraceRecord)) != 0)
+		SYSLOG(LOG_ERR, "Can't write %s. %s (%d).\n", path, strerror(errno),
+				errno);
+	else
+		ret = count;
+	if (fd >= 0)
+		close(fd);
+	free(copy);
+	return ret;
+}
+
+const char *gsm0710_trace_verdict(int verdict) {
+	switch (verdict) {
+	case TRACE_RX:
+		return "rx";
+	case TRACE_RX_FCS:
+		return "rx-drop-fcs";
+	case TRACE_RX_FLAG:
+		return "rx-drop-end-flag";
+	case TRACE_RX_LENGTH:
+		return "rx-drop-length";
+	case TRACE_RX_STALL:
+		return "rx-drop-stall";
+	case TRACE_RX_OVERFLOW:
+		return "rx-drop-overflow";
+	case TRACE_TX:
+		return "tx";
+	case TRACE_TX_FULL:
+		return "tx-full";
+	case TRACE_PTY_DROP:
+		return "pty-drop";
+	default:
+		return "unknown";
+	}
+}
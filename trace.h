@@ -0,0 +1,129 @@
+#ifndef _GSM0710_TRACE_H_
+#define _GSM0710_TRACE_H_
+/*
+ * trace.h -- fixed size binary ring of frame events of the GSM 0710
+ *            multiplexer, dumped to a file and decoded offline
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// what happened to a frame
+#define TRACE_RX 1          // received
+#define TRACE_RX_FCS 2      // dropped, FCS doesn't match
+#define TRACE_RX_FLAG 3     // dropped, end flag not found
+#define TRACE_RX_LENGTH 4   // dropped, above N1 or malformed
+#define TRACE_RX_STALL 5    // dropped, rest of it not received
+#define TRACE_RX_OVERFLOW 6 // dropped by the overflow policy of in_buf
+#define TRACE_TX 16         // queued for the serial port
+#define TRACE_TX_FULL 17    // not sent, no room for it
+#define TRACE_PTY_DROP 32   // data dropped, the pty queue is full
+
+// the DLC of a dropped frame, whose header isn't known
+#define TRACE_NO_DLC 0xFF
+
+/* One event. The records are written by the threads of all multiplexers
+ * and dumped in the byte order of the host.
+ */
+typedef struct GSM0710_TraceRecord {
+	uint64_t time;   // CLOCK_MONOTONIC in microseconds
+	uint32_t seq;    // position in the ring + 1, 0 while being written
+	uint16_t length; // of the payload
+	uint8_t dlc;
+	uint8_t control;
+	uint8_t verdict; // TRACE_*
+	uint8_t source;  // the multiplexer
+	uint8_t reserved[6];
+} GSM0710_TraceRecord;
+
+// the file starts with this, followed by count records oldest first
+typedef struct GSM0710_TraceHeader {
+	char magic[8]; // TRACE_MAGIC
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;
+	uint32_t reserved;
+} GSM0710_TraceHeader;
+
+#define TRACE_MAGIC "GSMTRACE"
+#define TRACE_VERSION 1
+
+/* Any thread may add records without a lock: the position is taken by an
+ * atomic increment and a record is marked valid by its seq, once it has
+ * been written. The oldest records are overwritten.
+ */
+typedef struct GSM0710_Trace {
+	atomic_uint head;
+	unsigned int mask;
+	GSM0710_TraceRecord *records;
+} GSM0710_Trace;
+
+/* Allocates a trace ring
+ *
+ * PARAMS:
+ * size - number of records, rounded up to a power of two
+ * RETURNS:
+ * the ring or NULL, if out of memory
+ */
+GSM0710_Trace *gsm0710_trace_init(unsigned int size);
+
+void gsm0710_trace_destroy(GSM0710_Trace *t);
+
+/* Writes the records of the ring to a file, oldest first. Records being
+ * written at the same time are left out.
+ *
+ * PARAMS:
+ * t    - the ring
+ * path - the file, which is replaced
+ * RETURNS:
+ * number of records written or -1 on error
+ */
+int gsm0710_trace_dump(GSM0710_Trace *t, const char *path);
+
+// Tells the name of a verdict
+const char *gsm0710_trace_verdict(int verdict);
+
+/* Adds an event to a trace ring. Does nothing, if tracing is off, i.e.
+ * t is NULL.
+ */
+static inline void gsm0710_trace(GSM0710_Trace *t, int source, int dlc,
+		int control, int length, int verdict) {
+	GSM0710_TraceRecord *r;
+	struct timespec ts;
+	unsigned int pos;
+
+	if (!t)
+		return;
+	pos = atomic_fetch_add_explicit(&t->head, 1, memory_order_relaxed);
+	r = &t->records[pos & t->mask];
+	atomic_store_explicit((_Atomic uint32_t *) &r->seq, 0,
+			memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r->time = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	r->length = length;
+	r->dlc = dlc;
+	r->control = control;
+	r->verdict = verdict;
+	r->source = source;
+	atomic_store_explicit((_Atomic uint32_t *) &r->seq, pos + 1,
+			memory_order_release);
+}
+
+#endif /* _GSM0710_TRACE_H_ */
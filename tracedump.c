@@ -0,0 +1,91 @@
+/*
+ * tracedump.c -- prints a frame trace written by gsmMuxd -T
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "buffer.h"
+#include "internal.h"
+
+// Tells the name of a frame type, without the P/F bit
+static const char *control_name(int control) {
+	switch (control & ~PF) {
+	case SABM:
+		return "SABM";
+	case UA:
+		return "UA";
+	case DM:
+		return "DM";
+	case DISC:
+		return "DISC";
+	case UIH:
+		return "UIH";
+	case UI:
+		return "UI";
+	default:
+		return "?";
+	}
+}
+
+int main(int argc, char *argv[]) {
+	GSM0710_TraceHeader header;
+	GSM0710_TraceRecord r;
+	uint64_t start = 0;
+	char frame[8];
+	unsigned int i;
+	FILE *f;
+
+	if (argc != 2) {
+		fprintf(stderr, "\nUsage: %s <trace-file>\n", argv[0]);
+		return 1;
+	}
+	if (!(f = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1
+			|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != TRACE_VERSION
+			|| header.record_size != sizeof(r)) {
+		fprintf(stderr, "%s: not a trace of this version\n", argv[1]);
+		return 1;
+	}
+	// times are relative to the first record
+	printf("%12s %3s %4s %-6s %6s %s\n", "seconds", "mux", "dlc", "frame",
+			"length", "verdict");
+	for (i = 0; i < header.count && fread(&r, sizeof(r), 1, f) == 1; i++) {
+		if (i == 0)
+			start = r.time;
+		printf("%12.6f %3d ", (r.time - start) / 1e6, r.source);
+		if (r.dlc == TRACE_NO_DLC)
+			printf("%4s %-6s ", "-", "-");
+		else if (r.control == 0)
+			printf("%4d %-6s ", r.dlc, "-");
+		else {
+			snprintf(frame, sizeof(frame), "%s%s", control_name(r.control),
+					(r.control & PF) ? "/P" : "");
+			printf("%4d %-6s ", r.dlc, frame);
+		}
+		printf("%6d %s\n", r.length, gsm0710_trace_verdict(r.verdict));
+	}
+	if (i < header.count)
+		fprintf(stderr, "%s: truncated after %u of %u records\n", argv[1], i,
+				header.count);
+	fclose(f);
+	return 0;
+}